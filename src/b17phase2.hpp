@@ -15,6 +15,7 @@
 #ifndef SRC_CPP_B17PHASE2_HPP_
 #define SRC_CPP_B17PHASE2_HPP_
 
+#include "compressed_disk.hpp"
 #include "disk.hpp"
 #include "entry_sizes.hpp"
 #include "b17sort_manager.hpp"
@@ -25,7 +26,7 @@
 // so that they are sorted by position.
 std::vector<uint64_t> b17RunPhase2(
     uint8_t *memory,
-    std::vector<FileDisk> &tmp_1_disks,
+    std::vector<CompressedDisk> &tmp_1_disks,
     std::vector<uint64_t> table_sizes,
     uint8_t k,
     const uint8_t *id,
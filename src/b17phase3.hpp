@@ -15,6 +15,7 @@
 #ifndef SRC_CPP_B17PHASE3_HPP_
 #define SRC_CPP_B17PHASE3_HPP_
 
+#include "compressed_disk.hpp"
 #include "encoding.hpp"
 #include "entry_sizes.hpp"
 #include "exceptions.hpp"
@@ -50,7 +51,7 @@ b17Phase3Results b17RunPhase3(
     uint8_t *memory,
     uint8_t k,
     FileDisk &tmp2_disk /*filename*/,
-    std::vector<FileDisk> &tmp_1_disks /*plot_filename*/,
+    std::vector<CompressedDisk> &tmp_1_disks /*plot_filename*/,
     std::vector<uint64_t> table_sizes,
     const uint8_t *id,
     const std::string &tmp_dirname,
@@ -31,6 +31,22 @@ struct bitfield
         buffer_[bit / 64] |= uint64_t(1) << (bit % 64);
     }
 
+    // Like set(), but safe to call from several threads at once. Bits that are
+    // already set are only read, so the cache line isn't taken exclusively
+    void set_atomic(int64_t const bit)
+    {
+        assert(bit / 64 < size_);
+        uint64_t* const word = &buffer_[bit / 64];
+        uint64_t const mask = uint64_t(1) << (bit % 64);
+#if defined(_MSC_VER)
+        if ((*reinterpret_cast<uint64_t volatile*>(word) & mask) != 0) return;
+        _InterlockedOr64(reinterpret_cast<__int64 volatile*>(word), __int64(mask));
+#else
+        if ((__atomic_load_n(word, __ATOMIC_RELAXED) & mask) != 0) return;
+        __atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
+#endif
+    }
+
     bool get(int64_t const bit) const
     {
         assert(bit / 64 < size_);
@@ -44,6 +60,9 @@ struct bitfield
 
     int64_t size() const { return size_ * 64; }
 
+    // the bits, 64 at a time. Bit i is bit (i % 64) of word i / 64
+    uint64_t const* words() const { return buffer_.get(); }
+
     void swap(bitfield& rhs)
     {
         using std::swap;
@@ -71,6 +90,39 @@ struct bitfield
         return ret;
     }
 
+    // Returns the index of the first set bit at or after "bit", or size() if
+    // there is none. Runs of cleared bits are skipped a word at a time
+    int64_t find_next_set(int64_t const bit) const
+    {
+        int64_t word = bit / 64;
+        if (word >= size_) return size();
+        uint64_t w = buffer_[word] & (~uint64_t(0) << (bit % 64));
+        while (w == 0) {
+            if (++word == size_) return size();
+            w = buffer_[word];
+        }
+        return word * 64 + Util::CountTrailingZeros(w);
+    }
+
+    // Returns the index of the n-th (counting from 0) set bit at or after
+    // "bit", or size() if there aren't that many. Whole words are skipped
+    // based on their popcount
+    int64_t select(int64_t const bit, int64_t n) const
+    {
+        if (n == 0) return find_next_set(bit);
+        int64_t word = bit / 64;
+        if (word >= size_) return size();
+        uint64_t w = buffer_[word] & (~uint64_t(0) << (bit % 64));
+        int64_t cnt = Util::PopCount(w);
+        while (cnt <= n) {
+            n -= cnt;
+            if (++word == size_) return size();
+            w = buffer_[word];
+            cnt = Util::PopCount(w);
+        }
+        return word * 64 + Util::SelectInWord(w, int(n));
+    }
+
     void free_memory()
     {
         buffer_.reset();
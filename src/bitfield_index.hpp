@@ -15,49 +15,103 @@
 #pragma once
 
 #include <algorithm>
+#include <vector>
 #include "bitfield.hpp"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// A rank index over a bitfield, in the layout of rank9 (Vigna, "Broadword
+// Implementation of Rank/Select Queries"). For every block of kIndexBucket
+// bits there are two interleaved counters: the number of set bits before the
+// block, and the number of set bits before each of the block's words 1-7,
+// packed 9 bits each. A rank is then one counter pair (16 bytes, never split
+// across cache lines), one word of the bitfield and one popcount.
 struct bitfield_index
 {
-    // Cache the number of set bits every kIndexBucket bits.
-    // For a bitfield of size 2^32, this means a 32 MiB index
-    static inline const int64_t kIndexBucket = 1024;
+    // For a bitfield of size 2^32, this means a 128 MiB index
+    static inline const int64_t kIndexBucket = 512;
 
     bitfield_index(bitfield const& b) : bitfield_(b)
     {
-        uint64_t counter = 0;
-        index_.reserve(bitfield_.size() / kIndexBucket);
+        int64_t const num_words = bitfield_.size() / 64;
+        int64_t const num_blocks = (num_words + 7) / 8;
+        uint64_t const* words = bitfield_.words();
+        index_.resize(num_blocks * 2);
 
-        for (int64_t idx = 0; idx < int64_t(bitfield_.size()); idx += kIndexBucket) {
-            index_.push_back(counter);
-            int64_t const left = std::min(int64_t(bitfield_.size()) - idx, kIndexBucket);
-            counter += bitfield_.count(idx, idx + left);
+        uint64_t counter = 0;
+        for (int64_t block = 0; block < num_blocks; ++block) {
+            uint64_t counts[8] = {};
+            int64_t const n = std::min<int64_t>(8, num_words - block * 8);
+            if (n == 8) {
+                BlockPopCounts(words + block * 8, counts);
+            } else {
+                for (int64_t i = 0; i < n; ++i) counts[i] = Util::PopCount(words[block * 8 + i]);
+            }
+
+            uint64_t in_block = 0;
+            uint64_t relative = 0;
+            for (int i = 0; i < 7; ++i) {
+                in_block += counts[i];
+                relative |= in_block << (9 * i);
+            }
+            index_[block * 2] = counter;
+            index_[block * 2 + 1] = relative;
+            counter += in_block + counts[7];
         }
     }
 
-    std::pair<uint64_t, uint64_t> lookup(uint64_t pos, uint64_t offset) const
+    // The number of set bits before "bit"
+    uint64_t rank(uint64_t const bit) const
     {
-        uint64_t const bucket = pos / kIndexBucket;
+        uint64_t const word = bit / 64;
+        uint64_t const* counters = &index_[word / 8 * 2];
+        // word 0 of a block wraps around to 7, which selects bits 63 and up
+        // of the relative counts, i.e. 0
+        uint64_t const t = (word % 8) - 1;
+        uint64_t const relative = (counters[1] >> ((t + (t >> 60 & 8)) * 9 & 63)) & 0x1ff;
+        uint64_t const mask = (uint64_t(1) << (bit % 64)) - 1;
+        return counters[0] + relative + Util::PopCount(bitfield_.words()[word] & mask);
+    }
 
-        assert(bucket < index_.size());
+    std::pair<uint64_t, uint64_t> lookup(uint64_t pos, uint64_t offset) const
+    {
+        assert(pos / kIndexBucket < index_.size() / 2);
         assert(pos < uint64_t(bitfield_.size()));
         assert(pos + offset < uint64_t(bitfield_.size()));
         assert(bitfield_.get(pos) && bitfield_.get(pos + offset));
 
-        uint64_t const base = index_[bucket];
-
-        int64_t const aligned_pos = pos & ~uint64_t(63);
-
-        uint64_t const aligned_pos_count = bitfield_.count(bucket * kIndexBucket, aligned_pos);
-        uint64_t const offset_count = aligned_pos_count + bitfield_.count(aligned_pos, pos + offset);
-        uint64_t const pos_count = aligned_pos_count + bitfield_.count(aligned_pos, pos);
+        uint64_t const pos_count = rank(pos);
+        uint64_t const offset_count = rank(pos + offset);
 
         assert(offset_count >= pos_count);
 
-        return { base + pos_count, offset_count - pos_count };
+        return { pos_count, offset_count - pos_count };
     }
 private:
+    // The popcounts of the 8 words of a block
+    static void BlockPopCounts(uint64_t const* words, uint64_t* counts)
+    {
+#if defined(__AVX2__)
+        // per-nibble popcounts by table lookup, summed up per 64-bit lane
+        __m256i const lut = _mm256_setr_epi8(
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+        __m256i const low_nibbles = _mm256_set1_epi8(0x0f);
+        for (int i = 0; i < 8; i += 4) {
+            __m256i const v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(words + i));
+            __m256i const lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low_nibbles));
+            __m256i const hi = _mm256_shuffle_epi8(
+                lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_nibbles));
+            __m256i const sums = _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(counts + i), sums);
+        }
+#else
+        for (int i = 0; i < 8; ++i) counts[i] = Util::PopCount(words[i]);
+#endif
+    }
+
     bitfield const& bitfield_;
     std::vector<uint64_t> index_;
 };
-
@@ -554,4 +554,61 @@ using Bits = BitsGeneric<SmallVector>;
 using ParkBits = BitsGeneric<ParkVector>;
 using LargeBits = BitsGeneric<LargeVector>;
 
+// Packs values of up to 64 bits straight into a byte buffer, most significant
+// bit first. The bytes are the same as those of Bits::ToBytes() of all the
+// values appended together, but nothing is kept besides one pending word,
+// which is stored 8 bytes at a time once it's full. Exactly
+// cdiv(bits written, 8) bytes of the buffer are written, after Finish()
+class BitWriter {
+public:
+    explicit BitWriter(uint8_t* out) : out_(out) {}
+
+    // Appends the low "bits" bits of value
+    void Append(uint64_t value, uint8_t const bits)
+    {
+        if (bits == 0) return;
+        if (bits < 64) value &= (uint64_t(1) << bits) - 1;
+        total_bits_ += bits;
+        int const free = 64 - used_;
+        if (bits < free) {
+            word_ |= value << (free - bits);
+            used_ += bits;
+            return;
+        }
+        // fill up the word with the top of value, the rest starts the next one
+        int const rest = bits - free;
+        word_ |= value >> rest;
+        Util::IntToEightBytes(out_, word_);
+        out_ += 8;
+        word_ = rest == 0 ? 0 : value << (64 - rest);
+        used_ = rest;
+    }
+
+    // Appends "n" values of "bits" bits each
+    void AppendAll(uint64_t const* values, size_t const n, uint8_t const bits)
+    {
+        for (size_t i = 0; i < n; ++i) Append(values[i], bits);
+    }
+
+    // Writes the bytes of the last, partial, word
+    void Finish()
+    {
+        uint8_t bytes[8];
+        Util::IntToEightBytes(bytes, word_);
+        memcpy(out_, bytes, cdiv(used_, 8));
+        out_ += cdiv(used_, 8);
+        word_ = 0;
+        used_ = 0;
+    }
+
+    uint64_t GetSize() const { return total_bits_; }
+
+private:
+    uint8_t* out_;
+    // the pending bits, at the top of the word
+    uint64_t word_ = 0;
+    int used_ = 0;
+    uint64_t total_bits_ = 0;
+};
+
 #endif  // SRC_CPP_BITS_HPP_
@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <chrono>
 #include <ctime>
 #include <set>
 
@@ -99,6 +100,16 @@ int main(int argc, char *argv[]) try {
     bool nobitfield = false;        // 关闭bitfield(、位字段、字节牧场)
     bool show_progress = false;     // 显示进度
     uint32_t buffmegabytes = 0;     // 基础什么什么字节数
+    uint32_t rammegabytes = 0;      // 可放在内存中的临时文件大小
+    bool iostats = false;           // 绘图结束后输出I/O统计
+    bool mmap_reads = false;        // 通过内存映射读取排序桶和临时表
+    bool compress_tmp = false;      // 压缩临时表文件
+    bool stream_final = false;      // 直接写入最终目录
+    uint8_t copy_threads = 0;       // 复制最终文件的并发数
+    uint32_t copy_limit = 0;        // 复制最终文件的带宽上限(MiB/s)
+    vector<string> placement;       // 按类别指定临时文件目录
+    bool interleaved_parks = false; // 交错多路ANS编码的park格式
+    string iolog;                   // I/O日志文件
 
     options.allow_unrecognised_options().add_options()(
         // k，大小，Plot文件的大小
@@ -129,6 +140,40 @@ int main(int argc, char *argv[]) try {
         // p, 进度，在绘图时显示进度百分比
         "p, progress", "Display progress percentage during plotting",
         cxxopts::value<bool>(show_progress))(
+        // ram, 临时文件(表1、表2和排序桶)可以使用的内存大小，超出部分写入临时目录
+        "ram", "Megabytes of temp files (tables 1-2, sort buckets) to keep in RAM",
+        cxxopts::value<uint32_t>(rammegabytes))(
+        // compress-tmp, 压缩第一阶段写入的表2-7临时文件，减少临时空间和I/O
+        "compress-tmp", "Compress temp tables 2-7 (requires bitfield)",
+        cxxopts::value<bool>(compress_tmp))(
+        // stream-final, 第三、四阶段直接写入最终目录，完成后重命名，不再从备用临时目录复制
+        "stream-final", "Write the plot directly into the final directory (no tempdir2 copy)",
+        cxxopts::value<bool>(stream_final))(
+        // copy-threads, 从备用临时目录复制最终文件时同时复制的块数
+        "copy-threads", "Number of chunks copied concurrently to the final directory",
+        cxxopts::value<uint8_t>(copy_threads))(
+        // copy-limit, 复制最终文件的带宽上限，避免影响下一个Plot的临时文件读写
+        "copy-limit", "Bandwidth limit of the copy to the final directory, in MiB/s",
+        cxxopts::value<uint32_t>(copy_limit))(
+        // place, 按文件类别指定临时目录，例如 --place buckets=/mnt/nvme --place table1=/mnt/ssd
+        // 类别：buckets, p3buckets, table1, tables, table7, tmp2
+        "place",
+        "Directory for a class of temp files, <class>=<dir>. Classes: buckets, p3buckets, table1, "
+        "tables, table7, tmp2",
+        cxxopts::value<vector<string>>(placement))(
+        // interleaved-parks, park的deltas分为多路交错的ANS流，解码更快，查找延迟更低，文件略大
+        "interleaved-parks",
+        "Plot format " + kFormatDescriptionInterleaved +
+            ": faster lookups, slightly larger plots (requires bitfield)",
+        cxxopts::value<bool>(interleaved_parks))(
+        // iostats, 统计每个文件、每个阶段的读写量和延迟，绘图结束后输出
+        "iostats", "Print per-file and per-phase I/O statistics at the end of plotting",
+        cxxopts::value<bool>(iostats))(
+        // mmap, 通过mmap直接从页缓存读取排序桶和临时表，不经过中间缓冲区
+        "mmap", "Read sort buckets and temp tables through memory mappings",
+        cxxopts::value<bool>(mmap_reads))(
+        // iolog, 记录每一次读写到日志文件(用tools/parse_disk.py和tools/disk.gnuplot分析)
+        "iolog", "Log every disk operation to this file", cxxopts::value<string>(iolog))(
         // help, 输出帮助信息
         "help", "Print help");
 
@@ -167,6 +212,16 @@ int main(int argc, char *argv[]) try {
         HexToBytes(memo, memo_bytes.data());
         HexToBytes(id, id_bytes.data());
 
+        if (iostats) {
+            DiskTrace::EnableStats();
+        }
+        if (!iolog.empty()) {
+            DiskTrace::EnableLog(iolog);
+        }
+        if (mmap_reads) {
+            MappedFile::Enable();
+        }
+
         DiskPlotter plotter = DiskPlotter();
         plotter.CreatePlotDisk(
                 tempdir,
@@ -183,7 +238,14 @@ int main(int argc, char *argv[]) try {
                 num_stripes,
                 num_threads,
                 nobitfield,
-                show_progress);
+                show_progress,
+                rammegabytes,
+                compress_tmp,
+                stream_final,
+                copy_threads,
+                copy_limit,
+                placement,
+                interleaved_parks);
     } else if (operation == "prove") {
         if (argc < 3) {
             HelpAndQuit(options);
@@ -275,6 +337,13 @@ int main(int argc, char *argv[]) try {
         prover.GetId(id_bytes);
         k = prover.GetSize();
 
+        // 查找延迟统计：每次质量查找、每个完整证明的平均耗时
+        // Lookup latency: the average time of a quality lookup and of a full proof
+        using lookup_clock = std::chrono::steady_clock;
+        lookup_clock::duration quality_time{};
+        lookup_clock::duration proof_time{};
+        uint32_t num_proofs = 0;
+
         for (uint32_t num = 0; num < iterations; num++) {
             vector<unsigned char> hash_input = intToBytes(num, 4);
             hash_input.insert(hash_input.end(), &id_bytes[0], &id_bytes[32]);
@@ -283,10 +352,15 @@ int main(int argc, char *argv[]) try {
             picosha2::hash256(hash_input.begin(), hash_input.end(), hash.begin(), hash.end());
 
             try {
+                auto const quality_start = lookup_clock::now();
                 vector<LargeBits> qualities = prover.GetQualitiesForChallenge(hash.data());
+                quality_time += lookup_clock::now() - quality_start;
 
                 for (uint32_t i = 0; i < qualities.size(); i++) {
+                    auto const proof_start = lookup_clock::now();
                     LargeBits proof = prover.GetFullProof(hash.data(), i);
+                    proof_time += lookup_clock::now() - proof_start;
+                    num_proofs++;
                     uint8_t *proof_data = new uint8_t[proof.GetSize() / 8];
                     proof.ToBytes(proof_data);
                     cout << "i: " << num << std::endl;
@@ -310,6 +384,11 @@ int main(int argc, char *argv[]) try {
         }
         std::cout << "Total success: " << success << "/" << iterations << ", "
                   << (success * 100 / static_cast<double>(iterations)) << "%." << std::endl;
+        auto to_us = [](lookup_clock::duration const d, uint32_t const n) {
+            return n == 0 ? 0.0 : std::chrono::duration<double, std::micro>(d).count() / n;
+        };
+        std::cout << "Average quality lookup: " << to_us(quality_time, iterations)
+                  << " us, full proof: " << to_us(proof_time, num_proofs) << " us" << std::endl;
         if (show_progress) { progress(4, 1, 1); }
     } else {
         cout << "Invalid operation. Use create/prove/verify/check" << endl;
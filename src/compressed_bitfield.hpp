@@ -0,0 +1,363 @@
+// Copyright 2020 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "bitfield.hpp"
+
+// A bitfield split into chunks of kChunkBits bits, in the style of roaring
+// bitmaps. Each chunk is stored in whichever form is smallest:
+//
+// * array:    the sorted offsets of the set bits
+// * inverted: the sorted offsets of the cleared bits
+// * bitmap:   the plain bits
+//
+// Empty chunks take no memory beyond their header, and chunks that are
+// almost empty or almost full take 2 bytes per exception. Chunks are
+// converted to bitmaps as they fill up, and back to arrays by optimize().
+//
+// It has the same interface as bitfield, as far as phase 2 uses it. set_atomic()
+// locks the chunk, so bits can be set from several threads at once. count()
+// looks up the bits before each chunk, which optimize() sums up, until bits
+// are set again.
+struct compressed_bitfield
+{
+    static inline const int64_t kChunkBits = 65536;
+    // A chunk with more exceptions than this is cheaper to store as a bitmap
+    static inline const size_t kMaxArraySize = kChunkBits / 16;
+
+    explicit compressed_bitfield(int64_t size)
+        : size_((size + 63) / 64 * 64)
+        , chunks_((size_ + kChunkBits - 1) / kChunkBits)
+        , locks_(new std::mutex[kNumLocks])
+    {
+    }
+
+    // Forces phase 2 to use compressed bitfields, regardless of k and memory.
+    // Mostly for tests
+    static std::atomic<bool>& ForcedFlag()
+    {
+        static std::atomic<bool> forced{false};
+        return forced;
+    }
+    static bool Forced() { return ForcedFlag().load(std::memory_order_relaxed); }
+    static void Force(bool const force = true) { ForcedFlag() = force; }
+
+    void set(int64_t const bit)
+    {
+        assert(bit < size_);
+        invalidate_counts();
+        chunks_[bit / kChunkBits].set(bit % kChunkBits);
+    }
+
+    void set_atomic(int64_t const bit)
+    {
+        assert(bit < size_);
+        invalidate_counts();
+        std::lock_guard<std::mutex> l(locks_[(bit / kChunkBits) % kNumLocks]);
+        chunks_[bit / kChunkBits].set(bit % kChunkBits);
+    }
+
+    bool get(int64_t const bit) const
+    {
+        assert(bit < size_);
+        return chunks_[bit / kChunkBits].get(bit % kChunkBits);
+    }
+
+    void clear()
+    {
+        for (chunk_t& c : chunks_) c = chunk_t();
+        invalidate_counts();
+    }
+
+    int64_t size() const { return size_; }
+
+    void swap(compressed_bitfield& rhs)
+    {
+        using std::swap;
+        swap(size_, rhs.size_);
+        swap(chunks_, rhs.chunks_);
+        swap(chunk_counts_, rhs.chunk_counts_);
+        bool const valid = counts_valid_.exchange(rhs.counts_valid_.load());
+        rhs.counts_valid_.store(valid);
+    }
+
+    int64_t count(int64_t const start_bit, int64_t const end_bit) const
+    {
+        assert(start_bit <= end_bit);
+        return prefix_count(end_bit) - prefix_count(start_bit);
+    }
+
+    // Stores every chunk in its smallest form, and sums up the bits before
+    // each chunk. Call it once all bits are set
+    void optimize()
+    {
+        for (int64_t i = 0; i < int64_t(chunks_.size()); ++i) chunks_[i].optimize(chunk_size(i));
+        chunk_counts_.resize(chunks_.size() + 1);
+        chunk_counts_[0] = 0;
+        for (size_t i = 0; i < chunks_.size(); ++i) {
+            chunk_counts_[i + 1] = chunk_counts_[i] + chunks_[i].cardinality;
+        }
+        counts_valid_ = true;
+    }
+
+    // The number of bytes held by the chunks
+    uint64_t memory_usage() const
+    {
+        uint64_t ret = chunks_.size() * sizeof(chunk_t);
+        for (chunk_t const& c : chunks_) {
+            ret += c.bits ? kChunkBits / 8 : c.values.capacity() * sizeof(uint16_t);
+        }
+        return ret;
+    }
+
+    // Estimates memory_usage() after optimize(), for "size" bits of which at
+    // most "max_set" are set, spread evenly. Only chunks with few bits set
+    // are smaller than bitmaps, the estimate doesn't count on nearly full ones
+    static uint64_t EstimateMemoryUsage(int64_t const size, int64_t const max_set)
+    {
+        int64_t const num_chunks = (size + kChunkBits - 1) / kChunkBits;
+        if (num_chunks == 0) return 0;
+        uint64_t const per_chunk = (std::min(max_set, size) + num_chunks - 1) / num_chunks;
+        uint64_t const chunk_bytes =
+            per_chunk <= kMaxArraySize ? per_chunk * sizeof(uint16_t) : kChunkBits / 8;
+        return num_chunks * (sizeof(chunk_t) + chunk_bytes);
+    }
+
+    // A plain bitfield of "size" bits with the same bits set
+    bitfield to_bitfield(int64_t const size) const
+    {
+        bitfield ret(size);
+        for (int64_t i = 0; i < int64_t(chunks_.size()); ++i) {
+            int64_t const base = i * kChunkBits;
+            int64_t const end = std::min(chunk_size(i), size - base);
+            for (int64_t bit = 0; bit < end; ++bit) {
+                if (chunks_[i].get(bit)) ret.set(base + bit);
+            }
+        }
+        return ret;
+    }
+
+    void free_memory()
+    {
+        chunks_.clear();
+        chunks_.shrink_to_fit();
+        chunk_counts_.clear();
+        chunk_counts_.shrink_to_fit();
+        counts_valid_ = false;
+        size_ = 0;
+    }
+
+private:
+    friend struct compressed_bitfield_index;
+
+    // chunks share locks, the number of chunks doesn't matter for contention
+    static inline const int kNumLocks = 1024;
+
+    struct chunk_t {
+        enum kind_t : uint8_t { array, inverted, bitmap };
+
+        kind_t kind = array;
+        uint32_t cardinality = 0;
+        // the offsets of the set bits (array) or of the cleared bits (inverted)
+        std::vector<uint16_t> values;
+        std::unique_ptr<uint64_t[]> bits;
+
+        bool get(int64_t const bit) const
+        {
+            switch (kind) {
+                case array: return std::binary_search(values.begin(), values.end(), bit);
+                case inverted: return !std::binary_search(values.begin(), values.end(), bit);
+                default: return (bits[bit / 64] & (uint64_t(1) << (bit % 64))) != 0;
+            }
+        }
+
+        void set(int64_t const bit)
+        {
+            if (kind == bitmap) {
+                uint64_t const mask = uint64_t(1) << (bit % 64);
+                if ((bits[bit / 64] & mask) != 0) return;
+                bits[bit / 64] |= mask;
+                ++cardinality;
+                return;
+            }
+            auto const it = std::lower_bound(values.begin(), values.end(), bit);
+            bool const found = it != values.end() && *it == bit;
+            if (kind == inverted) {
+                if (!found) return;
+                values.erase(it);
+                ++cardinality;
+                return;
+            }
+            if (found) return;
+            if (values.size() == kMaxArraySize) {
+                to_bitmap();
+                return set(bit);
+            }
+            values.insert(it, uint16_t(bit));
+            ++cardinality;
+        }
+
+        // The number of set bits before "bit"
+        int64_t prefix_count(int64_t const bit) const
+        {
+            if (kind == bitmap) {
+                int64_t ret = 0;
+                for (int64_t w = 0; w < bit / 64; ++w) ret += Util::PopCount(bits[w]);
+                if (bit % 64 != 0) {
+                    ret += Util::PopCount(bits[bit / 64] & ((uint64_t(1) << (bit % 64)) - 1));
+                }
+                return ret;
+            }
+            int64_t const below =
+                std::lower_bound(values.begin(), values.end(), bit) - values.begin();
+            return kind == array ? below : bit - below;
+        }
+
+        // only array chunks grow into bitmaps, inverted ones only shrink
+        void to_bitmap()
+        {
+            bits.reset(new uint64_t[kChunkBits / 64]());
+            for (uint16_t const v : values) bits[v / 64] |= uint64_t(1) << (v % 64);
+            values = std::vector<uint16_t>();
+            kind = bitmap;
+        }
+
+        void optimize(int64_t const num_bits)
+        {
+            if (kind != bitmap) {
+                values.shrink_to_fit();
+                return;
+            }
+            int64_t const cleared = num_bits - cardinality;
+            if (cardinality > kMaxArraySize && cleared > int64_t(kMaxArraySize)) return;
+            bool const set_bits = cardinality <= kMaxArraySize;
+            std::vector<uint16_t> v;
+            v.reserve(set_bits ? cardinality : cleared);
+            for (int64_t bit = 0; bit < num_bits; ++bit) {
+                bool const is_set = (bits[bit / 64] & (uint64_t(1) << (bit % 64))) != 0;
+                if (is_set == set_bits) v.push_back(uint16_t(bit));
+            }
+            values = std::move(v);
+            bits.reset();
+            kind = set_bits ? array : inverted;
+        }
+    };
+
+    // the number of bits in chunk "i", only the last one can be shorter
+    int64_t chunk_size(int64_t const i) const
+    {
+        return std::min(kChunkBits, size_ - i * kChunkBits);
+    }
+
+    void invalidate_counts()
+    {
+        // a load first: once the counts are invalid, the threads setting
+        // bits only read the flag
+        if (counts_valid_.load(std::memory_order_relaxed)) {
+            counts_valid_.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    int64_t prefix_count(int64_t const bit) const
+    {
+        int64_t const chunk = bit / kChunkBits;
+        int64_t ret = 0;
+        if (counts_valid_.load(std::memory_order_relaxed)) {
+            ret = chunk_counts_[chunk];
+        } else {
+            for (int64_t i = 0; i < chunk; ++i) ret += chunks_[i].cardinality;
+        }
+        if (bit % kChunkBits != 0) ret += chunks_[chunk].prefix_count(bit % kChunkBits);
+        return ret;
+    }
+
+    // number of bits, a multiple of 64 like bitfield
+    int64_t size_;
+    std::vector<chunk_t> chunks_;
+    // the number of set bits before each chunk (and after the last one), if
+    // counts_valid_
+    std::vector<uint64_t> chunk_counts_;
+    std::atomic<bool> counts_valid_{false};
+    std::unique_ptr<std::mutex[]> locks_;
+};
+
+// The rank index of a compressed_bitfield, with the interface of
+// bitfield_index. It keeps the number of set bits before each chunk and,
+// for chunks stored as bitmaps, before each 512 bits of the chunk. Array
+// chunks are searched.
+struct compressed_bitfield_index
+{
+    static inline const int64_t kBlockBits = 512;
+
+    compressed_bitfield_index(compressed_bitfield const& b) : bitfield_(b)
+    {
+        chunk_counts_.reserve(b.chunks_.size());
+        blocks_.resize(b.chunks_.size());
+        uint64_t counter = 0;
+        for (size_t i = 0; i < b.chunks_.size(); ++i) {
+            auto const& c = b.chunks_[i];
+            chunk_counts_.push_back(counter);
+            counter += c.cardinality;
+            if (!c.bits) continue;
+            std::vector<uint16_t>& blocks = blocks_[i];
+            blocks.resize(compressed_bitfield::kChunkBits / kBlockBits);
+            uint16_t in_chunk = 0;
+            for (size_t block = 0; block < blocks.size(); ++block) {
+                blocks[block] = in_chunk;
+                for (int w = 0; w < kBlockBits / 64; ++w) {
+                    in_chunk += Util::PopCount(c.bits[block * kBlockBits / 64 + w]);
+                }
+            }
+        }
+    }
+
+    // The number of set bits before "bit"
+    uint64_t rank(uint64_t const bit) const
+    {
+        uint64_t const chunk = bit / compressed_bitfield::kChunkBits;
+        uint64_t const offset = bit % compressed_bitfield::kChunkBits;
+        auto const& c = bitfield_.chunks_[chunk];
+        if (!c.bits) return chunk_counts_[chunk] + c.prefix_count(offset);
+
+        uint64_t ret = chunk_counts_[chunk] + blocks_[chunk][offset / kBlockBits];
+        for (uint64_t w = offset / kBlockBits * (kBlockBits / 64); w < offset / 64; ++w) {
+            ret += Util::PopCount(c.bits[w]);
+        }
+        uint64_t const mask = (uint64_t(1) << (offset % 64)) - 1;
+        return ret + Util::PopCount(c.bits[offset / 64] & mask);
+    }
+
+    std::pair<uint64_t, uint64_t> lookup(uint64_t pos, uint64_t offset) const
+    {
+        assert(pos + offset < uint64_t(bitfield_.size()));
+        assert(bitfield_.get(pos) && bitfield_.get(pos + offset));
+
+        uint64_t const pos_count = rank(pos);
+        uint64_t const offset_count = rank(pos + offset);
+        return { pos_count, offset_count - pos_count };
+    }
+
+private:
+    compressed_bitfield const& bitfield_;
+    std::vector<uint64_t> chunk_counts_;
+    // per chunk, empty for chunks that aren't bitmaps
+    std::vector<std::vector<uint16_t>> blocks_;
+};
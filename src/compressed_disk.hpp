@@ -0,0 +1,352 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_COMPRESSED_DISK_HPP_
+#define SRC_CPP_COMPRESSED_DISK_HPP_
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../lib/FiniteStateEntropy/lib/fse.h"
+#include "disk.hpp"
+#include "exceptions.hpp"
+#include "util.hpp"
+
+// A temp file holding fixed size entries, optionally compressed. The file is
+// split into blocks of kBlockEntries entries, each compressed on its own:
+//
+// * every entry is replaced by its difference to the previous one (as a
+//   big-endian integer), so runs of increasing positions turn into small
+//   numbers.
+// * the differences are split into byte planes (byte 0 of every entry, then
+//   byte 1, ...), and each plane is FSE compressed, stored as-is if that
+//   doesn't help, or as a single byte if the whole plane is the same.
+//
+// An in-memory index of where each block is stored makes the file seekable:
+// forward scans decode each block once, and backward reads just decode an
+// earlier block. Blocks can be rewritten, they're stored in place if they
+// still fit, otherwise they're appended to the underlying file.
+//
+// With an entry_size of 0, nothing is compressed and all calls go straight to
+// the underlying file.
+struct CompressedDisk : RandomAccessDisk {
+    static constexpr uint32_t kBlockEntries = 32768;
+
+    explicit CompressedDisk(HybridDisk storage, uint16_t const entry_size = 0)
+        : storage_(std::move(storage))
+        , entry_size_(entry_size)
+        , block_size_(uint64_t(entry_size) * kBlockEntries)
+    {
+    }
+
+    CompressedDisk(CompressedDisk &&) = default;
+
+    CompressedDisk(const CompressedDisk &) = delete;
+    CompressedDisk &operator=(const CompressedDisk &) = delete;
+
+    void Read(uint64_t begin, uint8_t *memcache, uint64_t length) override
+    {
+        if (entry_size_ == 0) return storage_.Read(begin, memcache, length);
+        while (length > 0) {
+            uint64_t const offset = begin % block_size_;
+            uint64_t const n = std::min(length, block_size_ - offset);
+            ::memcpy(memcache, ReadBlock(begin / block_size_) + offset, n);
+            memcache += n;
+            begin += n;
+            length -= n;
+        }
+    }
+
+    void Write(uint64_t begin, const uint8_t *memcache, uint64_t length) override
+    {
+        size_ = std::max(size_, begin + length);
+        if (entry_size_ == 0) return storage_.Write(begin, memcache, length);
+        while (length > 0) {
+            uint64_t const offset = begin % block_size_;
+            uint64_t const n = std::min(length, block_size_ - offset);
+            ::memcpy(WriteBlock(begin / block_size_) + offset, memcache, n);
+            memcache += n;
+            begin += n;
+            length -= n;
+        }
+    }
+
+    void Truncate(uint64_t const new_size) override
+    {
+        if (entry_size_ == 0) {
+            size_ = new_size;
+            return storage_.Truncate(new_size);
+        }
+        FlushWriteBlock();
+        read_index_ = kNoBlock;
+        write_index_ = kNoBlock;
+
+        uint64_t const tail = new_size % block_size_;
+        uint64_t const last = new_size / block_size_;
+        if (tail != 0 && last < index_.size() && size_ > new_size) {
+            // the last block is cut in half, re-encode what's left of it
+            size_ = new_size;
+            uint8_t *const buf = WriteBlock(last);
+            ::memset(buf + tail, 0, block_size_ - tail);
+            FlushWriteBlock();
+            write_index_ = kNoBlock;
+        }
+        size_ = new_size;
+        index_.resize(std::min<uint64_t>(index_.size(), cdiv(new_size, int(block_size_))));
+
+        storage_end_ = 0;
+        for (block_t const &b : index_) {
+            storage_end_ = std::max(storage_end_, b.offset + b.capacity);
+        }
+        storage_.Truncate(storage_end_);
+        if (new_size == 0) FreeMemory();
+    }
+
+    std::string GetFileName() override { return storage_.GetFileName(); }
+
+    void Close() override
+    {
+        FlushWriteBlock();
+        storage_.Close();
+    }
+
+    // Compressed files are decoded block by block, they can't be mapped
+    bool Map(
+        uint64_t const begin,
+        uint64_t const length,
+        MappedFile &mapping,
+        MappedFile::advice_t const advice) override
+    {
+        if (entry_size_ != 0) return false;
+        return storage_.Map(begin, length, mapping, advice);
+    }
+
+    // Compressed sizes aren't known up-front, the hint is only used for
+    // uncompressed files
+    void Preallocate(uint64_t const size)
+    {
+        if (entry_size_ == 0) storage_.Preallocate(size);
+    }
+
+    // The size of the file, and the number of bytes it takes on the underlying
+    // storage
+    uint64_t GetSize() const noexcept { return size_; }
+    uint64_t GetStoredSize() const noexcept { return entry_size_ == 0 ? size_ : storage_end_; }
+
+    void FreeMemory()
+    {
+        FlushWriteBlock();
+        read_index_ = kNoBlock;
+        write_index_ = kNoBlock;
+        read_buf_.reset();
+        write_buf_.reset();
+        planes_.reset();
+        encoded_.reset();
+    }
+
+private:
+    struct block_t {
+        // where the block is stored in the underlying file
+        uint64_t offset;
+        // the number of bytes it's stored in, and the number of bytes reserved
+        // for it. A block that grows beyond its capacity is moved to the end
+        uint32_t stored_size;
+        uint32_t capacity;
+        // the number of (uncompressed) bytes it holds
+        uint32_t length;
+    };
+
+    static constexpr uint64_t kNoBlock = std::numeric_limits<uint64_t>::max();
+
+    uint8_t *ReadBlock(uint64_t const block)
+    {
+        if (block == write_index_) return write_buf_.get();
+        if (block != read_index_) {
+            NeedBuffer(read_buf_);
+            Decode(block, read_buf_.get());
+            read_index_ = block;
+        }
+        return read_buf_.get();
+    }
+
+    uint8_t *WriteBlock(uint64_t const block)
+    {
+        if (block != write_index_) {
+            FlushWriteBlock();
+            NeedBuffer(write_buf_);
+            if (block == read_index_) {
+                // it's already decoded
+                std::swap(read_buf_, write_buf_);
+                read_index_ = kNoBlock;
+            } else {
+                Decode(block, write_buf_.get());
+            }
+            write_index_ = block;
+        }
+        dirty_ = true;
+        return write_buf_.get();
+    }
+
+    void FlushWriteBlock()
+    {
+        if (!dirty_) return;
+        dirty_ = false;
+        uint64_t const block = write_index_;
+        uint64_t const length = std::min(block_size_, size_ - block * block_size_);
+        uint64_t const stored_size = Encode(write_buf_.get(), length);
+
+        if (index_.size() <= block) index_.resize(block + 1, block_t{0, 0, 0, 0});
+        block_t &b = index_[block];
+        if (stored_size > b.capacity) {
+            b.offset = storage_end_;
+            b.capacity = stored_size;
+            storage_end_ += stored_size;
+        }
+        b.stored_size = stored_size;
+        b.length = length;
+        storage_.Write(b.offset, encoded_.get(), stored_size);
+    }
+
+    void NeedBuffer(std::unique_ptr<uint8_t[]> &buf)
+    {
+        // all allocations need 7 bytes head-room, since
+        // SliceInt64FromBytes() may overrun by 7 bytes
+        if (!buf) buf.reset(new uint8_t[block_size_ + 7]);
+    }
+
+    // Encodes "length" bytes of "buf" into encoded_, returns the encoded size
+    uint64_t Encode(uint8_t const *buf, uint64_t const length)
+    {
+        uint64_t const num_entries = length / entry_size_;
+        uint64_t const tail = length % entry_size_;
+        if (!planes_) planes_.reset(new uint8_t[block_size_]);
+        uint64_t const plane_bound = FSE_compressBound(kBlockEntries) + 5;
+        if (!encoded_) encoded_.reset(new uint8_t[plane_bound * entry_size_ + entry_size_]);
+
+        // difference to the previous entry, big-endian, with borrow
+        uint8_t const *prev = nullptr;
+        for (uint64_t i = 0; i < num_entries; ++i) {
+            uint8_t const *entry = buf + i * entry_size_;
+            int borrow = 0;
+            for (int j = entry_size_ - 1; j >= 0; --j) {
+                int const d = int(entry[j]) - (prev ? prev[j] : 0) - borrow;
+                borrow = d < 0;
+                planes_[j * num_entries + i] = uint8_t(d);
+            }
+            prev = entry;
+        }
+
+        uint8_t *out = encoded_.get();
+        for (int j = 0; j < entry_size_ && num_entries > 0; ++j) {
+            uint8_t const *plane = planes_.get() + j * num_entries;
+            size_t const r = FSE_compress(out + 5, plane_bound - 5, plane, num_entries);
+            if (FSE_isError(r) || r == 0) {
+                *out++ = kRawPlane;
+                ::memcpy(out, plane, num_entries);
+                out += num_entries;
+            } else if (r == 1) {
+                *out++ = kRlePlane;
+                *out++ = plane[0];
+            } else {
+                out[0] = kFsePlane;
+                Util::IntToFourBytes(out + 1, r);
+                out += 5 + r;
+            }
+        }
+        ::memcpy(out, buf + num_entries * entry_size_, tail);
+        out += tail;
+        return out - encoded_.get();
+    }
+
+    void Decode(uint64_t const block, uint8_t *buf)
+    {
+        if (block >= index_.size() || index_[block].length == 0) {
+            // never written, reads as zeros, just like a file would
+            ::memset(buf, 0, block_size_);
+            return;
+        }
+        block_t const &b = index_[block];
+        if (!encoded_) {
+            encoded_.reset(
+                new uint8_t[(FSE_compressBound(kBlockEntries) + 5) * entry_size_ + entry_size_]);
+        }
+        if (!planes_) planes_.reset(new uint8_t[block_size_]);
+        storage_.Read(b.offset, encoded_.get(), b.stored_size);
+
+        uint64_t const num_entries = b.length / entry_size_;
+        uint64_t const tail = b.length % entry_size_;
+        uint8_t const *in = encoded_.get();
+        for (int j = 0; j < entry_size_ && num_entries > 0; ++j) {
+            uint8_t *plane = planes_.get() + j * num_entries;
+            uint8_t const mode = *in++;
+            if (mode == kRawPlane) {
+                ::memcpy(plane, in, num_entries);
+                in += num_entries;
+            } else if (mode == kRlePlane) {
+                ::memset(plane, *in++, num_entries);
+            } else {
+                uint32_t const size = Util::FourBytesToInt(in);
+                size_t const r = FSE_decompress(plane, num_entries, in + 4, size);
+                if (FSE_isError(r) || r != num_entries) {
+                    throw InvalidStateException(
+                        "Corrupt block " + std::to_string(block) + " in " + GetFileName());
+                }
+                in += 4 + size;
+            }
+        }
+
+        // undo the differences, big-endian, with carry
+        uint8_t const *prev = nullptr;
+        for (uint64_t i = 0; i < num_entries; ++i) {
+            uint8_t *entry = buf + i * entry_size_;
+            int carry = 0;
+            for (int j = entry_size_ - 1; j >= 0; --j) {
+                int const s = int(planes_[j * num_entries + i]) + (prev ? prev[j] : 0) + carry;
+                carry = s > 0xff;
+                entry[j] = uint8_t(s);
+            }
+            prev = entry;
+        }
+        ::memcpy(buf + num_entries * entry_size_, in, tail);
+        ::memset(buf + b.length, 0, block_size_ - b.length);
+    }
+
+    static constexpr uint8_t kRawPlane = 0;
+    static constexpr uint8_t kRlePlane = 1;
+    static constexpr uint8_t kFsePlane = 2;
+
+    HybridDisk storage_;
+    uint16_t entry_size_;
+    uint64_t block_size_;
+
+    // the logical size of the file, and the end of the underlying file
+    uint64_t size_ = 0;
+    uint64_t storage_end_ = 0;
+    std::vector<block_t> index_;
+
+    // the last block read, and the block being written (which is only encoded
+    // once we move on to another block)
+    uint64_t read_index_ = kNoBlock;
+    std::unique_ptr<uint8_t[]> read_buf_;
+    uint64_t write_index_ = kNoBlock;
+    std::unique_ptr<uint8_t[]> write_buf_;
+    bool dirty_ = false;
+
+    std::unique_ptr<uint8_t[]> planes_;
+    std::unique_ptr<uint8_t[]> encoded_;
+};
+
+#endif  // SRC_CPP_COMPRESSED_DISK_HPP_
@@ -16,24 +16,36 @@
 #define SRC_CPP_DISK_HPP_
 
 #include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <string>
 #include <vector>
 #include <thread>
 #include <chrono>
 
-// enables disk I/O logging to disk.log
-// use tools/disk.gnuplot to generate a plot
-#define ENABLE_LOGGING 0
-
 using namespace std::chrono_literals; // for operator""min;
 
 #include "chia_filesystem.hpp"
 
+#ifdef _WIN32
+#include <io.h>
+#include <sys/stat.h>
+#include <mutex>
+#endif
+#include <fcntl.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
 #include "./bits.hpp"
 #include "./util.hpp"
 #include "bitfield.hpp"
+#include "disk_trace.hpp"
+#include "exceptions.hpp"
+#include "mapped_file.hpp"
+#include "tmp_placement.hpp"
 
 constexpr uint64_t write_cache = 1024 * 1024;
 constexpr uint64_t read_ahead = 1024 * 1024;
@@ -47,76 +59,55 @@ struct Disk {
     virtual ~Disk() = default;
 };
 
-#if ENABLE_LOGGING
-// logging is currently unix / bsd only: use <fstream> or update
-// calls to ::open and ::write to port to windows
-#include <fcntl.h>
-#include <unistd.h>
-#include <mutex>
-#include <unordered_map>
-#include <cinttypes>
-
-enum class op_t : int { read, write};
-
-void disk_log(fs::path const& filename, op_t const op, uint64_t offset, uint64_t length)
-{
-    static std::mutex m;
-    static std::unordered_map<std::string, int> file_index;
-    static auto const start_time = std::chrono::steady_clock::now();
-    static int next_file = 0;
-
-    auto const timestamp = std::chrono::steady_clock::now() - start_time;
-
-    int fd = ::open("disk.log", O_WRONLY | O_CREAT | O_APPEND, 0755);
-
-    std::unique_lock<std::mutex> l(m);
-
-    char buffer[512];
-
-    int const index = [&] {
-        auto it = file_index.find(filename.string());
-        if (it != file_index.end()) return it->second;
-        file_index[filename.string()] = next_file;
-
-        int const len = std::snprintf(buffer, sizeof(buffer)
-            , "# %d %s\n", next_file, filename.string().c_str());
-        ::write(fd, buffer, len);
-        return next_file++;
-    }();
-
-    // timestamp (ms), start-offset, end-offset, operation (0 = read, 1 = write), file_index
-    int const len = std::snprintf(buffer, sizeof(buffer)
-        , "%" PRId64 "\t%" PRIu64 "\t%" PRIu64 "\t%d\t%d\n"
-        , std::chrono::duration_cast<std::chrono::milliseconds>(timestamp).count()
-        , offset
-        , offset + length
-        , int(op)
-        , index);
-    ::write(fd, buffer, len);
-    ::close(fd);
-}
-#endif
+// A (temporary) file that's read and written at arbitrary offsets. Unlike
+// Disk, reads are copied into a buffer provided by the caller, so
+// implementations don't need to hold on to any memory between calls.
+struct RandomAccessDisk {
+    virtual void Read(uint64_t begin, uint8_t *memcache, uint64_t length) = 0;
+    virtual void Write(uint64_t begin, const uint8_t *memcache, uint64_t length) = 0;
+    virtual void Truncate(uint64_t new_size) = 0;
+    virtual std::string GetFileName() = 0;
+    virtual void Close() = 0;
+    // Maps [begin, begin + length) into "mapping", to read it without copying.
+    // Returns false if mapped reads are disabled, or this file (or this part of
+    // it) can't be mapped; callers then fall back to Read(). The range must
+    // not be truncated away while it's mapped.
+    virtual bool Map(uint64_t, uint64_t, MappedFile &, MappedFile::advice_t) { return false; }
+    virtual ~RandomAccessDisk() = default;
+};
 
-struct FileDisk {
+// A file on disk, read and written at arbitrary offsets with pread()/pwrite().
+// There's no file position, so several threads may read and write disjoint
+// ranges of the same FileDisk at the same time. The exceptions are Close(),
+// and files with a write buffer (see SetBufferSize()), which must only be used
+// by one thread at a time.
+struct FileDisk : RandomAccessDisk {
     explicit FileDisk(const fs::path &filename)
     {
         filename_ = filename;
+        usage_ = TmpSpace::ForFile(filename_.string());
         Open(writeFlag);
     }
 
+    // Opens the file, unless it's already open. With writeFlag, the file is
+    // created, or truncated if it exists. Re-opening a closed file keeps its
+    // contents.
     void Open(uint8_t flags = 0)
     {
         // if the file is already open, don't do anything
-        if (f_) return;
+        if (fd_.load(std::memory_order_acquire) >= 0) return;
 
-        // Opens the file for reading and writing
+        int fd;
         do {
 #ifdef _WIN32
-            f_ = ::_wfopen(filename_.c_str(), (flags & writeFlag) ? L"w+b" : L"r+b");
+            int const create = (flags & writeFlag) ? (_O_CREAT | _O_TRUNC) : 0;
+            fd = ::_wopen(
+                filename_.c_str(), _O_RDWR | _O_BINARY | create, _S_IREAD | _S_IWRITE);
 #else
-            f_ = ::fopen(filename_.c_str(), (flags & writeFlag) ? "w+b" : "r+b");
+            int const create = (flags & writeFlag) ? (O_CREAT | O_TRUNC) : 0;
+            fd = ::open(filename_.c_str(), O_RDWR | O_CLOEXEC | create, 0644);
 #endif
-            if (f_ == nullptr) {
+            if (fd < 0) {
                 std::string error_message =
                     "Could not open " + filename_.string() + ": " + ::strerror(errno) + ".";
                 if (flags & retryOpenFlag) {
@@ -126,124 +117,641 @@ struct FileDisk {
                     throw InvalidValueException(error_message);
                 }
             }
-        } while (f_ == nullptr);
+        } while (fd < 0);
+
+        // another thread may have opened it in the meantime
+        int expected = -1;
+        if (!fd_.compare_exchange_strong(expected, fd, std::memory_order_acq_rel)) {
+            CloseFd(fd);
+        }
+    }
+
+    // Collects writes in a buffer of "size" bytes, so that many small
+    // sequential writes reach the file system in large chunks. The buffer is
+    // flushed when a write isn't adjacent to the previous one, before reads,
+    // and by Truncate() and Close().
+    void SetBufferSize(size_t const size)
+    {
+        FlushBuffer();
+        buffer_.reset(new uint8_t[size]);
+        buffer_size_ = size;
     }
 
     FileDisk(FileDisk &&fd)
     {
         filename_ = std::move(fd.filename_);
-        f_ = fd.f_;
-        fd.f_ = nullptr;
+        fd_ = fd.fd_.exchange(-1);
+        trace_ = fd.trace_;
+        fd.trace_ = nullptr;
+        preallocated_ = fd.preallocated_;
+        buffer_ = std::move(fd.buffer_);
+        buffer_size_ = fd.buffer_size_;
+        buffer_begin_ = fd.buffer_begin_;
+        buffered_ = fd.buffered_;
+        fd.buffered_ = 0;
+        writeMax = fd.writeMax.load();
+        usage_ = fd.usage_;
+        fd.usage_ = nullptr;
     }
 
     FileDisk(const FileDisk &) = delete;
     FileDisk &operator=(const FileDisk &) = delete;
 
-    void Close()
+    void Close() override
     {
-        if (f_ == nullptr) return;
-        ::fclose(f_);
-        f_ = nullptr;
-        readPos = 0;
-        writePos = 0;
+        if (fd_ < 0) return;
+        FlushBuffer();
+        CloseFd(fd_.exchange(-1));
     }
 
-    ~FileDisk() { Close(); }
+    ~FileDisk()
+    {
+        Close();
+        if (usage_) usage_->Shrink(writeMax);
+        DiskTrace::ReleaseFile(trace_);
+    }
 
-    void Read(uint64_t begin, uint8_t *memcache, uint64_t length)
+    void Read(uint64_t begin, uint8_t *memcache, uint64_t length) override
     {
         Open(retryOpenFlag);
-#if ENABLE_LOGGING
-        disk_log(filename_, op_t::read, begin, length);
-#endif
-        // Seek, read, and replace into memcache
-        uint64_t amtread;
-        do {
-            if ((!bReading) || (begin != readPos)) {
+        FlushBuffer();
+        DiskTrace::Scope trace(trace_, filename_, DiskTrace::op_t::read, begin, length);
+        uint64_t amtread = 0;
+        while (amtread < length) {
+            int64_t const r = ReadAt(memcache + amtread, length - amtread, begin + amtread);
+            if (r > 0) {
+                amtread += r;
+            } else if (r < 0 && errno == EINTR) {
+                continue;
+            } else {
+                std::cout << "Only read " << amtread << " of " << length << " bytes at offset "
+                          << begin << " from " << filename_ << " with length " << writeMax
+                          << ". Error " << (r < 0 ? ::strerror(errno) : "end of file")
+                          << ". Retrying in five minutes." << std::endl;
+                std::this_thread::sleep_for(5min);
+            }
+        }
+    }
+
+    void Write(uint64_t begin, const uint8_t *memcache, uint64_t length) override
+    {
+        Open(retryOpenFlag);
+        DiskTrace::Scope trace(trace_, filename_, DiskTrace::op_t::write, begin, length);
+        GrowTo(begin + length);
+        if (buffer_) {
+            if (buffered_ > 0 && begin != buffer_begin_ + buffered_) FlushBuffer();
+            if (buffered_ + length <= buffer_size_) {
+                if (buffered_ == 0) buffer_begin_ = begin;
+                ::memcpy(buffer_.get() + buffered_, memcache, length);
+                buffered_ += length;
+                return;
+            }
+            FlushBuffer();
+        }
+        WriteAll(begin, memcache, length);
+    }
+
+    std::string GetFileName() override { return filename_.string(); }
+
+    uint64_t GetWriteMax() const noexcept { return writeMax; }
+
+    void Truncate(uint64_t new_size) override
+    {
+        Open(retryOpenFlag);
+        FlushBuffer();
 #ifdef _WIN32
-                _fseeki64(f_, begin, SEEK_SET);
+        int const r = ::_chsize_s(fd_, new_size);
 #else
-                // fseek() takes a long as offset, make sure it's wide enough
-                static_assert(sizeof(long) >= sizeof(begin));
-                ::fseek(f_, begin, SEEK_SET);
+        int const r = ::ftruncate(fd_, new_size);
 #endif
-                bReading = true;
-            }
-            amtread = ::fread(reinterpret_cast<char *>(memcache), sizeof(uint8_t), length, f_);
-            readPos = begin + amtread;
-            if (amtread != length) {
-                std::cout << "Only read " << amtread << " of " << length << " bytes at offset "
-                          << begin << " from " << filename_ << "with length " << writeMax
-                          << ". Error " << ferror(f_) << ". Retrying in five minutes." << std::endl;
-                std::this_thread::sleep_for(5min);
+        if (r != 0) {
+            throw InvalidStateException(
+                "Could not truncate " + filename_.string() + ": " + ::strerror(errno));
+        }
+        preallocated_ = std::min(preallocated_, new_size);
+        uint64_t const old_size = writeMax.exchange(new_size);
+        if (usage_) {
+            if (new_size > old_size) usage_->Grow(new_size - old_size);
+            else usage_->Shrink(old_size - new_size);
+        }
+    }
+
+    bool Map(
+        uint64_t const begin,
+        uint64_t const length,
+        MappedFile &mapping,
+        MappedFile::advice_t const advice) override
+    {
+        if (!MappedFile::Enabled() || begin + length > writeMax) return false;
+        Open(retryOpenFlag);
+        FlushBuffer();
+        // the pages are only read when they're touched, this records them
+        // all up-front
+        DiskTrace::Scope trace(trace_, filename_, DiskTrace::op_t::read, begin, length);
+        return mapping.Map(fd_, begin, length, advice);
+    }
+
+    // Allocates disk space for the first "size" bytes of the file, without
+    // changing the file size. Files that grow one write at a time, several of
+    // them at once, end up badly fragmented otherwise. This is only a hint,
+    // it's silently ignored where the file system doesn't support it. Running
+    // out of space is reported, since the writes are likely to fail next.
+    void Preallocate(uint64_t const size)
+    {
+        if (size <= preallocated_) return;
+        Open(retryOpenFlag);
+#ifdef __linux__
+        // unlike posix_fallocate(), this doesn't change the file size, and it
+        // fails instead of writing zeros when the file system can't do it
+        if (::fallocate(fd_, FALLOC_FL_KEEP_SIZE, 0, size) != 0) {
+            if (errno == ENOSPC) {
+                std::cout << "Not enough space to preallocate " << size << " bytes for "
+                          << filename_.string() << std::endl;
             }
-        } while (amtread != length);
+            return;
+        }
+#elif defined(__APPLE__)
+        fstore_t store = {F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, off_t(size), 0};
+        if (::fcntl(fd_, F_PREALLOCATE, &store) == -1) {
+            // a contiguous range isn't available, settle for any
+            store.fst_flags = F_ALLOCATEALL;
+            if (::fcntl(fd_, F_PREALLOCATE, &store) == -1) return;
+        }
+#else
+        return;
+#endif
+        preallocated_ = size;
     }
 
-    void Write(uint64_t begin, const uint8_t *memcache, uint64_t length)
+private:
+    // Like pread()/pwrite(), returns the number of bytes transferred, or -1
+    int64_t ReadAt(uint8_t *buf, uint64_t const length, uint64_t const offset)
     {
-        Open(writeFlag | retryOpenFlag);
-#if ENABLE_LOGGING
-        disk_log(filename_, op_t::write, begin, length);
+        // single calls are limited to a little less than 2 GiB on Linux anyway
+        size_t const n = std::min<uint64_t>(length, 1U << 30);
+#ifdef _WIN32
+        // there's no pread() on Windows, seek and read under a lock instead
+        std::lock_guard<std::mutex> l(seek_mutex_);
+        if (::_lseeki64(fd_, offset, SEEK_SET) < 0) return -1;
+        return ::_read(fd_, buf, unsigned(n));
+#else
+        return ::pread(fd_, buf, n, offset);
 #endif
-        // Seek and write from memcache
-        uint64_t amtwritten;
-        do {
-            if ((bReading) || (begin != writePos)) {
+    }
+
+    int64_t WriteAt(uint8_t const *buf, uint64_t const length, uint64_t const offset)
+    {
+        size_t const n = std::min<uint64_t>(length, 1U << 30);
 #ifdef _WIN32
-                _fseeki64(f_, begin, SEEK_SET);
+        std::lock_guard<std::mutex> l(seek_mutex_);
+        if (::_lseeki64(fd_, offset, SEEK_SET) < 0) return -1;
+        return ::_write(fd_, buf, unsigned(n));
 #else
-                // fseek() takes a long as offset, make sure it's wide enough
-                static_assert(sizeof(long) >= sizeof(begin));
-                ::fseek(f_, begin, SEEK_SET);
+        return ::pwrite(fd_, buf, n, offset);
 #endif
-                bReading = false;
-            }
-            amtwritten =
-                ::fwrite(reinterpret_cast<const char *>(memcache), sizeof(uint8_t), length, f_);
-            writePos = begin + amtwritten;
-            if (writePos > writeMax)
-                writeMax = writePos;
-            if (amtwritten != length) {
+    }
+
+    void WriteAll(uint64_t const begin, const uint8_t *memcache, uint64_t const length)
+    {
+        uint64_t amtwritten = 0;
+        while (amtwritten < length) {
+            int64_t const r =
+                WriteAt(memcache + amtwritten, length - amtwritten, begin + amtwritten);
+            if (r > 0) {
+                amtwritten += r;
+            } else if (r < 0 && errno == EINTR) {
+                continue;
+            } else {
                 std::cout << "Only wrote " << amtwritten << " of " << length << " bytes at offset "
-                          << begin << " to " << filename_ << "with length " << writeMax
-                          << ". Error " << ferror(f_) << ". Retrying in five minutes." << std::endl;
+                          << begin << " to " << filename_ << " with length " << writeMax
+                          << ". Error " << ::strerror(errno) << ". Retrying in five minutes."
+                          << std::endl;
                 std::this_thread::sleep_for(5min);
             }
-        } while (amtwritten != length);
+        }
     }
 
-    std::string GetFileName() { return filename_.string(); }
-
-    uint64_t GetWriteMax() const noexcept { return writeMax; }
+    void FlushBuffer()
+    {
+        if (buffered_ == 0) return;
+        uint64_t const n = buffered_;
+        buffered_ = 0;
+        WriteAll(buffer_begin_, buffer_.get(), n);
+    }
 
-    void Truncate(uint64_t new_size)
+    // Records that the file is (at least) "size" bytes
+    void GrowTo(uint64_t const size)
     {
-        Close();
-        fs::resize_file(filename_, new_size);
+        uint64_t prev = writeMax.load(std::memory_order_relaxed);
+        while (size > prev) {
+            if (writeMax.compare_exchange_weak(prev, size, std::memory_order_relaxed)) {
+                if (usage_) usage_->Grow(size - prev);
+                return;
+            }
+        }
     }
 
-private:
+    static void CloseFd(int const fd)
+    {
+#ifdef _WIN32
+        ::_close(fd);
+#else
+        ::close(fd);
+#endif
+    }
 
-    uint64_t readPos = 0;
-    uint64_t writePos = 0;
-    uint64_t writeMax = 0;
-    bool bReading = true;
+    // the size of the file, as far as this FileDisk is concerned
+    std::atomic<uint64_t> writeMax{0};
 
     fs::path filename_;
-    FILE *f_ = nullptr;
+    std::atomic<int> fd_{-1};
+    // I/O counters of this file, looked up on first use when tracing is enabled
+    DiskTrace::FileStats *trace_ = nullptr;
+    // temp space accounting of this file's class, if it's a temp file
+    TmpSpace::Usage *usage_ = nullptr;
+    uint64_t preallocated_ = 0;
+    // the write buffer, if any, and the part of the file it holds
+    std::unique_ptr<uint8_t[]> buffer_;
+    size_t buffer_size_ = 0;
+    uint64_t buffer_begin_ = 0;
+    uint64_t buffered_ = 0;
+#ifdef _WIN32
+    std::mutex seek_mutex_;
+#endif
 
     static const uint8_t writeFlag = 0b01;
     static const uint8_t retryOpenFlag = 0b10;
 };
 
+// The amount of RAM temporary files may occupy. It's shared by all the
+// MemoryDisks of a plot, they take from it as they grow and give it back as
+// they shrink, so several files can be held in RAM at the same time without
+// exceeding what the user allowed.
+class RamBudget {
+public:
+    explicit RamBudget(uint64_t const bytes) : available_(bytes) {}
+
+    RamBudget(const RamBudget &) = delete;
+    RamBudget &operator=(const RamBudget &) = delete;
+
+    // Takes exactly "bytes" from the budget, or nothing if there isn't enough left
+    bool Acquire(uint64_t const bytes)
+    {
+        uint64_t available = available_.load();
+        do {
+            if (available < bytes) return false;
+        } while (!available_.compare_exchange_weak(available, available - bytes));
+        return true;
+    }
+
+    // Takes as much as possible, up to "bytes", from the budget. Returns the
+    // number of bytes taken
+    uint64_t Take(uint64_t const bytes)
+    {
+        uint64_t available = available_.load();
+        uint64_t taken;
+        do {
+            taken = std::min(available, bytes);
+        } while (!available_.compare_exchange_weak(available, available - taken));
+        return taken;
+    }
+
+    void Release(uint64_t const bytes) { available_ += bytes; }
+
+    uint64_t Available() const { return available_.load(); }
+
+private:
+    std::atomic<uint64_t> available_;
+};
+
+// A file that lives entirely in RAM. Memory is allocated in fixed size chunks
+// as the file grows (so growing never moves existing data) and is accounted
+// for against a RamBudget. Reads that fall within a single chunk are served
+// straight from the chunk, without copying.
+struct MemoryDisk : RandomAccessDisk, Disk {
+    static inline const uint64_t kChunkSize = 1024 * 1024;
+
+    // "reserve" bytes are taken from the budget up-front, so this file can
+    // grow to (at least) that size even if other files exhaust the budget
+    // first. Without a budget, the file can grow until max_size.
+    explicit MemoryDisk(
+        const fs::path &filename,
+        RamBudget *budget = nullptr,
+        uint64_t const reserve = 0,
+        uint64_t const max_size = std::numeric_limits<uint64_t>::max())
+        : filename_(filename), budget_(budget), max_size_(max_size)
+    {
+        if (budget_ != nullptr) reserved_ = budget_->Take(reserve);
+    }
+
+    MemoryDisk(MemoryDisk &&md)
+        : chunks_(std::move(md.chunks_))
+        , filename_(std::move(md.filename_))
+        , budget_(md.budget_)
+        , reserved_(md.reserved_)
+        , max_size_(md.max_size_)
+        , write_max_(md.write_max_)
+    {
+        md.chunks_.clear();
+        md.reserved_ = 0;
+        md.write_max_ = 0;
+    }
+
+    MemoryDisk(const MemoryDisk &) = delete;
+    MemoryDisk &operator=(const MemoryDisk &) = delete;
+
+    ~MemoryDisk()
+    {
+        ReleaseChunks(0);
+        if (budget_ != nullptr) budget_->Release(reserved_);
+    }
+
+    // Makes sure the first "size" bytes of the file are backed by memory.
+    // Returns false if the budget (or max_size) doesn't allow that, in which
+    // case as many chunks as possible were still added.
+    bool Reserve(uint64_t const size)
+    {
+        while (Capacity() < size) {
+            if (Capacity() + kChunkSize > max_size_) return false;
+            if (reserved_ >= kChunkSize) {
+                reserved_ -= kChunkSize;
+            } else if (budget_ != nullptr && !budget_->Acquire(kChunkSize)) {
+                return false;
+            }
+            // all allocations need 7 bytes head-room, since
+            // SliceInt64FromBytes() may overrun by 7 bytes
+            chunks_.emplace_back(new uint8_t[kChunkSize + 7]());
+        }
+        return true;
+    }
+
+    uint64_t Capacity() const noexcept { return chunks_.size() * kChunkSize; }
+
+    // Gives back the part of the reserve that isn't backing any chunk yet. The
+    // reserve is only meant to get the file to its final size, which is known
+    // once it's truncated
+    void ReleaseReserve()
+    {
+        if (budget_ != nullptr) budget_->Release(reserved_);
+        reserved_ = 0;
+    }
+
+    void Read(uint64_t begin, uint8_t *memcache, uint64_t length) override
+    {
+        if (begin + length > Capacity()) {
+            throw InvalidValueException(
+                "Read past the end of " + filename_.string() + " at offset " +
+                std::to_string(begin) + " length " + std::to_string(length));
+        }
+        while (length > 0) {
+            uint64_t const offset = begin % kChunkSize;
+            uint64_t const n = std::min(length, kChunkSize - offset);
+            ::memcpy(memcache, chunks_[begin / kChunkSize].get() + offset, n);
+            memcache += n;
+            begin += n;
+            length -= n;
+        }
+    }
+
+    uint8_t const* Read(uint64_t begin, uint64_t length) override
+    {
+        uint64_t const offset = begin % kChunkSize;
+        if (offset + length <= kChunkSize && begin + length <= Capacity()) {
+            return chunks_[begin / kChunkSize].get() + offset;
+        }
+        // the read straddles two chunks, we have to stitch it together
+        if (scratch_size_ < length) {
+            scratch_.reset(new uint8_t[length + 7]);
+            scratch_size_ = length;
+        }
+        Read(begin, scratch_.get(), length);
+        return scratch_.get();
+    }
+
+    void Write(uint64_t begin, const uint8_t *memcache, uint64_t length) override
+    {
+        if (!Reserve(begin + length)) {
+            throw InsufficientMemoryException(
+                "Not enough RAM to hold " + filename_.string() + ". Need " +
+                std::to_string(begin + length) + " bytes");
+        }
+        write_max_ = std::max(write_max_, begin + length);
+        while (length > 0) {
+            uint64_t const offset = begin % kChunkSize;
+            uint64_t const n = std::min(length, kChunkSize - offset);
+            ::memcpy(chunks_[begin / kChunkSize].get() + offset, memcache, n);
+            memcache += n;
+            begin += n;
+            length -= n;
+        }
+    }
+
+    void Truncate(uint64_t const new_size) override
+    {
+        ReleaseReserve();
+        ReleaseChunks(cdiv(new_size, int(kChunkSize)));
+        // the file may grow again later, the bytes past the end must read
+        // back as zeros, just like they would from a file
+        if (new_size % kChunkSize != 0 && new_size < Capacity()) {
+            uint64_t const offset = new_size % kChunkSize;
+            ::memset(chunks_.back().get() + offset, 0, kChunkSize - offset);
+        }
+        write_max_ = std::min(write_max_, new_size);
+        FreeMemory();
+    }
+
+    std::string GetFileName() override { return filename_.string(); }
+
+    uint64_t GetWriteMax() const noexcept { return write_max_; }
+
+    // the contents of the file is the memory, there's nothing to close
+    void Close() override {}
+
+    void FreeMemory() override
+    {
+        scratch_.reset();
+        scratch_size_ = 0;
+    }
+
+private:
+    void ReleaseChunks(uint64_t const keep)
+    {
+        if (chunks_.size() <= keep) return;
+        uint64_t const released = (chunks_.size() - keep) * kChunkSize;
+        chunks_.resize(keep);
+        if (budget_ != nullptr) budget_->Release(released);
+    }
+
+    std::vector<std::unique_ptr<uint8_t[]>> chunks_;
+    fs::path filename_;
+    RamBudget *budget_;
+    // bytes taken from the budget that are not backing any chunk yet
+    uint64_t reserved_ = 0;
+    uint64_t max_size_;
+    uint64_t write_max_ = 0;
+
+    // used to return reads that straddle two chunks
+    std::unique_ptr<uint8_t[]> scratch_;
+    uint64_t scratch_size_ = 0;
+};
+
+// Keeps the beginning of a file in RAM, for as long as the budget allows, and
+// spills the rest to a file on disk. Once anything has been spilled, the RAM
+// part stops growing, so it's always a prefix of the file. The file on disk
+// only holds the part past the RAM prefix, and is not created until something
+// is spilled. Without a budget, this behaves just like a FileDisk.
+struct HybridDisk : RandomAccessDisk {
+    explicit HybridDisk(
+        const fs::path &filename,
+        RamBudget *budget = nullptr,
+        uint64_t const reserve = 0)
+        : memory_(
+              filename,
+              budget,
+              reserve,
+              budget == nullptr ? 0 : std::numeric_limits<uint64_t>::max())
+        , filename_(filename)
+    {
+    }
+
+    HybridDisk(HybridDisk &&) = default;
+
+    HybridDisk(const HybridDisk &) = delete;
+    HybridDisk &operator=(const HybridDisk &) = delete;
+
+    void Read(uint64_t begin, uint8_t *memcache, uint64_t length) override
+    {
+        uint64_t const ram_size = GetRamSize();
+        if (begin < ram_size) {
+            uint64_t const n = std::min(length, ram_size - begin);
+            memory_.Read(begin, memcache, n);
+            memcache += n;
+            begin += n;
+            length -= n;
+        }
+        if (length > 0) {
+            if (!spill_) {
+                throw InvalidValueException(
+                    "Read past the end of " + filename_.string() + " at offset " +
+                    std::to_string(begin) + " length " + std::to_string(length));
+            }
+            spill_->Read(begin - ram_size, memcache, length);
+        }
+    }
+
+    void Write(uint64_t begin, const uint8_t *memcache, uint64_t length) override
+    {
+        if (!spilled_ && !memory_.Reserve(begin + length)) {
+            // from now on, the RAM part is fixed in size
+            spilled_ = true;
+        }
+        uint64_t const ram_size = GetRamSize();
+        if (begin < ram_size) {
+            uint64_t const n = std::min(length, ram_size - begin);
+            memory_.Write(begin, memcache, n);
+            memcache += n;
+            begin += n;
+            length -= n;
+        }
+        if (length > 0) {
+            NeedSpillFile();
+            spill_->Write(begin - ram_size, memcache, length);
+        }
+    }
+
+    void Truncate(uint64_t const new_size) override
+    {
+        memory_.ReleaseReserve();
+        if (new_size <= GetRamSize()) {
+            // nothing is left in the spill file
+            RemoveSpillFile();
+            memory_.Truncate(new_size);
+        } else {
+            NeedSpillFile();
+            spill_->Truncate(new_size - GetRamSize());
+        }
+    }
+
+    std::string GetFileName() override { return filename_.string(); }
+
+    // The size of the prefix of the file that's held in RAM
+    uint64_t GetRamSize() const noexcept { return memory_.Capacity(); }
+
+    // Hints the final size of the file. Whatever doesn't fit in RAM is
+    // preallocated on disk as soon as the spill file is created
+    void Preallocate(uint64_t const size)
+    {
+        size_hint_ = size;
+        if (spill_ && size_hint_ > GetRamSize()) spill_->Preallocate(size_hint_ - GetRamSize());
+    }
+
+    void Close() override
+    {
+        if (spill_) spill_->Close();
+    }
+
+    // Only the part of the file that's been spilled to disk can be mapped
+    bool Map(
+        uint64_t const begin,
+        uint64_t const length,
+        MappedFile &mapping,
+        MappedFile::advice_t const advice) override
+    {
+        uint64_t const ram_size = GetRamSize();
+        if (!spill_ || begin < ram_size) return false;
+        return spill_->Map(begin - ram_size, length, mapping, advice);
+    }
+
+    // Deletes the file, both the RAM and the disk part
+    void Remove()
+    {
+        RemoveSpillFile();
+        memory_.Truncate(0);
+    }
+
+private:
+    void NeedSpillFile()
+    {
+        if (spill_) return;
+        spilled_ = true;
+        spill_ = std::make_unique<FileDisk>(filename_);
+        if (size_hint_ > GetRamSize()) spill_->Preallocate(size_hint_ - GetRamSize());
+    }
+
+    void RemoveSpillFile()
+    {
+        spilled_ = false;
+        if (!spill_) return;
+        spill_.reset();
+        fs::remove(filename_);
+    }
+
+    MemoryDisk memory_;
+    std::unique_ptr<FileDisk> spill_;
+    bool spilled_ = false;
+    uint64_t size_hint_ = 0;
+    fs::path filename_;
+};
+
 struct BufferedDisk : Disk
 {
-    BufferedDisk(FileDisk* disk, uint64_t file_size) : disk_(disk), file_size_(file_size) {}
+    BufferedDisk(RandomAccessDisk* disk, uint64_t file_size) : disk_(disk), file_size_(file_size) {}
 
     uint8_t const* Read(uint64_t begin, uint64_t length) override
     {
         assert(length < read_ahead);
+        if (!map_tried_) {
+            // scans read the whole file, if it can be mapped, reads are served
+            // straight from the page cache
+            map_tried_ = true;
+            disk_->Map(0, file_size_, mapping_, MappedFile::sequential);
+        }
+        // all allocations need 7 bytes head-room, since
+        // SliceInt64FromBytes() may overrun by 7 bytes. The last few entries
+        // of a mapping don't have that, they're read through the buffer
+        if (begin + length + 7 <= mapping_.size()) {
+            return mapping_.data() + begin;
+        }
         NeedReadCache();
         // all allocations need 7 bytes head-room, since
         // SliceInt64FromBytes() may overrun by 7 bytes
@@ -316,6 +824,8 @@ struct BufferedDisk : Disk
     void Truncate(uint64_t const new_size) override
     {
         FlushCache();
+        // the mapping must not outlive the truncated part of the file
+        mapping_.Reset();
         disk_->Truncate(new_size);
         file_size_ = new_size;
         FreeMemory();
@@ -331,6 +841,8 @@ struct BufferedDisk : Disk
         write_buffer_.reset();
         read_buffer_size_ = 0;
         write_buffer_size_ = 0;
+        mapping_.Reset();
+        map_tried_ = false;
     }
 
     void FlushCache()
@@ -359,7 +871,7 @@ private:
         write_buffer_size_ = 0;
     }
 
-    FileDisk* disk_;
+    RandomAccessDisk* disk_;
 
     uint64_t file_size_;
 
@@ -373,6 +885,10 @@ private:
     uint64_t write_buffer_start_ = -1;
     std::unique_ptr<uint8_t[]> write_buffer_;
     uint64_t write_buffer_size_ = 0;
+
+    // the whole file, if mapped reads are enabled and it could be mapped
+    MappedFile mapping_;
+    bool map_tried_ = false;
 };
 
 struct FilteredDisk : Disk
@@ -383,10 +899,8 @@ struct FilteredDisk : Disk
         , entry_size_(entry_size)
     {
         assert(entry_size_ > 0);
-        while (!filter_.get(last_idx_)) {
-            last_physical_ += entry_size_;
-            ++last_idx_;
-        }
+        last_idx_ = filter_.find_next_set(0);
+        last_physical_ = last_idx_ * entry_size_;
         assert(filter_.get(last_idx_));
         assert(last_physical_ == last_idx_ * entry_size_);
     }
@@ -401,25 +915,14 @@ struct FilteredDisk : Disk
 
         if (begin > last_logical_) {
             // last_idx_ et.al. always points to an entry we have (i.e. the bit
-            // is set). So when we advance from there, we always take at least
-            // one step on all counters.
-            last_logical_ += entry_size_;
-            last_physical_ += entry_size_;
-            ++last_idx_;
-
-            while (begin > last_logical_)
-            {
-                if (filter_.get(last_idx_)) {
-                    last_logical_ += entry_size_;
-                }
-                last_physical_ += entry_size_;
-                ++last_idx_;
-            }
-
-            while (!filter_.get(last_idx_)) {
-                last_physical_ += entry_size_;
-                ++last_idx_;
-            }
+            // is set). We're looking for the n-th entry we have after that,
+            // the bitfield skips dropped entries a word at a time. Runs of
+            // dropped entries that extend past the read-ahead buffer are never
+            // read from disk, the next buffer starts at the entry we land on.
+            uint64_t const steps = (begin - last_logical_) / entry_size_;
+            last_idx_ = filter_.select(last_idx_ + 1, steps - 1);
+            last_physical_ = last_idx_ * entry_size_;
+            last_logical_ = begin;
         }
 
         assert(filter_.get(last_idx_));
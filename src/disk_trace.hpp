@@ -0,0 +1,514 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_DISK_TRACE_HPP_
+#define SRC_CPP_DISK_TRACE_HPP_
+
+#include <stdio.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Runtime switchable disk I/O tracing. There are two levels:
+//
+// * statistics: per-file and per-phase byte and operation counters, and a
+//   latency histogram per class of file. Printed by PrintSummary() at the end
+//   of a plot.
+// * log: additionally, every operation is recorded in a per-thread batch,
+//   which is appended to a log file whenever it fills up (and when the thread
+//   exits). The log has the format expected by tools/parse_disk.py and
+//   tools/disk.gnuplot.
+//
+// Both are off by default, and can be turned on by the API (EnableStats(),
+// EnableLog()), by the CLI (--iostats, --iolog) or by the environment
+// (CHIAPOS_IOSTATS=1, CHIAPOS_IOLOG=<path>), the latter works for plots
+// created through the python bindings too. When tracing is off, the cost of an
+// I/O operation is a single relaxed atomic load.
+namespace DiskTrace {
+
+enum class op_t : int { read, write };
+
+enum file_class_t : int { table_file, sort_bucket_file, plot_file, other_file, num_file_classes };
+
+inline const char* const kFileClassNames[num_file_classes] = {
+    "tables", "sort buckets", "plot", "other"};
+
+// 0 is anything that happens outside of the four phases, 5 is the final copy
+constexpr int kNumPhases = 6;
+inline const char* const kPhaseNames[kNumPhases] = {
+    "setup", "phase 1", "phase 2", "phase 3", "phase 4", "final copy"};
+
+// Bucket i holds operations that took [2^(i-1), 2^i) microseconds, bucket 0
+// the ones that took less than a microsecond. The last bucket is open ended.
+constexpr int kLatencyBuckets = 28;
+
+struct FileStats {
+    std::string name;
+    file_class_t file_class;
+    uint32_t index;
+    std::atomic<uint64_t> bytes[2] = {};
+    std::atomic<uint64_t> ops[2] = {};
+    // protected by State::mutex. The number of open files holding a pointer to
+    // these counters, and whether the name has been written to the current log
+    int users = 0;
+    bool logged = false;
+};
+
+struct State {
+    std::atomic<bool> stats{false};
+    std::atomic<bool> log{false};
+    std::atomic<int> phase{0};
+
+    std::mutex mutex;
+    // all of the below are protected by "mutex". Files are keyed by their
+    // index, which is what the log refers to them by. A FileStats is only
+    // removed once no open file uses it: sort buckets when they're closed, any
+    // other file by Reset(). The counters of closed sort buckets are added up
+    // in "closed_*", per class of file
+    std::map<uint32_t, std::unique_ptr<FileStats>> files;
+    std::unordered_map<std::string, FileStats*> file_index;
+    uint32_t next_index = 0;
+    uint64_t closed_files[num_file_classes] = {};
+    uint64_t closed_bytes[num_file_classes][2] = {};
+    uint64_t closed_ops[num_file_classes][2] = {};
+    FILE* log_file = nullptr;
+    std::string log_path;
+
+    std::atomic<uint64_t> phase_bytes[kNumPhases][2] = {};
+    std::atomic<uint64_t> phase_ops[kNumPhases][2] = {};
+    std::atomic<uint64_t> latency[num_file_classes][2][kLatencyBuckets] = {};
+    std::atomic<uint64_t> latency_total_us[num_file_classes][2] = {};
+
+    std::chrono::steady_clock::time_point const start_time = std::chrono::steady_clock::now();
+
+    State()
+    {
+        char const* stats_env = std::getenv("CHIAPOS_IOSTATS");
+        if (stats_env != nullptr && *stats_env != '\0' && *stats_env != '0') {
+            stats = true;
+        }
+        char const* log_env = std::getenv("CHIAPOS_IOLOG");
+        if (log_env != nullptr && *log_env != '\0') {
+            log_path = log_env;
+            stats = true;
+            log = true;
+        }
+    }
+
+    ~State()
+    {
+        if (log_file != nullptr) ::fclose(log_file);
+    }
+};
+
+inline State& GetState()
+{
+    static State state;
+    return state;
+}
+
+inline bool Enabled() { return GetState().stats.load(std::memory_order_relaxed); }
+
+inline void EnableStats(bool const enable = true) { GetState().stats = enable; }
+
+// Enables statistics and logs every operation to "path". The log is appended
+// to, one file can hold the traces of several plots.
+inline void EnableLog(std::string const& path)
+{
+    State& s = GetState();
+    std::lock_guard<std::mutex> l(s.mutex);
+    if (s.log_file != nullptr && path != s.log_path) {
+        ::fclose(s.log_file);
+        s.log_file = nullptr;
+        for (auto& f : s.files) f.second->logged = false;
+    }
+    s.log_path = path;
+    s.stats = true;
+    s.log = true;
+}
+
+inline void SetPhase(int const phase) { GetState().phase = phase; }
+
+inline file_class_t ClassifyFile(std::string const& filename)
+{
+    if (filename.find("sort_bucket") != std::string::npos) return sort_bucket_file;
+    if (filename.find(".table") != std::string::npos ||
+        filename.find(".sort.tmp") != std::string::npos) {
+        return table_file;
+    }
+    if (filename.find(".2.tmp") != std::string::npos ||
+        filename.find(".plot") != std::string::npos) {
+        return plot_file;
+    }
+    return other_file;
+}
+
+// The caller holds the mutex
+inline FileStats* GetFileLocked(State& s, std::string const& filename)
+{
+    auto it = s.file_index.find(filename);
+    if (it != s.file_index.end()) return it->second;
+    auto f = std::make_unique<FileStats>();
+    f->name = filename;
+    f->file_class = ClassifyFile(filename);
+    f->index = s.next_index++;
+    FileStats* const ret = f.get();
+    s.files.emplace(ret->index, std::move(f));
+    s.file_index[filename] = ret;
+    return ret;
+}
+
+// Returns the counters for a file, without holding on to them. They stay
+// valid until the next Reset()
+inline FileStats* GetFile(std::string const& filename)
+{
+    State& s = GetState();
+    std::lock_guard<std::mutex> l(s.mutex);
+    return GetFileLocked(s, filename);
+}
+
+// Looks up the counters for a file, unless "file" already holds them. This
+// takes a lock, open files are expected to do this once and hold on to the
+// pointer until they call ReleaseFile()
+inline void AcquireFile(FileStats*& file, std::string const& filename)
+{
+    State& s = GetState();
+    std::lock_guard<std::mutex> l(s.mutex);
+    if (file != nullptr) return;
+    file = GetFileLocked(s, filename);
+    ++file->users;
+}
+
+// Opens the log, if it isn't yet. The caller holds the mutex
+inline bool OpenLog(State& s)
+{
+    if (s.log_file == nullptr && !s.log_path.empty()) {
+        s.log_file = ::fopen(s.log_path.c_str(), "a");
+        if (s.log_file == nullptr) {
+            std::cout << "Could not open I/O log " << s.log_path << ". Disabling it."
+                      << std::endl;
+            s.log = false;
+            s.log_path.clear();
+        }
+    }
+    return s.log_file != nullptr;
+}
+
+// The file name is written the first time a file is referenced by the log, or
+// when it's removed, since other threads may still hold records of it. The
+// caller holds the mutex
+inline void LogFileName(State& s, FileStats& f)
+{
+    if (f.logged) return;
+    ::fprintf(s.log_file, "# %u %s\n", f.index, f.name.c_str());
+    f.logged = true;
+}
+
+// The caller holds the mutex
+inline void RemoveFile(State& s, FileStats& f)
+{
+    if (s.log.load(std::memory_order_relaxed) && (f.ops[0] != 0 || f.ops[1] != 0) &&
+        OpenLog(s)) {
+        LogFileName(s, f);
+        ::fflush(s.log_file);
+    }
+    s.file_index.erase(f.name);
+    s.files.erase(f.index);
+}
+
+// Called by an open file when it's done with the counters AcquireFile() gave
+// it. A sort bucket is added to the totals of its class once the last user is
+// gone, since there are hundreds of them per plot
+inline void ReleaseFile(FileStats*& file)
+{
+    if (file == nullptr) return;
+    State& s = GetState();
+    std::lock_guard<std::mutex> l(s.mutex);
+    FileStats& f = *file;
+    file = nullptr;
+    if (--f.users > 0 || f.file_class != sort_bucket_file) return;
+    int const c = f.file_class;
+    ++s.closed_files[c];
+    for (int o = 0; o < 2; ++o) {
+        s.closed_bytes[c][o] += f.bytes[o];
+        s.closed_ops[c][o] += f.ops[o];
+    }
+    RemoveFile(s, f);
+}
+
+struct Record {
+    uint64_t timestamp_ms;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t latency_us;
+    uint32_t file;
+    op_t op;
+};
+
+// The per-thread batch of records. They're written to the log when it fills
+// up, so the log mutex is only taken once every kBatchSize operations
+struct LogBatch {
+    static constexpr int kBatchSize = 4096;
+
+    ~LogBatch() { Flush(); }
+
+    void Add(Record const& r)
+    {
+        records[count++] = r;
+        if (count == kBatchSize) Flush();
+    }
+
+    void Flush()
+    {
+        if (count == 0) return;
+        State& s = GetState();
+        std::lock_guard<std::mutex> l(s.mutex);
+        if (OpenLog(s)) {
+            for (int i = 0; i < count; ++i) {
+                Record const& r = records[i];
+                // a file that's gone has had its name logged already
+                auto it = s.files.find(r.file);
+                if (it != s.files.end()) LogFileName(s, *it->second);
+                // timestamp (ms), start-offset, end-offset, operation (0 = read,
+                // 1 = write), file_index, latency (us)
+                ::fprintf(
+                    s.log_file,
+                    "%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\t%d\t%u\t%u\n",
+                    r.timestamp_ms,
+                    r.offset,
+                    r.offset + r.length,
+                    int(r.op),
+                    r.file,
+                    r.latency_us);
+            }
+            ::fflush(s.log_file);
+        }
+        count = 0;
+    }
+
+    std::array<Record, kBatchSize> records;
+    int count = 0;
+};
+
+inline LogBatch& GetLogBatch()
+{
+    thread_local LogBatch batch;
+    return batch;
+}
+
+inline int LatencyBucket(uint64_t us)
+{
+    int bucket = 0;
+    while (us != 0 && bucket < kLatencyBuckets - 1) {
+        us >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+// Measures a single I/O operation. Construct it right before the operation,
+// it's recorded when it goes out of scope
+class Scope {
+public:
+    // "file" caches the counters of the file, it's looked up by "filename" (a
+    // std::string or fs::path) the first time it's needed. The owner of "file"
+    // passes it to ReleaseFile() when it's closed
+    template <typename Path>
+    Scope(FileStats*& file, Path const& filename, op_t const op, uint64_t const offset,
+          uint64_t const length)
+        : op_(op), offset_(offset), length_(length)
+    {
+        if (!Enabled()) return;
+        if (file == nullptr) AcquireFile(file, std::string(filename.string()));
+        file_ = file;
+        start_ = std::chrono::steady_clock::now();
+    }
+
+    Scope(Scope const&) = delete;
+    Scope& operator=(Scope const&) = delete;
+
+    ~Scope()
+    {
+        if (file_ == nullptr) return;
+        auto const end = std::chrono::steady_clock::now();
+        uint64_t const us =
+            std::chrono::duration_cast<std::chrono::microseconds>(end - start_).count();
+        State& s = GetState();
+        int const o = int(op_);
+        int const phase = s.phase.load(std::memory_order_relaxed);
+
+        file_->bytes[o].fetch_add(length_, std::memory_order_relaxed);
+        file_->ops[o].fetch_add(1, std::memory_order_relaxed);
+        s.phase_bytes[phase][o].fetch_add(length_, std::memory_order_relaxed);
+        s.phase_ops[phase][o].fetch_add(1, std::memory_order_relaxed);
+        s.latency[file_->file_class][o][LatencyBucket(us)].fetch_add(
+            1, std::memory_order_relaxed);
+        s.latency_total_us[file_->file_class][o].fetch_add(us, std::memory_order_relaxed);
+
+        if (s.log.load(std::memory_order_relaxed)) {
+            GetLogBatch().Add(
+                {uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+                              end - s.start_time)
+                              .count()),
+                 offset_,
+                 length_,
+                 uint32_t(std::min(us, uint64_t(UINT32_MAX))),
+                 file_->index,
+                 op_});
+        }
+    }
+
+private:
+    FileStats* file_ = nullptr;
+    op_t op_;
+    uint64_t offset_;
+    uint64_t length_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Zeroes all counters, so the next summary only covers what happens from now
+// on. Files that aren't open anymore are removed, open ones hold pointers to
+// their counters and stay
+inline void Reset()
+{
+    State& s = GetState();
+    std::lock_guard<std::mutex> l(s.mutex);
+    for (auto it = s.files.begin(); it != s.files.end();) {
+        FileStats& f = *(it++)->second;
+        if (f.users == 0) {
+            RemoveFile(s, f);
+            continue;
+        }
+        for (int o = 0; o < 2; ++o) {
+            f.bytes[o] = 0;
+            f.ops[o] = 0;
+        }
+    }
+    for (int c = 0; c < num_file_classes; ++c) {
+        s.closed_files[c] = 0;
+        for (int o = 0; o < 2; ++o) {
+            s.closed_bytes[c][o] = 0;
+            s.closed_ops[c][o] = 0;
+        }
+    }
+    for (int p = 0; p < kNumPhases; ++p) {
+        for (int o = 0; o < 2; ++o) {
+            s.phase_bytes[p][o] = 0;
+            s.phase_ops[p][o] = 0;
+        }
+    }
+    for (int c = 0; c < num_file_classes; ++c) {
+        for (int o = 0; o < 2; ++o) {
+            for (auto& b : s.latency[c][o]) b = 0;
+            s.latency_total_us[c][o] = 0;
+        }
+    }
+    s.phase = 0;
+}
+
+inline std::string FormatBytes(uint64_t const bytes)
+{
+    char buffer[32];
+    ::snprintf(buffer, sizeof(buffer), "%.3f GiB", double(bytes) / (1024 * 1024 * 1024));
+    return buffer;
+}
+
+// The upper bound, in microseconds, of the bucket the given percentile falls in
+inline uint64_t LatencyPercentile(std::atomic<uint64_t> const (&buckets)[kLatencyBuckets],
+                                  uint64_t const total, double const percentile)
+{
+    uint64_t const target = std::max(uint64_t(1), uint64_t(total * percentile));
+    uint64_t seen = 0;
+    for (int i = 0; i < kLatencyBuckets; ++i) {
+        seen += buckets[i].load();
+        if (seen >= target) return uint64_t(1) << i;
+    }
+    return uint64_t(1) << (kLatencyBuckets - 1);
+}
+
+inline void PrintSummary(std::ostream& os = std::cout)
+{
+    if (!Enabled()) return;
+    State& s = GetState();
+    // make sure this thread's records make it to the log
+    GetLogBatch().Flush();
+
+    std::lock_guard<std::mutex> l(s.mutex);
+    char const* const op_names[2] = {"read", "write"};
+
+    os << std::endl << "I/O summary" << std::endl;
+    os << "  per file:" << std::endl;
+    uint64_t total_bytes[2] = {};
+    for (auto const& entry : s.files) {
+        FileStats const& f = *entry.second;
+        if (f.ops[0] == 0 && f.ops[1] == 0) continue;
+        os << "    " << f.name << " read: " << FormatBytes(f.bytes[0]) << " in " << f.ops[0]
+           << " ops, write: " << FormatBytes(f.bytes[1]) << " in " << f.ops[1] << " ops"
+           << std::endl;
+        total_bytes[0] += f.bytes[0];
+        total_bytes[1] += f.bytes[1];
+    }
+    for (int c = 0; c < num_file_classes; ++c) {
+        if (s.closed_files[c] == 0) continue;
+        os << "    " << kFileClassNames[c] << " (" << s.closed_files[c]
+           << " closed files) read: " << FormatBytes(s.closed_bytes[c][0]) << " in "
+           << s.closed_ops[c][0] << " ops, write: " << FormatBytes(s.closed_bytes[c][1])
+           << " in " << s.closed_ops[c][1] << " ops" << std::endl;
+        total_bytes[0] += s.closed_bytes[c][0];
+        total_bytes[1] += s.closed_bytes[c][1];
+    }
+    os << "    total read: " << FormatBytes(total_bytes[0])
+       << ", total write: " << FormatBytes(total_bytes[1]) << std::endl;
+
+    os << "  per phase:" << std::endl;
+    for (int p = 0; p < kNumPhases; ++p) {
+        if (s.phase_ops[p][0] == 0 && s.phase_ops[p][1] == 0) continue;
+        os << "    " << kPhaseNames[p] << " read: " << FormatBytes(s.phase_bytes[p][0]) << " in "
+           << s.phase_ops[p][0] << " ops, write: " << FormatBytes(s.phase_bytes[p][1]) << " in "
+           << s.phase_ops[p][1] << " ops" << std::endl;
+    }
+
+    os << "  latency (us):" << std::endl;
+    for (int c = 0; c < num_file_classes; ++c) {
+        for (int o = 0; o < 2; ++o) {
+            uint64_t total = 0;
+            for (auto const& b : s.latency[c][o]) total += b.load();
+            if (total == 0) continue;
+            os << "    " << kFileClassNames[c] << " " << op_names[o]
+               << " avg: " << s.latency_total_us[c][o] / total
+               << " p50: <" << LatencyPercentile(s.latency[c][o], total, 0.5)
+               << " p99: <" << LatencyPercentile(s.latency[c][o], total, 0.99)
+               << " max: <" << LatencyPercentile(s.latency[c][o], total, 1.0) << std::endl;
+            // the histogram, one column per power of two
+            os << "     ";
+            int last = kLatencyBuckets - 1;
+            while (last > 0 && s.latency[c][o][last] == 0) --last;
+            for (int i = 0; i <= last; ++i) os << " " << s.latency[c][o][i];
+            os << std::endl;
+        }
+    }
+}
+
+}  // namespace DiskTrace
+
+#endif  // SRC_CPP_DISK_TRACE_HPP_
@@ -15,6 +15,7 @@
 #ifndef SRC_CPP_ENCODING_HPP_
 #define SRC_CPP_ENCODING_HPP_
 
+#include <algorithm>
 #include <cmath>
 #include <map>
 #include <queue>
@@ -22,13 +23,17 @@
 #include <utility>
 #include <vector>
 
+// for the streaming API, which the interleaved park deltas are built with
+#define FSE_STATIC_LINKING_ONLY
 #include "../lib/FiniteStateEntropy/lib/fse.h"
 #include "../lib/FiniteStateEntropy/lib/hist.h"
 #include "../lib/FiniteStateEntropy/lib/error_public.h"
 #include "bits.hpp"
 #include "exceptions.hpp"
+#include "pos_constants.hpp"
 #include "util.hpp"
 
+#include <memory>
 #include <mutex>
 
 class TMemoCache {
@@ -90,6 +95,59 @@ private:
 
 TMemoCache tmCache;
 
+// What the interleaved park deltas need to know about the FSE tables of an R
+// value. It's recorded when the tables are built, FSE keeps it in private
+// table headers
+struct FSETableInfo {
+    // the largest delta the tables can encode
+    unsigned max_symbol = 0;
+    // every symbol reads at least one bit, FSE_decodeSymbolFast() works
+    bool fast = false;
+};
+
+// The FSE tables of the R values plots are encoded with: kRValues for the
+// parks of tables 1-6 and kC3R for the C3 blocks. They are built once, by the
+// first thread that needs them, and never change after that, so encoding and
+// decoding with them doesn't take any locks. Other R values go through
+// tmCache.
+class FSETables {
+public:
+    // kRValues[0] to kRValues[5], then kC3R
+    static constexpr int kNumTables = 7;
+
+    static FSETables const &Get()
+    {
+        static FSETables const tables;
+        return tables;
+    }
+
+    // The index of the tables for R, or -1 if R isn't one of them
+    static int Index(double const R)
+    {
+        for (int i = 0; i < kNumTables - 1; ++i) {
+            if (kRValues[i] == R) return i;
+        }
+        return R == kC3R ? kNumTables - 1 : -1;
+    }
+
+    FSE_CTable const *CT(int const index) const { return ct_[index].get(); }
+    FSE_DTable const *DT(int const index) const { return dt_[index].get(); }
+    FSETableInfo const &Info(int const index) const { return info_[index]; }
+
+private:
+    FSETables();
+
+    FSETableInfo info_[kNumTables];
+    std::unique_ptr<FSE_CTable, void (*)(FSE_CTable *)> ct_[kNumTables] = {
+        {nullptr, FSE_freeCTable}, {nullptr, FSE_freeCTable}, {nullptr, FSE_freeCTable},
+        {nullptr, FSE_freeCTable}, {nullptr, FSE_freeCTable}, {nullptr, FSE_freeCTable},
+        {nullptr, FSE_freeCTable}};
+    std::unique_ptr<FSE_DTable, void (*)(FSE_DTable *)> dt_[kNumTables] = {
+        {nullptr, FSE_freeDTable}, {nullptr, FSE_freeDTable}, {nullptr, FSE_freeDTable},
+        {nullptr, FSE_freeDTable}, {nullptr, FSE_freeDTable}, {nullptr, FSE_freeDTable},
+        {nullptr, FSE_freeDTable}};
+};
+
 class Encoding {
 public:
     // Calculates x * (x-1) / 2. Division is done before multiplication.
@@ -123,21 +181,89 @@ public:
         return GetXEnc(x) + y;
     }
 
+    // The integer square root of n, i.e. the largest r with r * r <= n. A
+    // double gives the first 53 bits, which for n < 2^104 is within one or
+    // two of r. Larger n take one integer Newton step first, which restores
+    // full precision. Then r is corrected exactly
+    static uint64_t Isqrt(uint128_t const n)
+    {
+        double const d =
+            double(uint64_t(n >> 64)) * 18446744073709551616.0 + double(uint64_t(n));
+        double const estimate = std::sqrt(d);
+        // the largest r whose square fits in 128 bits
+        uint64_t const max_r = ~uint64_t(0);
+        uint64_t r = estimate >= 18446744073709551615.0 ? max_r : uint64_t(estimate);
+        if ((n >> 104) != 0 && r != 0) {
+            uint128_t const next = ((uint128_t)r + n / r) / 2;
+            r = (next >> 64) != 0 ? max_r : uint64_t(next);
+        }
+        while ((uint128_t)r * r > n) --r;
+        while (r != max_r && (uint128_t)(r + 1) * (r + 1) <= n) ++r;
+        return r;
+    }
+
+    // The largest x with GetXEnc(x) <= index. That's x * (x - 1) / 2 <= index,
+    // or (2x - 1)^2 <= 8 * index + 1, so x = (1 + isqrt(8 * index + 1)) / 2
+    static uint64_t LinePointToX(uint128_t const index)
+    {
+        if ((index >> 124) != 0) {
+            // 8 * index + 1 overflows, only for line points no plot has.
+            // Performs a square root bit by bit
+            uint64_t x = 0;
+            for (int8_t i = 63; i >= 0; i--) {
+                uint64_t new_x = x + ((uint64_t)1 << i);
+                if (GetXEnc(new_x) <= index)
+                    x = new_x;
+            }
+            return x;
+        }
+        return uint64_t(((uint128_t)Isqrt(index * 8 + 1) + 1) / 2);
+    }
+
     // Does the opposite as the above function, deterministicaly mapping a one dimensional
     // line point into a 2d pair. However, we do not recover the original ordering here.
     static std::pair<uint64_t, uint64_t> LinePointToSquare(uint128_t index)
     {
-        // Performs a square root, without the use of doubles, to use the precision of the
+        // Performs a square root, without losing the precision of the
         // uint128_t.
-        uint64_t x = 0;
-        for (int8_t i = 63; i >= 0; i--) {
-            uint64_t new_x = x + ((uint64_t)1 << i);
-            if (GetXEnc(new_x) <= index)
-                x = new_x;
-        }
+        uint64_t const x = LinePointToX(index);
         return std::pair<uint64_t, uint64_t>(x, index - GetXEnc(x));
     }
 
+    // LinePointToSquare() for "n" line points. The square roots are
+    // estimated for a batch of line points first, then corrected one by one,
+    // which keeps several square roots in flight
+    static void LinePointsToSquares(
+        uint128_t const *line_points,
+        size_t const n,
+        std::pair<uint64_t, uint64_t> *out)
+    {
+        constexpr size_t kBatch = 64;
+        double estimates[kBatch];
+        for (size_t begin = 0; begin < n; begin += kBatch) {
+            size_t const end = std::min(n, begin + kBatch);
+            for (size_t i = begin; i < end; ++i) {
+                uint128_t const v = line_points[i] * 8 + 1;
+                estimates[i - begin] = std::sqrt(
+                    double(uint64_t(v >> 64)) * 18446744073709551616.0 + double(uint64_t(v)));
+            }
+            for (size_t i = begin; i < end; ++i) {
+                uint128_t const index = line_points[i];
+                if ((index >> 100) != 0) {
+                    // the estimate isn't precise enough to just be corrected
+                    out[i] = LinePointToSquare(index);
+                    continue;
+                }
+                uint128_t const v = index * 8 + 1;
+                uint64_t r = uint64_t(estimates[i - begin]);
+                while ((uint128_t)r * r > v) --r;
+                while ((uint128_t)(r + 1) * (r + 1) <= v) ++r;
+                uint64_t const x = (r + 1) / 2;
+                out[i] = std::pair<uint64_t, uint64_t>(x, index - GetXEnc(x));
+            }
+        }
+    }
+
     static std::vector<short> CreateNormalizedCount(double R)
     {
         std::vector<double> dpdf;
@@ -178,26 +304,77 @@ public:
         return ans;
     }
 
-    static size_t ANSEncodeDeltas(std::vector<unsigned char> deltas, double R, uint8_t *out)
+    // The log2 of the size of the FSE tables
+    static constexpr unsigned kTableLog = 14;
+
+    static FSE_CTable *CreateCTable(double R)
+    {
+        std::vector<short> nCount = Encoding::CreateNormalizedCount(R);
+        unsigned maxSymbolValue = nCount.size() - 1;
+        unsigned tableLog = kTableLog;
+
+        if (maxSymbolValue > 255)
+            throw std::invalid_argument("maxSymbolValue > 255");
+        FSE_CTable *ct = FSE_createCTable(maxSymbolValue, tableLog);
+        size_t err = FSE_buildCTable(ct, nCount.data(), maxSymbolValue, tableLog);
+        if (FSE_isError(err)) {
+            FSE_freeCTable(ct);
+            throw InvalidStateException(FSE_getErrorName(err));
+        }
+        return ct;
+    }
+
+    static FSE_DTable *CreateDTable(double R)
     {
-        if (!tmCache.CTExists(R)) {
-            std::vector<short> nCount = Encoding::CreateNormalizedCount(R);
-            unsigned maxSymbolValue = nCount.size() - 1;
-            unsigned tableLog = 14;
+        std::vector<short> nCount = Encoding::CreateNormalizedCount(R);
+        unsigned maxSymbolValue = nCount.size() - 1;
+        unsigned tableLog = kTableLog;
 
-            if (maxSymbolValue > 255)
-                throw std::invalid_argument("maxSymbolValue > 255");
-            FSE_CTable *ct = FSE_createCTable(maxSymbolValue, tableLog);
-            size_t err = FSE_buildCTable(ct, nCount.data(), maxSymbolValue, tableLog);
-            if (FSE_isError(err)) {
-                throw InvalidStateException(FSE_getErrorName(err));
-            }
-            tmCache.CTAssign(R, ct);
+        FSE_DTable *dt = FSE_createDTable(tableLog);
+        size_t err = FSE_buildDTable(dt, nCount.data(), maxSymbolValue, tableLog);
+        if (FSE_isError(err)) {
+            FSE_freeDTable(dt);
+            throw InvalidStateException(FSE_getErrorName(err));
+        }
+        return dt;
+    }
+
+    static FSETableInfo CreateTableInfo(double R)
+    {
+        std::vector<short> nCount = Encoding::CreateNormalizedCount(R);
+        FSETableInfo info;
+        info.max_symbol = nCount.size() - 1;
+        // A symbol with half of the table or more can read 0 bits
+        info.fast = std::all_of(nCount.begin(), nCount.end(), [](short const c) {
+            return c < short(1 << (kTableLog - 1));
+        });
+        return info;
+    }
+
+    // Encodes "num_deltas" deltas into "out", which has room for
+    // "out_capacity" bytes, without allocating. Returns the encoded size, or
+    // 0 if it doesn't fit (or there are less than 3 deltas). The encoder
+    // needs 8 bytes of slack, it only succeeds if the encoded size is at most
+    // out_capacity - 8
+    static size_t ANSEncodeDeltas(
+        const uint8_t *deltas,
+        size_t num_deltas,
+        double R,
+        uint8_t *out,
+        size_t out_capacity)
+    {
+        FSE_CTable const *ct = GetCTable(R);
+        size_t const ret = FSE_compress_usingCTable(out, out_capacity, deltas, num_deltas, ct);
+        if (FSE_isError(ret)) {
+            throw InvalidStateException(FSE_getErrorName(ret));
         }
+        return ret;
+    }
 
-        FSE_CTable *ct = tmCache.CTGet(R);
-        return FSE_compress_usingCTable(
-            out, deltas.size() * 8, static_cast<void *>(deltas.data()), deltas.size(), ct);
+    // "out" must have room for 8 bytes per delta
+    static size_t ANSEncodeDeltas(const std::vector<unsigned char> &deltas, double R, uint8_t *out)
+    {
+        return ANSEncodeDeltas(deltas.data(), deltas.size(), R, out, deltas.size() * 8);
     }
 
     static void ANSFree(double R)
@@ -205,41 +382,213 @@ public:
         // Cache all entries, only free on close
     }
 
+    // Decodes "num_deltas" deltas into "deltas", without allocating. If the
+    // input holds fewer, the rest are 0. Throws if the input is corrupt
+    static void ANSDecodeDeltas(
+        const uint8_t *inp,
+        size_t inp_size,
+        size_t num_deltas,
+        double R,
+        uint8_t *deltas)
+    {
+        FSE_DTable const *dt = GetDTable(R);
+        size_t const decoded = FSE_decompress_usingDTable(deltas, num_deltas, inp, inp_size, dt);
+        if (FSE_isError(decoded)) {
+            throw InvalidStateException(FSE_getErrorName(decoded));
+        }
+        // 0xff is never a valid delta. The check runs over the deltas just
+        // decoded, while they're still in cache
+        if (memchr(deltas, 0xff, decoded) != nullptr) {
+            throw InvalidStateException("Bad delta detected");
+        }
+        memset(deltas + decoded, 0, num_deltas - decoded);
+    }
+
     static std::vector<uint8_t> ANSDecodeDeltas(
         const uint8_t *inp,
         size_t inp_size,
         int numDeltas,
         double R)
     {
-        if (!tmCache.DTExists(R)) {
-            std::vector<short> nCount = Encoding::CreateNormalizedCount(R);
-            unsigned maxSymbolValue = nCount.size() - 1;
-            unsigned tableLog = 14;
+        std::vector<uint8_t> deltas(numDeltas);
+        ANSDecodeDeltas(inp, inp_size, deltas.size(), R, deltas.data());
+        return deltas;
+    }
 
-            FSE_DTable *dt = FSE_createDTable(tableLog);
-            size_t err = FSE_buildDTable(dt, nCount.data(), maxSymbolValue, tableLog);
-            if (FSE_isError(err)) {
-                throw InvalidStateException(FSE_getErrorName(err));
+    // Encodes the deltas of a park in kFormatDescriptionInterleaved, like
+    // ANSEncodeDeltas(). Delta i goes to stream i % kParkDeltaStreams, each
+    // stream has one ANS state. The format is:
+    // [2 bytes number of deltas] [2 bytes size of each stream but the last] [streams]
+    // Returns 0 if the deltas don't fit, or there are fewer than
+    // kParkDeltaStreams of them. The same 8 bytes of slack are needed
+    static size_t ANSEncodeInterleavedDeltas(
+        const uint8_t *deltas,
+        size_t num_deltas,
+        double R,
+        uint8_t *out,
+        size_t out_capacity)
+    {
+        size_t const header_size = 2 * kParkDeltaStreams;
+        if (num_deltas < kParkDeltaStreams || num_deltas > 0xffff || out_capacity < header_size) {
+            return 0;
+        }
+        FSE_CTable const *ct = GetCTable(R);
+        // symbols beyond the table can't be encoded
+        unsigned const max_symbol = GetTableInfo(R).max_symbol;
+        if (*std::max_element(deltas, deltas + num_deltas) > max_symbol) return 0;
+
+        Util::IntToTwoBytes(out, num_deltas);
+        uint8_t *stream = out + header_size;
+        for (uint32_t s = 0; s < kParkDeltaStreams; ++s) {
+            BIT_CStream_t bits;
+            if (ERR_isError(BIT_initCStream(&bits, stream, out + out_capacity - stream))) return 0;
+            FSE_CState_t state;
+            FSE_initCState(&state, ct);
+            // ANS is last in first out, the deltas are encoded backwards so
+            // that they're decoded forwards. The bit container takes 4
+            // symbols between flushes
+            for (size_t i = InterleavedStreamSize(num_deltas, s); i-- > 0;) {
+                FSE_encodeSymbol(&bits, &state, deltas[i * kParkDeltaStreams + s]);
+                if (i % 4 == 0) BIT_flushBits(&bits);
             }
-            tmCache.DTAssign(R, dt);
+            FSE_flushCState(&bits, &state);
+            size_t const size = BIT_closeCStream(&bits);
+            if (size == 0 || size > 0xffff) return 0;
+            if (s + 1 < kParkDeltaStreams) Util::IntToTwoBytes(out + 2 + 2 * s, size);
+            stream += size;
         }
+        return stream - out;
+    }
 
-        FSE_DTable *dt = tmCache.DTGet(R);
+    // Decodes the output of ANSEncodeInterleavedDeltas() into "deltas",
+    // which has room for "max_deltas". Returns the number of deltas, the
+    // rest are 0. Throws if the input is corrupt
+    static size_t ANSDecodeInterleavedDeltas(
+        const uint8_t *inp,
+        size_t inp_size,
+        size_t max_deltas,
+        double R,
+        uint8_t *deltas)
+    {
+        size_t const header_size = 2 * kParkDeltaStreams;
+        if (inp_size < header_size) {
+            throw InvalidStateException("Invalid size for interleaved deltas");
+        }
+        size_t const num_deltas = Util::TwoBytesToInt(inp);
+        if (num_deltas < kParkDeltaStreams || num_deltas > max_deltas) {
+            throw InvalidStateException("Invalid number of deltas: " + std::to_string(num_deltas));
+        }
+        FSE_DTable const *dt = GetDTable(R);
+
+        BIT_DStream_t bits[kParkDeltaStreams];
+        FSE_DState_t states[kParkDeltaStreams];
+        uint8_t const *stream = inp + header_size;
+        uint8_t const *const end = inp + inp_size;
+        for (uint32_t s = 0; s < kParkDeltaStreams; ++s) {
+            size_t const size =
+                s + 1 < kParkDeltaStreams ? Util::TwoBytesToInt(inp + 2 + 2 * s) : end - stream;
+            if (size > size_t(end - stream) || ERR_isError(BIT_initDStream(&bits[s], stream, size))) {
+                throw InvalidStateException("Invalid interleaved deltas stream");
+            }
+            FSE_initDState(&states[s], &bits[s], dt);
+            stream += size;
+        }
 
-        std::vector<uint8_t> deltas(numDeltas);
-        size_t err = FSE_decompress_usingDTable(&deltas[0], numDeltas, inp, inp_size, dt);
+        size_t const rounds = num_deltas / kParkDeltaStreams;
+        if (GetTableInfo(R).fast) {
+            DecodeInterleavedRounds<true>(bits, states, deltas, rounds);
+        } else {
+            DecodeInterleavedRounds<false>(bits, states, deltas, rounds);
+        }
+        // the first num_deltas % kParkDeltaStreams streams have one more delta
+        for (uint32_t s = 0; s < kParkDeltaStreams; ++s) {
+            BIT_reloadDStream(&bits[s]);
+            if (s < num_deltas % kParkDeltaStreams) {
+                deltas[rounds * kParkDeltaStreams + s] = FSE_decodeSymbol(&states[s], &bits[s]);
+                BIT_reloadDStream(&bits[s]);
+            }
+            if (!BIT_endOfDStream(&bits[s])) {
+                throw InvalidStateException("Invalid interleaved deltas stream");
+            }
+        }
 
-        if (FSE_isError(err)) {
-            throw InvalidStateException(FSE_getErrorName(err));
+        if (memchr(deltas, 0xff, num_deltas) != nullptr) {
+            throw InvalidStateException("Bad delta detected");
         }
+        memset(deltas + num_deltas, 0, max_deltas - num_deltas);
+        return num_deltas;
+    }
+
+private:
+    static FSE_CTable const *GetCTable(double const R)
+    {
+        int const index = FSETables::Index(R);
+        if (index >= 0) return FSETables::Get().CT(index);
+        if (!tmCache.CTExists(R)) tmCache.CTAssign(R, CreateCTable(R));
+        return tmCache.CTGet(R);
+    }
+
+    static FSE_DTable const *GetDTable(double const R)
+    {
+        int const index = FSETables::Index(R);
+        if (index >= 0) return FSETables::Get().DT(index);
+        if (!tmCache.DTExists(R)) tmCache.DTAssign(R, CreateDTable(R));
+        return tmCache.DTGet(R);
+    }
+
+    // Other R values aren't cached, they're only used by tests
+    static FSETableInfo GetTableInfo(double const R)
+    {
+        int const index = FSETables::Index(R);
+        return index >= 0 ? FSETables::Get().Info(index) : CreateTableInfo(R);
+    }
 
-        for (uint32_t i = 0; i < deltas.size(); i++) {
-            if (deltas[i] == 0xff) {
-                throw InvalidStateException("Bad delta detected");
+    // Decodes "rounds" deltas from each stream into "out", round-robin. The
+    // streams don't depend on each other, so the table lookups of all the
+    // states are in flight at once, instead of one after the other. The
+    // streams are indexed with constants only, which keeps them in registers.
+    // "fast" is for tables where every symbol reads at least one bit
+    template <bool fast>
+    static void DecodeInterleavedRounds(
+        BIT_DStream_t (&bits)[kParkDeltaStreams],
+        FSE_DState_t (&states)[kParkDeltaStreams],
+        uint8_t *out,
+        size_t const rounds)
+    {
+        static_assert(kParkDeltaStreams == 4, "the rounds decode 4 streams");
+        auto decode = [](FSE_DState_t &state, BIT_DStream_t &stream) {
+            return fast ? FSE_decodeSymbolFast(&state, &stream) : FSE_decodeSymbol(&state, &stream);
+        };
+        for (size_t r = 0; r < rounds; ++r, out += kParkDeltaStreams) {
+            out[0] = decode(states[0], bits[0]);
+            out[1] = decode(states[1], bits[1]);
+            out[2] = decode(states[2], bits[2]);
+            out[3] = decode(states[3], bits[3]);
+            // a reload leaves at least 57 bits, enough for 4 symbols per stream
+            if (r % 4 == 3) {
+                BIT_reloadDStream(&bits[0]);
+                BIT_reloadDStream(&bits[1]);
+                BIT_reloadDStream(&bits[2]);
+                BIT_reloadDStream(&bits[3]);
             }
         }
-        return deltas;
+    }
+
+    // The number of the "num_deltas" deltas that go to stream "s"
+    static size_t InterleavedStreamSize(size_t const num_deltas, uint32_t const s)
+    {
+        return (num_deltas + kParkDeltaStreams - 1 - s) / kParkDeltaStreams;
     }
 };
 
+inline FSETables::FSETables()
+{
+    for (int i = 0; i < kNumTables; ++i) {
+        double const R = i < kNumTables - 1 ? kRValues[i] : kC3R;
+        ct_[i].reset(Encoding::CreateCTable(R));
+        dt_[i].reset(Encoding::CreateDTable(R));
+        info_[i] = Encoding::CreateTableInfo(R);
+    }
+}
+
 #endif  // SRC_CPP_ENCODING_HPP_
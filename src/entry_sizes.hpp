@@ -91,13 +91,18 @@ public:
 
     static uint32_t CalculateLinePointSize(uint8_t k) { return Util::ByteAlign(2 * k) / 8; }
 
-    // This is the full size of the deltas section in a park. However, it will not be fully filled
-    static uint32_t CalculateMaxDeltasSize(uint8_t k, uint8_t table_index)
+    // This is the full size of the deltas section in a park. However, it will not be fully filled.
+    // "interleaved" is for plots in kFormatDescriptionInterleaved
+    static uint32_t CalculateMaxDeltasSize(
+        uint8_t k,
+        uint8_t table_index,
+        bool const interleaved = false)
     {
+        uint32_t const extra = interleaved ? kInterleavedDeltasOverhead : 0;
         if (table_index == 1) {
-            return Util::ByteAlign((kEntriesPerPark - 1) * kMaxAverageDeltaTable1) / 8;
+            return Util::ByteAlign((kEntriesPerPark - 1) * kMaxAverageDeltaTable1) / 8 + extra;
         }
-        return Util::ByteAlign((kEntriesPerPark - 1) * kMaxAverageDelta) / 8;
+        return Util::ByteAlign((kEntriesPerPark - 1) * kMaxAverageDelta) / 8 + extra;
     }
 
     static uint32_t CalculateStubsSize(uint32_t k)
@@ -105,10 +110,36 @@ public:
         return Util::ByteAlign((kEntriesPerPark - 1) * (k - kStubMinusBits)) / 8;
     }
 
-    static uint32_t CalculateParkSize(uint8_t k, uint8_t table_index)
+    static uint32_t CalculateParkSize(uint8_t k, uint8_t table_index, bool const interleaved = false)
     {
         return CalculateLinePointSize(k) + CalculateStubsSize(k) +
-               CalculateMaxDeltasSize(k, table_index);
+               CalculateMaxDeltasSize(k, table_index, interleaved);
+    }
+
+    // Calculates the size of the final plot file, given the number of entries in
+    // each table after backpropagation (in table_sizes[1] to table_sizes[7]). Parks and
+    // checkpoints all have fixed sizes, so this is exact, except that phase 3 may write
+    // one f7 entry less than table 7 has, which can save one P7 park.
+    static uint64_t CalculatePlotSize(
+        uint8_t k,
+        uint32_t header_size,
+        const std::vector<uint64_t> &table_sizes,
+        bool const interleaved = false)
+    {
+        uint64_t size = header_size;
+        // Table i's parks hold the line points of table i + 1's entries
+        for (uint8_t table_index = 1; table_index < 7; table_index++) {
+            size += cdiv(table_sizes[table_index + 1], kEntriesPerPark) *
+                    CalculateParkSize(k, table_index, interleaved);
+        }
+        uint64_t const num_f7 = table_sizes[7];
+        uint64_t const num_C1 = cdiv(num_f7, kCheckpoint1Interval);
+        uint64_t const num_C2 = cdiv(num_C1, kCheckpoint2Interval);
+        size += std::max(cdiv(num_f7, kEntriesPerPark), uint64_t(1)) *
+                (Util::ByteAlign((k + 1) * kEntriesPerPark) / 8);
+        size += (num_C1 + 1 + num_C2 + 1) * (Util::ByteAlign(k) / 8);
+        size += num_C1 * CalculateC3Size(k);
+        return size;
     }
 };
 
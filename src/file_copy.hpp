@@ -0,0 +1,338 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_FILE_COPY_HPP_
+#define SRC_CPP_FILE_COPY_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "chia_filesystem.hpp"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+// Copies the final plot file from tempdir2 to the final dir. The file is split
+// into chunks which are copied concurrently, each one with the cheapest method
+// the two file systems support:
+//
+// 1. copy_file_range(), which never moves the data through user space, and
+//    lets file systems (and NFS/SMB servers) copy server-side.
+// 2. sendfile(), the same thing for file systems that only allow it between
+//    different devices.
+// 3. pread()/pwrite() through an aligned buffer, with O_DIRECT where it's
+//    supported, so a 100 GiB copy doesn't evict everything else from the page
+//    cache.
+//
+// A method that fails with "not supported" is skipped for the rest of the copy.
+// Copying can be throttled to a number of bytes per second, shared by all
+// threads, so the copy to a slow farm disk doesn't starve the temp I/O of the
+// next plot.
+struct FileCopier {
+    struct options_t {
+        // the number of chunks copied concurrently
+        uint32_t num_threads = 4;
+        uint64_t chunk_size = 64 * 1024 * 1024;
+        // 0 means unlimited
+        uint64_t bytes_per_second = 0;
+        // seconds between throughput reports, 0 disables them
+        uint32_t report_interval = 30;
+        // skip copy_file_range() and sendfile()
+        bool read_write_only = false;
+    };
+
+    explicit FileCopier(options_t const& options) : options_(options)
+    {
+        options_.num_threads = std::max<uint32_t>(options_.num_threads, 1);
+        // whole pages, for O_DIRECT
+        options_.chunk_size = std::max<uint64_t>(options_.chunk_size / kAlign * kAlign, kAlign);
+    }
+
+    // Copies "from" to "to", overwriting it. Errors are reported through "ec",
+    // like fs::copy() does
+    void Copy(fs::path const& from, fs::path const& to, std::error_code& ec)
+    {
+        ec.clear();
+#ifdef _WIN32
+        fs::copy(from, to, fs::copy_options::overwrite_existing, ec);
+#else
+        int const in = ::open(from.c_str(), O_RDONLY);
+        if (in < 0) return SetError(ec);
+        struct stat st;
+        if (::fstat(in, &st) != 0) {
+            SetError(ec);
+            ::close(in);
+            return;
+        }
+        size_ = st.st_size;
+        int const out = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out < 0 || ::ftruncate(out, size_) != 0) {
+            SetError(ec);
+            ::close(in);
+            if (out >= 0) ::close(out);
+            return;
+        }
+        ::close(out);
+        ::close(in);
+
+        from_ = from;
+        to_ = to;
+        next_chunk_ = 0;
+        copied_ = 0;
+        error_ = 0;
+        done_threads_ = 0;
+        method_ = options_.read_write_only ? kReadWrite : kCopyFileRange;
+        start_ = std::chrono::steady_clock::now();
+
+        uint64_t const num_chunks = (size_ + options_.chunk_size - 1) / options_.chunk_size;
+        uint32_t const num_threads = std::min<uint64_t>(options_.num_threads, num_chunks);
+        std::vector<std::thread> threads;
+        for (uint32_t i = 0; i < num_threads; ++i) {
+            threads.emplace_back(&FileCopier::CopyThread, this);
+        }
+        Report(num_threads);
+        for (auto& t : threads) t.join();
+
+        if (error_ != 0) {
+            ec = std::error_code(error_, std::generic_category());
+            return;
+        }
+        double const seconds = Elapsed();
+        std::cout << "Copied " << size_ / (1024 * 1024) << " MiB in " << seconds << " seconds ("
+                  << Throughput(size_, seconds) << " MiB/s)" << std::endl;
+#endif
+    }
+
+private:
+    static constexpr uint64_t kAlign = 4096;
+    // Limits the size of single calls, so the bandwidth limit is applied
+    // smoothly and errors are noticed early
+    static constexpr uint64_t kMaxIoSize = 8 * 1024 * 1024;
+
+    enum method_t { kCopyFileRange, kSendFile, kReadWrite };
+
+#ifndef _WIN32
+    static void SetError(std::error_code& ec)
+    {
+        ec = std::error_code(errno, std::generic_category());
+    }
+
+    double Elapsed() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+    static double Throughput(uint64_t const bytes, double const seconds)
+    {
+        return seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0.0;
+    }
+
+    // Prints progress until all threads are done
+    void Report(uint32_t const num_threads)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto const interval = std::chrono::seconds(options_.report_interval);
+        auto next = std::chrono::steady_clock::now() + interval;
+        while (done_threads_ < num_threads) {
+            if (options_.report_interval == 0) {
+                done_.wait(lock);
+                continue;
+            }
+            if (done_.wait_until(lock, next) != std::cv_status::timeout) continue;
+            next += interval;
+            uint64_t const copied = copied_;
+            std::cout << "Copied " << copied / (1024 * 1024) << "/" << size_ / (1024 * 1024)
+                      << " MiB (" << Throughput(copied, Elapsed()) << " MiB/s)" << std::endl;
+        }
+    }
+
+    // The files as opened by one copy thread
+    struct files_t {
+        int in = -1;
+        int out = -1;
+        // opened with O_DIRECT, on first use of the read/write method
+        int direct_in = -1;
+        int direct_out = -1;
+        bool direct_opened = false;
+        uint8_t* buf = nullptr;
+
+        ~files_t()
+        {
+            for (int const fd : {in, out, direct_in, direct_out}) {
+                if (fd >= 0) ::close(fd);
+            }
+            ::free(buf);
+        }
+    };
+
+    void CopyThread()
+    {
+        {
+            files_t f;
+            f.in = ::open(from_.c_str(), O_RDONLY);
+            f.out = ::open(to_.c_str(), O_WRONLY);
+            if (f.in < 0 || f.out < 0) {
+                Fail(errno);
+            } else {
+                for (;;) {
+                    uint64_t const begin = next_chunk_++ * options_.chunk_size;
+                    if (begin >= size_ || error_ != 0) break;
+                    uint64_t const end = std::min(begin + options_.chunk_size, size_);
+                    if (!CopyChunk(f, begin, end)) break;
+                }
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++done_threads_;
+        done_.notify_all();
+    }
+
+    bool CopyChunk(files_t& f, uint64_t begin, uint64_t const end)
+    {
+        while (begin < end) {
+            uint64_t const n = std::min(end - begin, kMaxIoSize);
+            int64_t r = -1;
+            int const method = method_;
+#ifdef __linux__
+            if (method == kCopyFileRange) {
+                loff_t off_in = begin;
+                loff_t off_out = begin;
+                r = ::copy_file_range(f.in, &off_in, f.out, &off_out, n, 0);
+            } else if (method == kSendFile) {
+                off_t off_in = begin;
+                r = ::lseek(f.out, begin, SEEK_SET) < 0 ? -1 : ::sendfile(f.out, f.in, &off_in, n);
+            }
+#endif
+            if (method == kReadWrite) r = ReadWrite(f, begin, n);
+
+            if (r < 0) {
+                if (errno == EINTR || errno == EAGAIN) continue;
+                if (method != kReadWrite && Unsupported(errno)) {
+                    // fall back to the next method, for all threads
+                    int expected = method;
+                    method_.compare_exchange_strong(expected, method + 1);
+                    continue;
+                }
+                Fail(errno);
+                return false;
+            }
+            if (r == 0) {
+                // the file shrunk underneath us
+                Fail(EIO);
+                return false;
+            }
+            begin += r;
+            copied_ += r;
+            Throttle();
+        }
+        return true;
+    }
+
+    static bool Unsupported(int const err)
+    {
+        return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP;
+    }
+
+    // Copies up to "n" bytes at "begin" through a buffer. Whole pages are
+    // read and written with O_DIRECT when both file systems allow it, the
+    // unaligned tail of the file goes through the page cache. So do the bytes
+    // up to the next page if "begin" isn't aligned, which happens when
+    // another method copied part of a page before failing
+    int64_t ReadWrite(files_t& f, uint64_t const begin, uint64_t const n)
+    {
+        if (!f.buf && ::posix_memalign(reinterpret_cast<void**>(&f.buf), kAlign, kMaxIoSize) != 0) {
+            f.buf = nullptr;
+            errno = ENOMEM;
+            return -1;
+        }
+#ifdef O_DIRECT
+        if (!f.direct_opened) {
+            f.direct_opened = true;
+            f.direct_in = ::open(from_.c_str(), O_RDONLY | O_DIRECT);
+            f.direct_out = ::open(to_.c_str(), O_WRONLY | O_DIRECT);
+        }
+#endif
+        bool const can_direct = f.direct_in >= 0 && f.direct_out >= 0;
+        uint64_t const to_page = (kAlign - begin % kAlign) % kAlign;
+        bool const direct = can_direct && to_page == 0 && n >= kAlign;
+        uint64_t len = n;
+        if (direct) {
+            len = n / kAlign * kAlign;
+        } else if (can_direct && to_page != 0) {
+            len = std::min(n, to_page);
+        }
+        int64_t const r = ::pread(direct ? f.direct_in : f.in, f.buf, len, begin);
+        if (r <= 0) return r;
+        // a short read leaves an unaligned length, that's written buffered
+        int const out = (direct && r % kAlign == 0) ? f.direct_out : f.out;
+        for (int64_t written = 0; written < r;) {
+            int64_t const w = ::pwrite(out, f.buf + written, r - written, begin + written);
+            if (w < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            written += w;
+        }
+        return r;
+    }
+
+    // Sleeps until the bytes copied so far are within the bandwidth limit
+    void Throttle() const
+    {
+        if (options_.bytes_per_second == 0) return;
+        auto const due = start_ + std::chrono::duration<double>(
+                                      double(copied_) / options_.bytes_per_second);
+        std::this_thread::sleep_until(due);
+    }
+
+    void Fail(int const err)
+    {
+        int expected = 0;
+        error_.compare_exchange_strong(expected, err);
+    }
+#endif
+
+    options_t options_;
+
+    fs::path from_;
+    fs::path to_;
+    uint64_t size_ = 0;
+    std::chrono::steady_clock::time_point start_;
+
+    // shared by the copy threads
+    std::atomic<uint64_t> next_chunk_{0};
+    std::atomic<uint64_t> copied_{0};
+    std::atomic<int> method_{kCopyFileRange};
+    std::atomic<int> error_{0};
+
+    std::mutex mutex_;
+    std::condition_variable done_;
+    uint32_t done_threads_ = 0;
+};
+
+#endif  // SRC_CPP_FILE_COPY_HPP_
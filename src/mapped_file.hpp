@@ -0,0 +1,131 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_MAPPED_FILE_HPP_
+#define SRC_CPP_MAPPED_FILE_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <utility>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// A read-only memory mapping of (part of) a file. Sort buckets and temp tables
+// can be read through one instead of being copied into staging buffers; the
+// data is read straight from the page cache, and read-ahead is left to the
+// kernel (as hinted by the access pattern).
+//
+// Mapped reads are off by default. They're turned on by the API (Enable()),
+// the CLI (--mmap) or the environment (CHIAPOS_MMAP=1). Where mapping isn't
+// supported (Windows), or fails, callers fall back to regular reads.
+struct MappedFile {
+    enum advice_t { sequential, random };
+
+    MappedFile() = default;
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    MappedFile(MappedFile &&other) noexcept { *this = std::move(other); }
+
+    MappedFile &operator=(MappedFile &&other) noexcept
+    {
+        Reset();
+        base_ = other.base_;
+        mapped_size_ = other.mapped_size_;
+        data_ = other.data_;
+        size_ = other.size_;
+        other.base_ = nullptr;
+        other.data_ = nullptr;
+        other.mapped_size_ = 0;
+        other.size_ = 0;
+        return *this;
+    }
+
+    ~MappedFile() { Reset(); }
+
+    static std::atomic<bool> &EnabledFlag()
+    {
+        static std::atomic<bool> enabled{[] {
+            char const *env = std::getenv("CHIAPOS_MMAP");
+            return env != nullptr && *env != '\0' && *env != '0';
+        }()};
+        return enabled;
+    }
+
+    static bool Enabled() { return EnabledFlag().load(std::memory_order_relaxed); }
+    static void Enable(bool const enable = true) { EnabledFlag() = enable; }
+
+    // Maps "length" bytes at "offset" of the open file "fd". Returns false if
+    // the file can't be mapped
+    bool Map(int const fd, uint64_t const offset, uint64_t const length, advice_t const advice)
+    {
+        Reset();
+#ifdef _WIN32
+        (void)fd;
+        (void)offset;
+        (void)length;
+        (void)advice;
+        return false;
+#else
+        if (length == 0) return false;
+        // mappings start at a page boundary
+        uint64_t const page = ::sysconf(_SC_PAGESIZE);
+        uint64_t const aligned_offset = offset / page * page;
+        uint64_t const mapped_size = length + (offset - aligned_offset);
+        void *const base = ::mmap(nullptr, mapped_size, PROT_READ, MAP_SHARED, fd, aligned_offset);
+        if (base == MAP_FAILED) return false;
+        base_ = base;
+        mapped_size_ = mapped_size;
+        data_ = static_cast<uint8_t const *>(base) + (offset - aligned_offset);
+        size_ = length;
+
+        // these are all just hints, failures don't matter
+        ::madvise(base_, mapped_size_, advice == sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+        ::madvise(base_, mapped_size_, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+        // only honored by file systems that support huge pages in the page
+        // cache (e.g. tmpfs mounted with huge=), it saves on TLB misses there
+        ::madvise(base_, mapped_size_, MADV_HUGEPAGE);
+#endif
+        return true;
+#endif
+    }
+
+    void Reset()
+    {
+#ifndef _WIN32
+        if (base_ != nullptr) ::munmap(base_, mapped_size_);
+#endif
+        base_ = nullptr;
+        mapped_size_ = 0;
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    uint8_t const *data() const noexcept { return data_; }
+    uint64_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return data_ == nullptr; }
+
+private:
+    void *base_ = nullptr;
+    uint64_t mapped_size_ = 0;
+    uint8_t const *data_ = nullptr;
+    uint64_t size_ = 0;
+};
+
+#endif  // SRC_CPP_MAPPED_FILE_HPP_
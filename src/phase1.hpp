@@ -39,6 +39,7 @@
 #include "chia_filesystem.hpp"
 
 #include "calculate_bucket.hpp"
+#include "compressed_disk.hpp"
 #include "entry_sizes.hpp"
 #include "exceptions.hpp"
 #include "pos_constants.hpp"
@@ -59,7 +60,7 @@ struct THREADDATA {
     uint8_t pos_size;
     uint64_t prevtableentries;
     uint32_t compressed_entry_size_bytes;
-    std::vector<FileDisk>* ptmp_1_disks;
+    std::vector<CompressedDisk>* ptmp_1_disks;
 };
 
 struct GlobalData {
@@ -128,7 +129,7 @@ void* phase1_thread(THREADDATA* ptd)
     uint8_t const pos_size = ptd->pos_size;
     uint64_t const prevtableentries = ptd->prevtableentries;
     uint32_t const compressed_entry_size_bytes = ptd->compressed_entry_size_bytes;
-    std::vector<FileDisk>* ptmp_1_disks = ptd->ptmp_1_disks;
+    std::vector<CompressedDisk>* ptmp_1_disks = ptd->ptmp_1_disks;
 
     Timer start_time; // 开始时间
 
@@ -601,7 +602,7 @@ void* F1thread(int const index, uint8_t const k, const uint8_t* id, std::mutex*
 // 首先，计算F1，这是特殊的，因为它使用ChaCha8，并且每个加密提供多个输出值。
 // 然后，计算f函数的其余部分，并对每个表进行磁盘排序。
 std::vector<uint64_t> RunPhase1(
-    std::vector<FileDisk>& tmp_1_disks,
+    std::vector<CompressedDisk>& tmp_1_disks,
     uint8_t const k,
     const uint8_t* const id,
     std::string const tmp_dirname,
@@ -612,7 +613,8 @@ std::vector<uint64_t> RunPhase1(
     uint32_t const stripe_size,
     uint8_t const num_threads,
     bool const enable_bitfield,
-    bool const show_progress)
+    bool const show_progress,
+    RamBudget* const ram_budget)
 {
     std::cout << "Computing table 1" << std::endl;  // Computing table 1
     globals.stripe_size = stripe_size; // 条纹深度
@@ -630,7 +632,10 @@ std::vector<uint64_t> RunPhase1(
         tmp_dirname,
         filename + ".p1.t1",
         0,
-        globals.stripe_size);
+        globals.stripe_size,
+        strategy_t::uniform,
+        ram_budget);
+    globals.L_sort_manager->Preallocate(1ULL << k);
 
     //这些是用于在磁盘上排序。磁盘代码上的排序需要知道每个bucket中有多少元素。
     // These are used for sorting on disk. The sort on disk code needs to know how
@@ -702,7 +707,18 @@ std::vector<uint64_t> RunPhase1(
             tmp_dirname,
             filename + ".p1.t" + std::to_string(table_index + 1),
             0,
-            globals.stripe_size);
+            globals.stripe_size,
+            strategy_t::uniform,
+            ram_budget);
+
+        // 预先分配磁盘空间，右表的条目数量和左表大致相同
+        // The right table has about as many entries as the left one. Preallocating
+        // avoids fragmenting the files as they grow
+        globals.R_sort_manager->Preallocate(prevtableentries);
+        tmp_1_disks[table_index].Preallocate(prevtableentries * compressed_entry_size_bytes);
+        if (table_index == 6) {
+            tmp_1_disks[table_index + 1].Preallocate(prevtableentries * right_entry_size_bytes);
+        }
 
         globals.L_sort_manager->TriggerNewBucket(0);
 
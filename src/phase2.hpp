@@ -15,12 +15,18 @@
 #ifndef SRC_CPP_PHASE2_HPP_
 #define SRC_CPP_PHASE2_HPP_
 
+#include <type_traits>
+#include <vector>
+
+#include "compressed_disk.hpp"
 #include "disk.hpp"
 #include "entry_sizes.hpp"
 #include "sort_manager.hpp"
 #include "bitfield.hpp"
 #include "bitfield_index.hpp"
+#include "compressed_bitfield.hpp"
 #include "progress.hpp"
+#include "threading.hpp"
 
 struct Phase2Results
 {
@@ -36,12 +42,64 @@ struct Phase2Results
     std::vector<uint64_t> table_sizes;
 };
 
+// Phase 2 reads each table in batches of this many entries (a whole number of
+// compressed blocks and of bitfield words), both scans of a batch are split
+// between the threads
+constexpr int64_t kPhase2BatchEntries = 1024 * 1024;
+
+// Calls fn(thread, begin, end) for one contiguous slice of [0, n) per worker.
+// The slices start at multiples of 64, so no two threads touch the same word
+// of a bitfield that's indexed like the entries. Used by phase 3 too
+template <typename Fn>
+inline void RunInSlices(WorkerThreads& workers, int64_t const n, Fn const& fn)
+{
+    int const num_threads = workers.size();
+    if (num_threads <= 1 || n <= 64) {
+        fn(0, 0, n);
+        return;
+    }
+    int64_t const slice = cdiv(cdiv(n, 64), num_threads) * 64;
+    workers.Run([&fn, n, slice](int const t) {
+        int64_t const begin = std::min(n, t * slice);
+        int64_t const end = std::min(n, begin + slice);
+        fn(t, begin, end);
+    });
+}
+
+// The number of entries of a table that are kept among the first "n" entries
+// of the batch starting at entry "batch_start". Nothing is dropped from table 7
+template <typename Bitfield>
+inline int64_t KeptBefore(
+    int const table_index,
+    Bitfield const& current_bitfield,
+    int64_t const batch_start,
+    int64_t const n)
+{
+    if (table_index == 7) return n;
+    return current_bitfield.count(batch_start, batch_start + n);
+}
+
+// From this k on, phase 2 uses compressed bitfields if the dense ones don't
+// fit in memory_size and the compressed ones are smaller
+constexpr uint8_t kMinCompressedBitfieldK = 33;
+
+// The bitfield table 1 is filtered with in phase 3
+inline bitfield ToFilter(bitfield& b, int64_t) { return std::move(b); }
+
+inline bitfield ToFilter(compressed_bitfield& b, int64_t const table_size)
+{
+    bitfield ret = b.to_bitfield(table_size);
+    b.free_memory();
+    return ret;
+}
+
 // Backpropagate takes in as input, a file on which forward propagation has been done.
 // The purpose of backpropagate is to eliminate any dead entries that don't contribute
 // to final values in f7, to minimize disk usage. A sort on disk is applied to each table,
 // so that they are sorted by position.
-Phase2Results RunPhase2(
-    std::vector<FileDisk> &tmp_1_disks,
+template <typename Bitfield, typename BitfieldIndex>
+Phase2Results RunPhase2Impl(
+    std::vector<CompressedDisk> &tmp_1_disks,
     std::vector<uint64_t> table_sizes,
     uint8_t const k,
     const uint8_t *id,
@@ -50,7 +108,9 @@ Phase2Results RunPhase2(
     uint64_t memory_size,
     uint32_t const num_buckets,
     uint32_t const log_num_buckets,
-    bool const show_progress)
+    uint8_t const num_threads,
+    bool const show_progress,
+    RamBudget* const ram_budget)
 {
     // After pruning each table will have 0.865 * 2^k or fewer entries on
     // average
@@ -65,6 +125,9 @@ Phase2Results RunPhase2(
     std::vector<uint64_t> new_table_sizes(8, 0);
     new_table_sizes[7] = table_sizes[7];
 
+    // the scans of every batch are split between these, they're only started once
+    WorkerThreads workers(num_threads);
+
     // Iterates through each table, starting at 6 & 7. Each iteration, we scan
     // the current table twice. In the first scan, we:
 
@@ -82,8 +145,8 @@ Phase2Results RunPhase2(
     int64_t const max_table_size = *std::max_element(table_sizes.begin()
         , table_sizes.end());
 
-    bitfield next_bitfield(max_table_size);
-    bitfield current_bitfield(max_table_size);
+    Bitfield next_bitfield(max_table_size);
+    Bitfield current_bitfield(max_table_size);
 
     std::vector<std::unique_ptr<SortManager>> output_files;
 
@@ -105,36 +168,82 @@ Phase2Results RunPhase2(
         int64_t const table_size = table_sizes[table_index];
         int16_t const entry_size = cdiv(k + kOffsetSize + (table_index == 7 ? k : 0), 8);
 
-        BufferedDisk disk(&tmp_1_disks[table_index], table_size * entry_size);
+        RandomAccessDisk& disk = tmp_1_disks[table_index];
+        int64_t const batch_entries = std::min<int64_t>(kPhase2BatchEntries, table_size);
+        // entries are sliced 8 bytes at a time, the padding keeps the reads of
+        // the last entry in bounds
+        std::unique_ptr<uint8_t[]> batch(new uint8_t[batch_entries * entry_size + 7]());
+
+        // The first scan keeps the decoded (pos, offset) of the entries that
+        // aren't dropped (and f7, for table 7) if they fit in memory, then the
+        // second scan doesn't have to read the table again. They get the
+        // part of memory_size the sort manager of the second scan doesn't
+        // use, or else a share of the RAM budget for temp files.
+        int64_t const kept = table_index == 7 ? table_size : current_bitfield.count(0, table_size);
+        uint64_t const columns_size = kept * (table_index == 7 ? 16 : 8);
+        uint64_t const sort_memory = table_index == 2 ? memory_size : memory_size / 2;
+        uint64_t budget_taken = 0;
+        bool keep_columns = kept > 0 && columns_size <= memory_size - sort_memory;
+        if (!keep_columns && kept > 0 && ram_budget != nullptr &&
+            ram_budget->Acquire(columns_size)) {
+            budget_taken = columns_size;
+            keep_columns = true;
+        }
+        std::unique_ptr<uint64_t[]> pos_offsets;
+        std::unique_ptr<uint64_t[]> f7s;
+        if (keep_columns) {
+            pos_offsets.reset(new uint64_t[kept]);
+            if (table_index == 7) f7s.reset(new uint64_t[kept]);
+        }
 
         // read_index is the number of entries we've processed so far (in the
-        // current table) i.e. the index to the current entry. This is not used
-        // for table 7
-
-        int64_t read_cursor = 0;
-        for (int64_t read_index = 0; read_index < table_size; ++read_index, read_cursor += entry_size)
-        {
-            uint8_t const* entry = disk.Read(read_cursor, entry_size);
-
-            uint64_t entry_pos_offset = 0;
-            if (table_index == 7) {
-                // table 7 is special, we never drop anything, so just build
-                // next_bitfield
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, k, pos_offset_size);
-            } else {
-                if (!current_bitfield.get(read_index))
-                {
-                    // This entry should be dropped.
-                    continue;
+        // current table) i.e. the index to the current entry. The threads
+        // only set bits in next_bitfield, which they do atomically, so it
+        // doesn't matter which thread gets to a word first
+
+        // the number of entries kept before the current batch
+        int64_t kept_before = 0;
+        for (int64_t batch_start = 0; batch_start < table_size; batch_start += batch_entries) {
+            int64_t const n = std::min(batch_entries, table_size - batch_start);
+            disk.Read(batch_start * entry_size, batch.get(), n * entry_size);
+
+            RunInSlices(workers, n, [&](int, int64_t const begin, int64_t const end) {
+                // the index of the slice's first kept entry
+                int64_t column = KeptBefore(table_index, current_bitfield, batch_start, begin);
+                column += kept_before;
+
+                for (int64_t i = begin; i < end; ++i) {
+                    int64_t const read_index = batch_start + i;
+                    uint8_t const* entry = batch.get() + i * entry_size;
+
+                    uint64_t entry_pos_offset = 0;
+                    if (table_index == 7) {
+                        // table 7 is special, we never drop anything, so just
+                        // build next_bitfield
+                        entry_pos_offset = Util::SliceInt64FromBytes(entry, k, pos_offset_size);
+                        if (keep_columns) f7s[column] = Util::SliceInt64FromBytes(entry, 0, k);
+                    } else {
+                        if (!current_bitfield.get(read_index)) {
+                            // This entry should be dropped.
+                            continue;
+                        }
+                        entry_pos_offset = Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
+                    }
+                    if (keep_columns) pos_offsets[column] = entry_pos_offset;
+                    ++column;
+
+                    uint64_t entry_pos = entry_pos_offset >> kOffsetSize;
+                    uint64_t entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
+                    // mark the two matching entries as used (pos and pos+offset)
+                    next_bitfield.set_atomic(entry_pos);
+                    next_bitfield.set_atomic(entry_pos + entry_offset);
                 }
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
-            }
+            });
+            kept_before += KeptBefore(table_index, current_bitfield, batch_start, n);
+        }
 
-            uint64_t entry_pos = entry_pos_offset >> kOffsetSize;
-            uint64_t entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
-            // mark the two matching entries as used (pos and pos+offset)
-            next_bitfield.set(entry_pos);
-            next_bitfield.set(entry_pos + entry_offset);
+        if constexpr (std::is_same<Bitfield, compressed_bitfield>::value) {
+            next_bitfield.optimize();
         }
 
         std::cout << "scanned table " << table_index << std::endl;
@@ -155,7 +264,7 @@ Phase2Results RunPhase2(
         // table 2.
 
         auto sort_manager = std::make_unique<SortManager>(
-            table_index == 2 ? memory_size : memory_size / 2,
+            sort_memory,
             num_buckets,
             log_num_buckets,
             new_entry_size,
@@ -163,37 +272,25 @@ Phase2Results RunPhase2(
             filename + ".p2.t" + std::to_string(table_index),
             uint32_t(k),
             0,
-            strategy_t::quicksort_last);
+            strategy_t::quicksort_last,
+            ram_budget);
+        if (table_index != 7) {
+            sort_manager->Preallocate(kept);
+        }
 
         // as we scan the table for the second time, we'll also need to remap
-        // the positions and offsets based on the next_bitfield.
-        bitfield_index const index(next_bitfield);
-
-        read_cursor = 0;
-        int64_t write_counter = 0;
-        for (int64_t read_index = 0; read_index < table_size; ++read_index, read_cursor += entry_size)
-        {
-            uint8_t const* entry = disk.Read(read_cursor, entry_size);
-
-            uint64_t entry_f7 = 0;
-            uint64_t entry_pos_offset;
-            if (table_index == 7) {
-                // table 7 is special, we never drop anything, so just build
-                // next_bitfield
-                entry_f7 = Util::SliceInt64FromBytes(entry, 0, k);
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, k, pos_offset_size);
-            } else {
-                // skipping
-                if (!current_bitfield.get(read_index)) continue;
-
-                entry_pos_offset = Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
-            }
-
+        // the positions and offsets based on the next_bitfield. The index is
+        // only read from here on, so it's shared by all threads.
+        BitfieldIndex const index(next_bitfield);
+
+        // Remaps the (pos, offset) of an entry and encodes the new entry at
+        // "dst". Returns the end of the new entry
+        auto const remap = [&](
+            uint64_t const entry_f7, uint64_t entry_pos_offset, int64_t const counter,
+            uint8_t* const dst) {
             uint64_t entry_pos = entry_pos_offset >> kOffsetSize;
             uint64_t entry_offset = entry_pos_offset & ((1U << kOffsetSize) - 1);
 
-            // assemble the new entry and write it to the sort manager
-
             // map the pos and offset to the new, compacted, positions and
             // offsets
             std::tie(entry_pos, entry_offset) = index.lookup(entry_pos, entry_offset);
@@ -207,27 +304,112 @@ Phase2Results RunPhase2(
                 new_entry |= (uint128_t)entry_pos_offset << t7_pos_offset_shift;
                 Util::IntTo16Bytes(bytes, new_entry);
 
-                disk.Write(read_index * entry_size, bytes, entry_size);
+                memcpy(dst, bytes, entry_size);
+                return dst + entry_size;
             }
-            else {
-                // The new entry is slightly different. Metadata is dropped, to
-                // save space, and the counter of the entry is written (sort_key). We
-                // use this instead of (y + pos + offset) since its smaller.
-                uint128_t new_entry = (uint128_t)write_counter << write_counter_shift;
-                new_entry |= (uint128_t)entry_pos_offset << pos_offset_shift;
-                Util::IntTo16Bytes(bytes, new_entry);
+            // The new entry is slightly different. Metadata is dropped, to
+            // save space, and the counter of the entry is written (sort_key).
+            // We use this instead of (y + pos + offset) since its smaller.
+            uint128_t new_entry = (uint128_t)counter << write_counter_shift;
+            new_entry |= (uint128_t)entry_pos_offset << pos_offset_shift;
+            Util::IntTo16Bytes(bytes, new_entry);
+
+            memcpy(dst, bytes, new_entry_size);
+            return dst + new_entry_size;
+        };
+
+        // Each thread remaps a slice of the batch into a buffer of its own. A
+        // slice's first write_counter is known up-front, it's the number of
+        // entries kept before it, i.e. a popcount of current_bitfield. The
+        // buffers are then handed to the sort manager in order, so the output
+        // is the same as with a single thread.
+        std::vector<std::vector<uint8_t>> out(std::max<int>(num_threads, 1));
+        if (table_index == 7) {
+            // table 7 is rewritten in place, a batch at a time
+            out[0].resize(batch_entries * entry_size);
+        }
 
-                sort_manager->AddToCache(bytes);
+        // Hands the remapped entries of a batch on. For table 7, where
+        // nothing is dropped, the batch starts at entry "batch_start"
+        auto const output_batch = [&](int64_t const batch_start, int64_t const n) {
+            if (table_index == 7) {
+                disk.Write(batch_start * entry_size, out[0].data(), n * entry_size);
+                return;
+            }
+            for (std::vector<uint8_t>& slice : out) {
+                for (size_t i = 0; i < slice.size(); i += new_entry_size) {
+                    sort_manager->AddToCache(slice.data() + i);
+                }
+                slice.clear();
+            }
+        };
+
+        // the start of a thread's output, for a slice that starts at entry
+        // "begin" of the batch and has room for "n" entries
+        auto const slice_output = [&](int const t, int64_t const begin, int64_t const n) {
+            if (table_index == 7) return out[0].data() + begin * entry_size;
+            out[t].resize(n * new_entry_size);
+            return out[t].data();
+        };
+
+        if (keep_columns) {
+            // the kept entries are all there is, write_counter is their index
+            batch.reset();
+            for (int64_t batch_start = 0; batch_start < kept; batch_start += batch_entries) {
+                int64_t const n = std::min(batch_entries, kept - batch_start);
+                RunInSlices(workers, n, [&](int const t, int64_t begin, int64_t end) {
+                    uint8_t* dst = slice_output(t, begin, end - begin);
+                    for (int64_t i = batch_start + begin; i < batch_start + end; ++i) {
+                        dst = remap(table_index == 7 ? f7s[i] : 0, pos_offsets[i], i, dst);
+                    }
+                });
+                output_batch(batch_start, n);
+            }
+            pos_offsets.reset();
+            f7s.reset();
+            if (budget_taken > 0) ram_budget->Release(budget_taken);
+        } else {
+            int64_t kept_before = 0;
+            for (int64_t batch_start = 0; batch_start < table_size; batch_start += batch_entries) {
+                int64_t const n = std::min(batch_entries, table_size - batch_start);
+                disk.Read(batch_start * entry_size, batch.get(), n * entry_size);
+
+                RunInSlices(workers, n, [&](int const t, int64_t begin, int64_t end) {
+                    int64_t counter = kept_before +
+                                      KeptBefore(table_index, current_bitfield, batch_start, begin);
+                    uint8_t* const start = slice_output(t, begin, end - begin);
+                    uint8_t* dst = start;
+
+                    for (int64_t i = begin; i < end; ++i) {
+                        int64_t const read_index = batch_start + i;
+                        uint8_t const* entry = batch.get() + i * entry_size;
+
+                        if (table_index == 7) {
+                            dst = remap(
+                                Util::SliceInt64FromBytes(entry, 0, k),
+                                Util::SliceInt64FromBytes(entry, k, pos_offset_size),
+                                counter++,
+                                dst);
+                        } else if (current_bitfield.get(read_index)) {
+                            uint64_t const pos_offset =
+                                Util::SliceInt64FromBytes(entry, 0, pos_offset_size);
+                            dst = remap(0, pos_offset, counter++, dst);
+                        }
+                    }
+                    if (table_index != 7) out[t].resize(dst - start);
+                });
+                output_batch(batch_start, n);
+                kept_before += KeptBefore(table_index, current_bitfield, batch_start, n);
             }
-            ++write_counter;
         }
+        int64_t const write_counter = kept;
 
         if (table_index != 7) {
             sort_manager->FlushCache();
             sort_timer.PrintElapsed("sort time = ");
 
             // clear disk caches
-            disk.FreeMemory();
+            tmp_1_disks[table_index].FreeMemory();
             sort_manager->FreeMemory();
 
             output_files[table_index - 2] = std::move(sort_manager);
@@ -264,12 +446,58 @@ Phase2Results RunPhase2(
 
     std::cout << "table " << table_index << " new size: " << new_table_sizes[table_index] << std::endl;
 
+    next_bitfield.free_memory();
     return {
-        FilteredDisk(std::move(disk), std::move(current_bitfield), entry_size)
+        FilteredDisk(std::move(disk), ToFilter(current_bitfield, table_size), entry_size)
         , BufferedDisk(&tmp_1_disks[7], new_table_sizes[7] * new_entry_size)
         , std::move(output_files)
         , std::move(new_table_sizes)
     };
 }
 
+Phase2Results RunPhase2(
+    std::vector<CompressedDisk> &tmp_1_disks,
+    std::vector<uint64_t> table_sizes,
+    uint8_t const k,
+    const uint8_t *id,
+    const std::string &tmp_dirname,
+    const std::string &filename,
+    uint64_t memory_size,
+    uint32_t const num_buckets,
+    uint32_t const log_num_buckets,
+    uint8_t const num_threads,
+    bool const show_progress,
+    RamBudget* const ram_budget)
+{
+    // The two dense bitfields take a bit per entry of the largest table each,
+    // plus the rank index, a quarter of a bitfield. Compressed bitfields are
+    // slower, they're only used if they take less. That's if tables keep few
+    // of their entries: the bitfield of table i has at most two bits set per
+    // entry of table i + 1. At phase 2's usual density they don't save anything
+    uint64_t const max_table_size = *std::max_element(table_sizes.begin(), table_sizes.end());
+    uint64_t const dense_size = max_table_size / 8 * 2 + max_table_size / 32;
+    uint64_t compressed_size = 0;
+    for (int table_index = 1; table_index < 7; ++table_index) {
+        uint64_t const size = compressed_bitfield::EstimateMemoryUsage(
+            table_sizes[table_index], 2 * table_sizes[table_index + 1]);
+        compressed_size = std::max(compressed_size, 2 * size);
+    }
+    bool const forced = compressed_bitfield::Forced();
+    if (forced || (k >= kMinCompressedBitfieldK && dense_size > memory_size &&
+                   compressed_size < dense_size)) {
+        if (forced) {
+            std::cout << "Using compressed bitfields (forced)" << std::endl;
+        } else {
+            std::cout << "Using compressed bitfields, about " << compressed_size / (1024 * 1024)
+                      << "MiB instead of " << dense_size / (1024 * 1024) << "MiB" << std::endl;
+        }
+        return RunPhase2Impl<compressed_bitfield, compressed_bitfield_index>(
+            tmp_1_disks, table_sizes, k, id, tmp_dirname, filename, memory_size, num_buckets,
+            log_num_buckets, num_threads, show_progress, ram_budget);
+    }
+    return RunPhase2Impl<bitfield, bitfield_index>(
+        tmp_1_disks, table_sizes, k, id, tmp_dirname, filename, memory_size, num_buckets,
+        log_num_buckets, num_threads, show_progress, ram_budget);
+}
+
 #endif  // SRC_CPP_PHASE2_HPP
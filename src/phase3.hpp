@@ -20,8 +20,17 @@
 #include "exceptions.hpp"
 #include "pos_constants.hpp"
 #include "sort_manager.hpp"
+#include "threading.hpp"
 #include "progress.hpp"
 
+// The first pass of phase 3 reads the right table in batches of this many
+// entries
+constexpr int64_t kPhase3BatchEntries = 1024 * 1024;
+
+// The number of park batches that may wait for the park writer, while the
+// next one is being filled
+constexpr int kPhase3QueuedParkBatches = 2;
+
 // Results of phase 3. These are passed into Phase 4, so the checkpoint tables
 // can be properly built.
 struct Phase3Results {
@@ -33,6 +42,9 @@ struct Phase3Results {
 
     uint32_t header_size;
     std::unique_ptr<SortManager> table7_sm;
+    // The stage that writes to the plot. It may still be writing the last
+    // parks, phase 4 queues its writes behind them
+    std::unique_ptr<StageThread> plot_writer;
 };
 
 // This writes a number of entries into a file, in the final, optimized format. The park
@@ -42,10 +54,12 @@ struct Phase3Results {
 // have many entries in each park, we can approximate how much space each park with take. Format
 // is: [2k bits of first_line_point]  [EPP-1 stubs] [Deltas size] [EPP-1 deltas]....
 // [first_line_point] ...
-void WriteParkToFile(
-    FileDisk &final_disk,
-    uint64_t table_start,
-    uint64_t park_index,
+//
+// EncodePark() builds the park in park_buffer (park_size_bytes of it are the
+// park, the rest is scratch space), it doesn't share any state, so parks can
+// be encoded concurrently. With "interleaved" the deltas are encoded for
+// kFormatDescriptionInterleaved.
+inline void EncodePark(
     uint32_t park_size_bytes,
     uint128_t first_line_point,
     const std::vector<uint8_t> &park_deltas,
@@ -53,25 +67,21 @@ void WriteParkToFile(
     uint8_t k,
     uint8_t table_index,
     uint8_t *park_buffer,
-    uint64_t const park_buffer_size)
+    uint64_t const park_buffer_size,
+    bool const interleaved = false)
 {
-    // Parks are fixed size, so we know where to start writing. The deltas will not go over
-    // into the next park.
-    uint64_t writer = table_start + park_index * park_size_bytes;
     uint8_t *index = park_buffer;
 
     first_line_point <<= 128 - 2 * k;
     Util::IntTo16Bytes(index, first_line_point);
     index += EntrySizes::CalculateLinePointSize(k);
 
-    // We use ParkBits instead of Bits since it allows storing more data
-    ParkBits park_stubs_bits;
-    for (uint64_t stub : park_stubs) {
-        park_stubs_bits.AppendValue(stub, (k - kStubMinusBits));
-    }
+    // The stubs are packed straight into the park
+    BitWriter park_stubs_bits(index);
+    park_stubs_bits.AppendAll(park_stubs.data(), park_stubs.size(), k - kStubMinusBits);
+    park_stubs_bits.Finish();
     uint32_t stubs_size = EntrySizes::CalculateStubsSize(k);
     uint32_t stubs_valid_size = cdiv(park_stubs_bits.GetSize(), 8);
-    park_stubs_bits.ToBytes(index);
     memset(index + stubs_valid_size, 0, stubs_size - stubs_valid_size);
     index += stubs_size;
 
@@ -79,7 +89,19 @@ void WriteParkToFile(
     // be small, so we can compress them
     double R = kRValues[table_index - 1];
     uint8_t *deltas_start = index + 2;
-    size_t deltas_size = Encoding::ANSEncodeDeltas(park_deltas, R, deltas_start);
+    size_t deltas_size = 0;
+    if (interleaved) {
+        // Limited to the park, the encoder needs 8 bytes of slack after it
+        assert(park_buffer_size >= park_size_bytes + 8);
+        deltas_size = Encoding::ANSEncodeInterleavedDeltas(
+            park_deltas.data(),
+            park_deltas.size(),
+            R,
+            deltas_start,
+            park_size_bytes + 8 - (deltas_start - park_buffer));
+    } else {
+        deltas_size = Encoding::ANSEncodeDeltas(park_deltas, R, deltas_start);
+    }
 
     if (!deltas_size) {
         // Uncompressed
@@ -101,10 +123,139 @@ void WriteParkToFile(
             " bytes. Space: " + std::to_string(park_buffer_size));
     }
     memset(index, 0x00, park_size_bytes - (index - park_buffer));
+}
 
+void WriteParkToFile(
+    FileDisk &final_disk,
+    uint64_t table_start,
+    uint64_t park_index,
+    uint32_t park_size_bytes,
+    uint128_t first_line_point,
+    const std::vector<uint8_t> &park_deltas,
+    const std::vector<uint64_t> &park_stubs,
+    uint8_t k,
+    uint8_t table_index,
+    uint8_t *park_buffer,
+    uint64_t const park_buffer_size)
+{
+    // Parks are fixed size, so we know where to start writing. The deltas will not go over
+    // into the next park.
+    uint64_t writer = table_start + park_index * park_size_bytes;
+    EncodePark(
+        park_size_bytes,
+        first_line_point,
+        park_deltas,
+        park_stubs,
+        k,
+        table_index,
+        park_buffer,
+        park_buffer_size);
     final_disk.Write(writer, (uint8_t *)park_buffer, park_size_bytes);
 }
 
+// The parks of a table that are encoded together, by num_threads worker
+// threads, and written to the plot with a single write
+struct ParkBatch {
+    struct park_t {
+        uint128_t checkpoint_line_point = 0;
+        std::vector<uint8_t> deltas;
+        std::vector<uint64_t> stubs;
+    };
+
+    // parks per thread in a batch
+    static constexpr uint32_t kParksPerThread = 64;
+
+    ParkBatch(
+        uint8_t const k,
+        uint8_t const table_index,
+        uint32_t const park_size_bytes,
+        uint64_t const park_buffer_size,
+        uint8_t const num_threads,
+        bool const interleaved)
+        : k_(k)
+        , table_index_(table_index)
+        , park_size_bytes_(park_size_bytes)
+        , park_buffer_size_(park_buffer_size)
+        , num_threads_(std::max<uint8_t>(num_threads, 1))
+        , interleaved_(interleaved)
+        , parks_(num_threads_ * kParksPerThread)
+        , buffer_(new uint8_t[parks_.size() * park_size_bytes])
+    {
+        for (int t = 0; t < num_threads_; ++t) {
+            scratch_.emplace_back(new uint8_t[park_buffer_size]);
+        }
+    }
+
+    bool full() const { return size_ == parks_.size(); }
+    bool empty() const { return size_ == 0; }
+
+    // Drops the last park added, it won't be written
+    void RemoveLast() { --size_; }
+
+    // Starts the next park in the batch. It must not be full()
+    park_t &Add(uint128_t const checkpoint_line_point)
+    {
+        park_t &p = parks_[size_++];
+        p.checkpoint_line_point = checkpoint_line_point;
+        p.deltas.clear();
+        p.stubs.clear();
+        return p;
+    }
+
+    // The number of entries in the parks added since the last Write()
+    uint64_t entries() const
+    {
+        uint64_t ret = 0;
+        for (size_t i = 0; i < size_; ++i) ret += parks_[i].stubs.size() + 1;
+        return ret;
+    }
+
+    // Encodes the parks added since the last call on "encoders", which has
+    // num_threads threads, and writes them at "park_index" of the table
+    // starting at "table_start"
+    void Write(
+        WorkerThreads &encoders,
+        FileDisk &final_disk,
+        uint64_t const table_start,
+        uint64_t const park_index)
+    {
+        encoders.Run([this](int const t) {
+            for (size_t i = t; i < size_; i += num_threads_) {
+                park_t const &p = parks_[i];
+                EncodePark(
+                    park_size_bytes_,
+                    p.checkpoint_line_point,
+                    p.deltas,
+                    p.stubs,
+                    k_,
+                    table_index_,
+                    scratch_[t].get(),
+                    park_buffer_size_,
+                    interleaved_);
+                uint8_t *const dst = buffer_.get() + i * park_size_bytes_;
+                memcpy(dst, scratch_[t].get(), park_size_bytes_);
+            }
+        });
+
+        final_disk.Write(
+            table_start + park_index * park_size_bytes_, buffer_.get(), size_ * park_size_bytes_);
+        size_ = 0;
+    }
+
+private:
+    uint8_t const k_;
+    uint8_t const table_index_;
+    uint32_t const park_size_bytes_;
+    uint64_t const park_buffer_size_;
+    uint8_t const num_threads_;
+    bool const interleaved_;
+    std::vector<park_t> parks_;
+    size_t size_ = 0;
+    std::unique_ptr<uint8_t[]> buffer_;
+    // a park buffer per thread, parks may overflow theirs before that's caught
+    std::vector<std::unique_ptr<uint8_t[]>> scratch_;
+};
+
 // Compresses the plot file tables into the final file. In order to do this, entries must be
 // reorganized from the (pos, offset) bucket sorting order, to a more free line_point sorting
 // order. In (pos, offset ordering), we store two pointers two the previous table, (x, y) which
@@ -128,7 +279,10 @@ Phase3Results RunPhase3(
     uint64_t memory_size,
     uint32_t num_buckets,
     uint32_t log_num_buckets,
-    const bool show_progress)
+    uint8_t const num_threads,
+    const bool show_progress,
+    RamBudget* const ram_budget,
+    bool const interleaved_parks = false)
 {
     uint8_t const pos_size = k;
     uint8_t const line_point_size = 2 * k - 1;
@@ -147,12 +301,24 @@ Phase3Results RunPhase3(
     std::unique_ptr<SortManager> L_sort_manager;
     std::unique_ptr<SortManager> R_sort_manager;
 
-    // These variables are used in the WriteParkToFile method. They are preallocatted here
-    // to save time.
+    // the line points of every batch of the first pass are computed by these
+    WorkerThreads workers(num_threads);
+
+    // Parks are encoded and written to tmp2_disk by this stage, so that the
+    // I/O overlaps with the computation here, also across tables and into
+    // phase 4. It does all writes to tmp2_disk from here on, the disk has a
+    // write buffer which must not be shared between threads
+    auto park_writer = std::make_unique<StageThread>(kPhase3QueuedParkBatches);
+    // the park writer encodes each batch on these. Its jobs may still run in
+    // phase 4, so they share ownership
+    auto park_encoders = std::make_shared<WorkerThreads>(num_threads);
+
+    // The space EncodePark() needs to build a park in. Interleaved parks
+    // need 8 bytes of slack for the encoder
     uint64_t const park_buffer_size = EntrySizes::CalculateLinePointSize(k)
         + EntrySizes::CalculateStubsSize(k) + 2
-        + EntrySizes::CalculateMaxDeltasSize(k, 1);
-    std::unique_ptr<uint8_t[]> park_buffer(new uint8_t[park_buffer_size]);
+        + EntrySizes::CalculateMaxDeltasSize(k, 1, interleaved_parks)
+        + (interleaved_parks ? 8 : 0);
 
     // Iterates through all tables, starting at 1, with L and R pointers.
     // For each table, R entries are rewritten with line points. Then, the right table is
@@ -170,7 +336,8 @@ Phase3Results RunPhase3(
         // entries. entry deltas are encoded with variable length, and thus there is no
         // guarantee that they won't override into the next park. It is only different (larger)
         // for table 1
-        uint32_t park_size_bytes = EntrySizes::CalculateParkSize(k, table_index);
+        uint32_t park_size_bytes =
+            EntrySizes::CalculateParkSize(k, table_index, interleaved_parks);
 
         Disk& right_disk = res2.disk_for_table(table_index + 1);
         Disk& left_disk = res2.disk_for_table(table_index);
@@ -205,149 +372,141 @@ Phase3Results RunPhase3(
             filename + ".p3.t" + std::to_string(table_index + 1),
             0,
             0,
-            strategy_t::quicksort_last);
-
-        bool should_read_entry = true;
-        std::vector<uint64_t> left_new_pos(kCachedPositionsSize);
-
-        uint64_t old_sort_keys[kReadMinusWrite][kMaxMatchesSingleEntry];
-        uint64_t old_offsets[kReadMinusWrite][kMaxMatchesSingleEntry];
-        uint16_t old_counters[kReadMinusWrite];
-        for (uint16_t &old_counter : old_counters) {
-            old_counter = 0;
-        }
-        bool end_of_right_table = false;
-        uint64_t current_pos = 0;
-        uint64_t end_of_table_pos = 0;
-        uint64_t greatest_pos = 0;
-
-        uint8_t const* left_entry_disk_buf = nullptr;
-
-        uint64_t entry_sort_key, entry_pos, entry_offset;
-        uint64_t cached_entry_sort_key = 0;
-        uint64_t cached_entry_pos = 0;
-        uint64_t cached_entry_offset = 0;
-
-        // Similar algorithm as Backprop, to read both L and R tables simultaneously
-        while (!end_of_right_table || (current_pos - end_of_table_pos <= kReadMinusWrite)) {
-            old_counters[current_pos % kReadMinusWrite] = 0;
-
-            if (end_of_right_table || current_pos <= greatest_pos) {
-                while (!end_of_right_table) {
-                    if (should_read_entry) {
-                        if (right_reader_count == res2.table_sizes[table_index + 1]) {
-                            end_of_right_table = true;
-                            end_of_table_pos = current_pos;
-                            right_disk.FreeMemory();
-                            break;
-                        }
-                        // The right entries are in the format from backprop, (sort_key, pos,
-                        // offset)
-                        uint8_t const* right_entry_buf = right_disk.Read(right_reader, p2_entry_size_bytes);
-                        right_reader += p2_entry_size_bytes;
-                        right_reader_count++;
-
-                        entry_sort_key =
-                            Util::SliceInt64FromBytes(right_entry_buf, 0, right_sort_key_size);
-                        entry_pos = Util::SliceInt64FromBytes(
-                            right_entry_buf, right_sort_key_size, pos_size);
-                        entry_offset = Util::SliceInt64FromBytes(
-                            right_entry_buf, right_sort_key_size + pos_size, kOffsetSize);
-                    } else if (cached_entry_pos == current_pos) {
-                        entry_sort_key = cached_entry_sort_key;
-                        entry_pos = cached_entry_pos;
-                        entry_offset = cached_entry_offset;
-                    } else {
-                        break;
-                    }
-
-                    should_read_entry = true;
-
-                    if (entry_pos + entry_offset > greatest_pos) {
-                        greatest_pos = entry_pos + entry_offset;
-                    }
-                    if (entry_pos == current_pos) {
-                        uint64_t const old_write_pos = entry_pos % kReadMinusWrite;
-                        old_sort_keys[old_write_pos][old_counters[old_write_pos]] = entry_sort_key;
-                        old_offsets[old_write_pos][old_counters[old_write_pos]] =
-                            (entry_pos + entry_offset);
-                        ++old_counters[old_write_pos];
-                    } else {
-                        should_read_entry = false;
-                        cached_entry_sort_key = entry_sort_key;
-                        cached_entry_pos = entry_pos;
-                        cached_entry_offset = entry_offset;
-                        break;
-                    }
-                }
-
-                if (left_reader_count < res2.table_sizes[table_index]) {
-                    // The left entries are in the new format: (sort_key, new_pos), except for table
-                    // 1: (y, x).
+            strategy_t::quicksort_last,
+            ram_budget);
+        R_sort_manager->Preallocate(res2.table_sizes[table_index + 1]);
+
+        uint64_t const right_table_size = res2.table_sizes[table_index + 1];
+        uint64_t const left_table_size = res2.table_sizes[table_index];
+
+        // The right table is sorted by pos, and an entry points at most
+        // 2^kOffsetSize entries past its pos, so a range of right entries
+        // needs only a window of the left table. The right table is processed
+        // in batches: the right entries and the new positions of the left
+        // entries they point to are read on this thread (the disks and sort
+        // managers can't be shared), then the line points are computed by
+        // num_threads threads, each into a buffer of its own. The buffers are
+        // added to R_sort_manager in order.
+        int64_t const batch_entries =
+            std::max<int64_t>(std::min<int64_t>(kPhase3BatchEntries, right_table_size), 1);
+        std::vector<uint64_t> sort_keys(batch_entries);
+        std::vector<uint64_t> positions(batch_entries);
+        std::vector<uint16_t> offsets(batch_entries);
+        std::vector<std::vector<uint8_t>> out(std::max<int>(num_threads, 1));
+
+        // the new positions of the left entries [left_base, left_reader_count)
+        std::vector<uint64_t> left_new_pos;
+        uint64_t left_base = 0;
+
+        // (line_point, sort_key) fit in a 128 bit integer for all but the
+        // largest k
+        bool const packed_entry = line_point_size + right_sort_key_size <= 128 &&
+                                  right_entry_size_bytes <= 16;
+        uint8_t const line_point_shift = 128 - line_point_size;
+        uint8_t const right_sort_key_shift = line_point_shift - right_sort_key_size;
+
+        while (right_reader_count < right_table_size) {
+            int64_t const n =
+                std::min<int64_t>(batch_entries, right_table_size - right_reader_count);
+            uint64_t needed_end = 0;
+            for (int64_t i = 0; i < n; ++i) {
+                // The right entries are in the format from backprop, (sort_key, pos, offset)
+                uint8_t const* right_entry_buf = right_disk.Read(right_reader, p2_entry_size_bytes);
+                right_reader += p2_entry_size_bytes;
+                right_reader_count++;
+
+                sort_keys[i] = Util::SliceInt64FromBytes(right_entry_buf, 0, right_sort_key_size);
+                positions[i] =
+                    Util::SliceInt64FromBytes(right_entry_buf, right_sort_key_size, pos_size);
+                offsets[i] = Util::SliceInt64FromBytes(
+                    right_entry_buf, right_sort_key_size + pos_size, kOffsetSize);
+                needed_end = std::max(needed_end, positions[i] + offsets[i] + 1);
+            }
 
-                    // TODO: unify these cases once SortManager implements
-                    // the ReadDisk interface
-                    if (table_index == 1) {
-                        left_entry_disk_buf = left_disk.Read(left_reader, left_entry_size_bytes);
-                        left_reader += left_entry_size_bytes;
-                    } else {
-                        left_entry_disk_buf = L_sort_manager->ReadEntry(left_reader);
-                        left_reader += new_pos_entry_size_bytes;
-                    }
-                    left_reader_count++;
-                }
+            // drop the left entries that are behind this batch
+            if (positions[0] > left_base) {
+                uint64_t const drop =
+                    std::min<uint64_t>(positions[0] - left_base, left_new_pos.size());
+                left_new_pos.erase(left_new_pos.begin(), left_new_pos.begin() + drop);
+                left_base += drop;
+            }
+            while (left_reader_count < std::min(needed_end, left_table_size)) {
+                // The left entries are in the new format: (sort_key, new_pos), except for table
+                // 1: (y, x).
 
-                // We read the "new_pos" from the L table, which for table 1 is just x. For
-                // other tables, the new_pos
+                // TODO: unify these cases once SortManager implements
+                // the ReadDisk interface
                 if (table_index == 1) {
+                    uint8_t const* left_entry_disk_buf =
+                        left_disk.Read(left_reader, left_entry_size_bytes);
+                    left_reader += left_entry_size_bytes;
                     // Only k bits, since this is x
-                    left_new_pos[current_pos % kCachedPositionsSize] =
-                        Util::SliceInt64FromBytes(left_entry_disk_buf, 0, k);
+                    left_new_pos.push_back(Util::SliceInt64FromBytes(left_entry_disk_buf, 0, k));
                 } else {
+                    uint8_t const* left_entry_disk_buf = L_sort_manager->ReadEntry(left_reader);
+                    left_reader += new_pos_entry_size_bytes;
                     // k+1 bits in case it overflows
-                    left_new_pos[current_pos % kCachedPositionsSize] =
-                        Util::SliceInt64FromBytes(left_entry_disk_buf, right_sort_key_size, k);
+                    left_new_pos.push_back(
+                        Util::SliceInt64FromBytes(left_entry_disk_buf, right_sort_key_size, k));
                 }
+                left_reader_count++;
+            }
+            if (left_base + left_new_pos.size() < needed_end) {
+                throw InvalidStateException(
+                    "Entry of table " + std::to_string(table_index + 1) +
+                    " points past the end of table " + std::to_string(table_index));
             }
-
-            uint64_t const write_pointer_pos = current_pos - kReadMinusWrite + 1;
 
             // Rewrites each right entry as (line_point, sort_key)
-            if (current_pos + 1 >= kReadMinusWrite) {
-                uint64_t left_new_pos_1 = left_new_pos[write_pointer_pos % kCachedPositionsSize];
-                for (uint32_t counter = 0;
-                     counter < old_counters[write_pointer_pos % kReadMinusWrite];
-                     counter++) {
-                    uint64_t left_new_pos_2 = left_new_pos
-                        [old_offsets[write_pointer_pos % kReadMinusWrite][counter] %
-                         kCachedPositionsSize];
+            RunInSlices(workers, n, [&](int const t, int64_t const begin, int64_t const end) {
+                std::vector<uint8_t>& buf = out[t];
+                // with room for the 16 byte store of the last packed entry
+                buf.resize((end - begin) * right_entry_size_bytes + 16);
+                uint8_t* dst = buf.data();
+                for (int64_t i = begin; i < end; ++i, dst += right_entry_size_bytes) {
+                    uint64_t const left_new_pos_1 = left_new_pos[positions[i] - left_base];
+                    uint64_t const left_new_pos_2 =
+                        left_new_pos[positions[i] + offsets[i] - left_base];
 
                     // A line point is an encoding of two k bit values into one 2k bit value.
-                    uint128_t line_point =
+                    uint128_t const line_point =
                         Encoding::SquareToLinePoint(left_new_pos_1, left_new_pos_2);
 
                     if (left_new_pos_1 > ((uint64_t)1 << k) ||
                         left_new_pos_2 > ((uint64_t)1 << k)) {
-                        std::cout << "left or right positions too large" << std::endl;
-                        std::cout << (line_point > ((uint128_t)1 << (2 * k)));
                         if ((line_point > ((uint128_t)1 << (2 * k)))) {
+                            std::cout << "left or right positions too large" << std::endl;
                             std::cout << "L, R: " << left_new_pos_1 << " " << left_new_pos_2
                                       << std::endl;
                             std::cout << "Line point: " << line_point << std::endl;
                             abort();
                         }
                     }
-                    Bits to_write = Bits(line_point, line_point_size);
-                    to_write.AppendValue(
-                        old_sort_keys[write_pointer_pos % kReadMinusWrite][counter],
-                        right_sort_key_size);
+                    if (packed_entry) {
+                        uint128_t const entry = (line_point << line_point_shift) |
+                                                ((uint128_t)sort_keys[i] << right_sort_key_shift);
+                        Util::IntTo16Bytes(dst, entry);
+                    } else {
+                        Bits to_write = Bits(line_point, line_point_size);
+                        to_write.AppendValue(sort_keys[i], right_sort_key_size);
+                        // ToBytes stores whole words, a Bits holds up to 10 of them
+                        uint8_t bytes[10 * 8];
+                        to_write.ToBytes(bytes);
+                        memcpy(dst, bytes, right_entry_size_bytes);
+                    }
+                }
+                buf.resize((end - begin) * right_entry_size_bytes);
+            });
 
-                    R_sort_manager->AddToCache(to_write);
-                    total_r_entries++;
+            for (std::vector<uint8_t>& buf : out) {
+                for (size_t i = 0; i < buf.size(); i += right_entry_size_bytes) {
+                    R_sort_manager->AddToCache(buf.data() + i);
                 }
+                buf.clear();
             }
-            current_pos += 1;
+            total_r_entries += n;
         }
+        right_disk.FreeMemory();
         computation_pass_1_timer.PrintElapsed("\tFirst computation pass time:");
 
         // Remove no longer needed file
@@ -390,13 +549,46 @@ Phase3Results RunPhase3(
             filename + ".p3s.t" + std::to_string(table_index + 1),
             0,
             0,
-            strategy_t::quicksort_last);
+            strategy_t::quicksort_last,
+            ram_budget);
+        L_sort_manager->Preallocate(res2.table_sizes[table_index + 1]);
+        // The sort keys of tables 2-6 are their entries' indices from phase 2,
+        // so the table is put in order by placing each entry at its sort key.
+        // Table 7's sort key is y, which isn't dense
+        if (table_index < 6) {
+            L_sort_manager->SetDenseKeys(right_sort_key_size);
+        }
 
-        std::vector<uint8_t> park_deltas;
-        std::vector<uint64_t> park_stubs;
-        uint128_t checkpoint_line_point = 0;
+        // Parks are collected in batches, which the park writer encodes in
+        // parallel and writes. The batches are used round-robin: there are
+        // enough of them that the one being filled is never queued or written
+        std::vector<std::shared_ptr<ParkBatch>> batches;
+        for (int i = 0; i < kPhase3QueuedParkBatches + 2; ++i) {
+            batches.push_back(std::make_shared<ParkBatch>(
+                k,
+                table_index,
+                park_size_bytes,
+                park_buffer_size,
+                num_threads,
+                interleaved_parks));
+        }
+        size_t current_batch = 0;
+        ParkBatch::park_t *park = nullptr;
         uint128_t last_line_point = 0;
         uint64_t park_index = 0;
+        // the index of the first park in the batch
+        uint64_t batch_park_index = 0;
+
+        auto submit_parks = [&] {
+            std::shared_ptr<ParkBatch> const batch = batches[current_batch];
+            final_entries_written += batch->entries();
+            uint64_t const table_start = final_table_begin_pointers[table_index];
+            uint64_t const first_park = batch_park_index;
+            park_writer->Submit([batch, park_encoders, &tmp2_disk, table_start, first_park] {
+                batch->Write(*park_encoders, tmp2_disk, table_start, first_park);
+            });
+            current_batch = (current_batch + 1) % batches.size();
+        };
 
         uint8_t *right_reader_entry_buf;
 
@@ -425,28 +617,17 @@ Phase3Results RunPhase3(
             L_sort_manager->AddToCache(bytes);
             added_to_cache++;
 
-            // Every EPP entries, writes a park
+            // Every EPP entries, starts a park. The parks are written once
+            // the batch is full
             if (index % kEntriesPerPark == 0) {
                 if (index != 0) {
-                    WriteParkToFile(
-                        tmp2_disk,
-                        final_table_begin_pointers[table_index],
-                        park_index,
-                        park_size_bytes,
-                        checkpoint_line_point,
-                        park_deltas,
-                        park_stubs,
-                        k,
-                        table_index,
-                        park_buffer.get(),
-                        park_buffer_size);
                     park_index += 1;
-                    final_entries_written += (park_stubs.size() + 1);
                 }
-                park_deltas.clear();
-                park_stubs.clear();
-
-                checkpoint_line_point = line_point;
+                if (batches[current_batch]->full()) {
+                    submit_parks();
+                    batch_park_index = park_index;
+                }
+                park = &batches[current_batch]->Add(line_point);
             }
             uint128_t big_delta = line_point - last_line_point;
 
@@ -463,8 +644,8 @@ Phase3Results RunPhase3(
             assert(small_delta < 256);
 
             if ((index % kEntriesPerPark != 0)) {
-                park_deltas.push_back(small_delta);
-                park_stubs.push_back(stub);
+                park->deltas.push_back(small_delta);
+                park->stubs.push_back(stub);
             }
             last_line_point = line_point;
         }
@@ -473,33 +654,27 @@ Phase3Results RunPhase3(
 
         computation_pass_2_timer.PrintElapsed("\tSecond computation pass time:");
 
-        if (park_deltas.size() > 0) {
-            // Since we don't have a perfect multiple of EPP entries, this writes the last ones
-            WriteParkToFile(
-                tmp2_disk,
-                final_table_begin_pointers[table_index],
-                park_index,
-                park_size_bytes,
-                checkpoint_line_point,
-                park_deltas,
-                park_stubs,
-                k,
-                table_index,
-                park_buffer.get(),
-                park_buffer_size);
-            final_entries_written += (park_stubs.size() + 1);
+        // Since we don't have a perfect multiple of EPP entries, this writes the last ones
+        // (unless the last park has nothing but its checkpoint)
+        if (park != nullptr && park->deltas.empty()) {
+            batches[current_batch]->RemoveLast();
+        }
+        if (!batches[current_batch]->empty()) {
+            submit_parks();
         }
 
-        Encoding::ANSFree(kRValues[table_index - 1]);
         std::cout << "\tWrote " << final_entries_written << " entries" << std::endl;
 
         final_table_begin_pointers[table_index + 1] =
             final_table_begin_pointers[table_index] + (park_index + 1) * park_size_bytes;
 
         final_table_writer = header_size - 8 * (10 - table_index);
-        Util::IntToEightBytes(table_pointer_bytes, final_table_begin_pointers[table_index + 1]);
-        tmp2_disk.Write(final_table_writer, (table_pointer_bytes), 8);
-        final_table_writer += 8;
+        uint64_t const table_pointer = final_table_begin_pointers[table_index + 1];
+        park_writer->Submit([&tmp2_disk, final_table_writer, table_pointer] {
+            uint8_t bytes[8];
+            Util::IntToEightBytes(bytes, table_pointer);
+            tmp2_disk.Write(final_table_writer, bytes, 8);
+        });
 
         table_timer.PrintElapsed("Total compress table time:");
 
@@ -509,7 +684,6 @@ Phase3Results RunPhase3(
     }
 
     L_sort_manager->FreeMemory();
-    park_buffer.reset();
 
     // These results will be used to write table P7 and the checkpoint tables in phase 4.
     return Phase3Results{
@@ -517,7 +691,8 @@ Phase3Results RunPhase3(
         final_entries_written,
         new_pos_entry_size_bytes * 8,
         header_size,
-        std::move(L_sort_manager)};
+        std::move(L_sort_manager),
+        std::move(park_writer)};
 }
 
 #endif  // SRC_CPP_PHASE3_HPP
@@ -15,6 +15,8 @@
 #ifndef SRC_CPP_PHASE4_HPP_
 #define SRC_CPP_PHASE4_HPP_
 
+#include <atomic>
+
 #include "disk.hpp"
 #include "encoding.hpp"
 #include "entry_sizes.hpp"
@@ -23,6 +25,13 @@
 #include "util.hpp"
 #include "progress.hpp"
 
+// Phase 4 reads table 7 in batches of this many entries, a whole number of P7
+// parks and of C3 blocks, so the batches' parks and blocks are independent
+constexpr uint64_t kPhase4BatchEntries = 625 * 2048;
+static_assert(
+    kPhase4BatchEntries % kEntriesPerPark == 0 && kPhase4BatchEntries % kCheckpoint1Interval == 0,
+    "phase 4 batches must hold whole parks and C3 blocks");
+
 // Writes the checkpoint tables. The purpose of these tables, is to store a list of ~2^k values
 // of size k (the proof of space outputs from table 7), in a way where they can be looked up for
 // proofs, but also efficiently. To do this, we assume table 7 is sorted by f7, and we write the
@@ -40,7 +49,8 @@
 // C2 (checkpoint values into)
 // C3 (deltas of f7s between C1 checkpoints)
 void RunPhase4(uint8_t k, uint8_t pos_size, FileDisk &tmp2_disk, Phase3Results &res,
-               const bool show_progress, const int max_phase4_progress_updates)
+               uint8_t const num_threads, const bool show_progress,
+               const int max_phase4_progress_updates)
 {
     uint32_t P7_park_size = Util::ByteAlign((k + 1) * kEntriesPerPark) / 8;
     uint64_t number_of_p7_parks =
@@ -64,100 +74,154 @@ void RunPhase4(uint8_t k, uint8_t pos_size, FileDisk &tmp2_disk, Phase3Results &
 
     uint64_t plot_file_reader = 0;
     uint64_t final_file_writer_1 = begin_byte_C1;
-    uint64_t final_file_writer_2 = begin_byte_C3;
-    uint64_t final_file_writer_3 = res.final_table_begin_pointers[7];
 
-    uint64_t prev_y = 0;
     std::vector<Bits> C2;
-    uint64_t num_C1_entries = 0;
-    std::vector<uint8_t> deltas_to_write;
     uint32_t right_entry_size_bytes = res.right_entry_size_bits / 8;
+    uint32_t const C1_size = Util::ByteAlign(k) / 8;
+    uint64_t const total_entries = res.final_entries_written;
 
-    uint8_t *right_entry_buf;
-    auto C1_entry_buf = new uint8_t[Util::ByteAlign(k) / 8];
-    auto C3_entry_buf = new uint8_t[size_C3];
-    auto P7_entry_buf = new uint8_t[P7_park_size];
+    auto C1_entry_buf = new uint8_t[C1_size];
 
     std::cout << "\tStarting to write C1 and C3 tables" << std::endl;
 
-    ParkBits to_write_p7;
-    const int progress_update_increment = res.final_entries_written / max_phase4_progress_updates;
+    // Table 7 is read in batches on this thread. The P7 parks and C3 blocks
+    // of a batch only depend on the batch's entries, they're encoded by
+    // num_threads threads into buffers laid out like the plot, so each table
+    // gets one write per batch. The writes are queued on phase 3's plot
+    // writer, behind its last parks, and overlap with the next batch
+    uint64_t const batch_entries =
+        std::max<uint64_t>(std::min<uint64_t>(kPhase4BatchEntries, total_entries), 1);
+    uint64_t const max_parks = cdiv(batch_entries, kEntriesPerPark);
+    uint64_t const max_blocks = cdiv(batch_entries, kCheckpoint1Interval);
+    std::vector<uint64_t> ys(batch_entries);
+    std::vector<uint64_t> new_positions(batch_entries);
+
+    struct batch_buffers_t {
+        std::vector<uint8_t> P7;
+        std::vector<uint8_t> C1;
+        std::vector<uint8_t> C3;
+    };
+    // Used round-robin, there are enough of them that the ones being filled
+    // are never queued or being written
+    std::vector<std::shared_ptr<batch_buffers_t>> buffers;
+    for (int i = 0; i < kPhase3QueuedParkBatches + 2; ++i) {
+        buffers.push_back(std::make_shared<batch_buffers_t>());
+        buffers.back()->P7.resize(max_parks * P7_park_size);
+        buffers.back()->C1.resize(max_blocks * C1_size);
+        buffers.back()->C3.resize(max_blocks * size_C3);
+    }
+    size_t current_buffers = 0;
+
+    // the blocks and parks of every batch are encoded by these
+    WorkerThreads workers(num_threads);
+    // C3 blocks are encoded here first, ANSEncodeDeltas() needs 8 bytes of
+    // slack to tell whether a block fits
+    std::vector<std::vector<uint8_t>> C3_scratch(workers.size(), std::vector<uint8_t>(size_C3 + 8));
+    uint64_t const progress_update_increment =
+        std::max<uint64_t>(total_entries / max_phase4_progress_updates, 1);
 
     // We read each table7 entry, which is sorted by f7, but we don't need f7 anymore. Instead,
     // we will just store pos6, and the deltas in table C3, and checkpoints in tables C1 and C2.
-    for (uint64_t f7_position = 0; f7_position < res.final_entries_written; f7_position++) {
-        right_entry_buf = res.table7_sm->ReadEntry(plot_file_reader);
-
-        plot_file_reader += right_entry_size_bytes;
-        uint64_t entry_y = Util::SliceInt64FromBytes(right_entry_buf, 0, k);
-        uint64_t entry_new_pos = Util::SliceInt64FromBytes(right_entry_buf, k, pos_size);
-
-        Bits entry_y_bits = Bits(entry_y, k);
-
-        if (f7_position % kEntriesPerPark == 0 && f7_position > 0) {
-            memset(P7_entry_buf, 0, P7_park_size);
-            to_write_p7.ToBytes(P7_entry_buf);
-            tmp2_disk.Write(final_file_writer_3, (P7_entry_buf), P7_park_size);
-            final_file_writer_3 += P7_park_size;
-            to_write_p7 = ParkBits();
+    uint64_t batch_start = 0;
+    do {
+        uint64_t const n = std::min(batch_entries, total_entries - batch_start);
+        for (uint64_t i = 0; i < n; ++i) {
+            uint8_t const *right_entry_buf = res.table7_sm->ReadEntry(plot_file_reader);
+            plot_file_reader += right_entry_size_bytes;
+            ys[i] = Util::SliceInt64FromBytes(right_entry_buf, 0, k);
+            new_positions[i] = Util::SliceInt64FromBytes(right_entry_buf, k, pos_size);
         }
-
-        to_write_p7 += ParkBits(entry_new_pos, k + 1);
-
-        if (f7_position % kCheckpoint1Interval == 0) {
-            entry_y_bits.ToBytes(C1_entry_buf);
-            tmp2_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
-            final_file_writer_1 += Util::ByteAlign(k) / 8;
-            if (num_C1_entries > 0) {
-                final_file_writer_2 = begin_byte_C3 + (num_C1_entries - 1) * size_C3;
-                size_t num_bytes =
-                    Encoding::ANSEncodeDeltas(deltas_to_write, kC3R, C3_entry_buf + 2) + 2;
-
-                // We need to be careful because deltas are variable sized, and they need to fit
-                assert(size_C3 * 8 > num_bytes);
-
-                // Write the size
-                Util::IntToTwoBytes(C3_entry_buf, num_bytes - 2);
-
-                tmp2_disk.Write(final_file_writer_2, (C3_entry_buf), num_bytes);
-                final_file_writer_2 += num_bytes;
-            }
-            prev_y = entry_y;
+        // with no entries at all, there's still one (empty) park
+        uint64_t const num_parks = std::max<uint64_t>(cdiv(n, kEntriesPerPark), 1);
+        uint64_t const num_blocks = cdiv(n, kCheckpoint1Interval);
+        std::shared_ptr<batch_buffers_t> const batch_buffers = buffers[current_buffers];
+        current_buffers = (current_buffers + 1) % buffers.size();
+        std::vector<uint8_t> &P7_buf = batch_buffers->P7;
+        std::vector<uint8_t> &C1_buf = batch_buffers->C1;
+        std::vector<uint8_t> &C3_buf = batch_buffers->C3;
+
+        // The first y of every C3 block is a C1 checkpoint, and every
+        // kCheckpoint2Interval'th of those a C2 checkpoint
+        for (uint64_t b = 0; b < num_blocks; ++b) {
+            uint64_t const y = ys[b * kCheckpoint1Interval];
+            uint8_t bytes[8];
+            Util::IntToEightBytes(bytes, y << (64 - k));
+            memcpy(C1_buf.data() + b * C1_size, bytes, C1_size);
+            uint64_t const f7_position = batch_start + b * kCheckpoint1Interval;
             if (f7_position % (kCheckpoint1Interval * kCheckpoint2Interval) == 0) {
-                C2.emplace_back(std::move(entry_y_bits));
+                C2.emplace_back(y, k);
             }
-            deltas_to_write.clear();
-            ++num_C1_entries;
-        } else {
-            deltas_to_write.push_back(entry_y - prev_y);
-            prev_y = entry_y;
         }
-        if (show_progress && f7_position % progress_update_increment == 0) {
-            progress(4, f7_position, res.final_entries_written);
+
+        // the blocks and parks are handed out one at a time, blocks first
+        std::atomic<uint64_t> next_item{0};
+        workers.Run([&](int const t) {
+            std::vector<uint8_t> deltas;
+            deltas.reserve(kCheckpoint1Interval);
+            for (uint64_t item = next_item++; item < num_blocks + num_parks; item = next_item++) {
+                if (item < num_blocks) {
+                    uint64_t const first = item * kCheckpoint1Interval;
+                    uint64_t const last = std::min(first + kCheckpoint1Interval, n);
+                    deltas.clear();
+                    for (uint64_t i = first + 1; i < last; ++i) {
+                        deltas.push_back(ys[i] - ys[i - 1]);
+                    }
+                    uint8_t *const dst = C3_buf.data() + item * size_C3;
+                    memset(dst, 0, size_C3);
+                    // only the last block can be a lone checkpoint
+                    if (deltas.empty()) continue;
+
+                    uint8_t *const scratch = C3_scratch[t].data();
+                    size_t const num_bytes = Encoding::ANSEncodeDeltas(
+                        deltas.data(), deltas.size(), kC3R, scratch, size_C3 + 8);
+                    // We need to be careful because deltas are variable sized, and they
+                    // need to fit. Up to 2 deltas aren't encoded at all
+                    if ((num_bytes == 0 && deltas.size() > 2) || num_bytes + 2 > size_C3) {
+                        throw InvalidStateException(
+                            "C3 block doesn't fit in " + std::to_string(size_C3) + " bytes");
+                    }
+                    // Write the size
+                    Util::IntToTwoBytes(dst, num_bytes);
+                    memcpy(dst + 2, scratch, num_bytes);
+                } else {
+                    uint64_t const park = item - num_blocks;
+                    uint64_t const first = park * kEntriesPerPark;
+                    uint64_t const last = std::min(first + kEntriesPerPark, n);
+                    // P7 parks are packed straight into P7_buf
+                    uint8_t *const dst = P7_buf.data() + park * P7_park_size;
+                    memset(dst, 0, P7_park_size);
+                    BitWriter to_write_p7(dst);
+                    for (uint64_t i = first; i < last; ++i) {
+                        to_write_p7.Append(new_positions[i], k + 1);
+                    }
+                    to_write_p7.Finish();
+                }
+            }
+        });
+
+        uint64_t const P7_begin =
+            res.final_table_begin_pointers[7] + batch_start / kEntriesPerPark * P7_park_size;
+        uint64_t const C1_begin = final_file_writer_1;
+        uint64_t const C3_begin = begin_byte_C3 + batch_start / kCheckpoint1Interval * size_C3;
+        final_file_writer_1 += num_blocks * C1_size;
+        res.plot_writer->Submit([=, &tmp2_disk] {
+            tmp2_disk.Write(P7_begin, batch_buffers->P7.data(), num_parks * P7_park_size);
+            if (num_blocks == 0) return;
+            tmp2_disk.Write(C1_begin, batch_buffers->C1.data(), num_blocks * C1_size);
+            // C3 blocks are written with their padding, up to the end of the plot
+            tmp2_disk.Write(C3_begin, batch_buffers->C3.data(), num_blocks * size_C3);
+        });
+
+        batch_start += n;
+        if (show_progress &&
+            (batch_start - n) / progress_update_increment !=
+                batch_start / progress_update_increment) {
+            progress(4, batch_start, total_entries);
         }
-    }
-    Encoding::ANSFree(kC3R);
+    } while (batch_start < total_entries);
     res.table7_sm.reset();
-
-    // Writes the final park to disk
-    memset(P7_entry_buf, 0, P7_park_size);
-    to_write_p7.ToBytes(P7_entry_buf);
-
-    tmp2_disk.Write(final_file_writer_3, (P7_entry_buf), P7_park_size);
-    final_file_writer_3 += P7_park_size;
-
-    if (!deltas_to_write.empty()) {
-        size_t num_bytes = Encoding::ANSEncodeDeltas(deltas_to_write, kC3R, C3_entry_buf + 2);
-        memset(C3_entry_buf + num_bytes + 2, 0, size_C3 - (num_bytes + 2));
-        final_file_writer_2 = begin_byte_C3 + (num_C1_entries - 1) * size_C3;
-
-        // Write the size
-        Util::IntToTwoBytes(C3_entry_buf, num_bytes);
-
-        tmp2_disk.Write(final_file_writer_2, (C3_entry_buf), size_C3);
-        final_file_writer_2 += size_C3;
-        Encoding::ANSFree(kC3R);
-    }
+    // the rest is written from this thread
+    res.plot_writer->Finish();
 
     Bits(0, Util::ByteAlign(k)).ToBytes(C1_entry_buf);
     tmp2_disk.Write(final_file_writer_1, (C1_entry_buf), Util::ByteAlign(k) / 8);
@@ -175,9 +239,7 @@ void RunPhase4(uint8_t k, uint8_t pos_size, FileDisk &tmp2_disk, Phase3Results &
     final_file_writer_1 += Util::ByteAlign(k) / 8;
     std::cout << "\tFinished writing C2 table" << std::endl;
 
-    delete[] C3_entry_buf;
     delete[] C1_entry_buf;
-    delete[] P7_entry_buf;
 
     final_file_writer_1 = res.header_size - 8 * 3;
     uint8_t table_pointer_bytes[8];
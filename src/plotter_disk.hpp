@@ -37,6 +37,7 @@
 #include "calculate_bucket.hpp"
 #include "encoding.hpp"
 #include "exceptions.hpp"
+#include "file_copy.hpp"
 #include "phase1.hpp"
 #include "phase2.hpp"
 #include "b17phase2.hpp"
@@ -46,6 +47,7 @@
 #include "b17phase4.hpp"
 #include "pos_constants.hpp"
 #include "sort_manager.hpp"
+#include "tmp_placement.hpp"
 #include "util.hpp"
 
 #define B17PHASE23
@@ -72,7 +74,14 @@ public:
         uint64_t stripe_size_input = 0,     // 创建Plot文件设置的条带深度
         uint8_t num_threads_input = 0,      // 创建Plots文件设置的现场数量
         bool nobitfield = false,            // 设置nobitfield
-        bool show_progress = false)         // 显示进度
+        bool show_progress = false,         // 显示进度
+        uint32_t ram_megabytes_input = 0,   // 可以放在内存中的临时文件大小(表1、表2和排序桶)，0表示全部写入磁盘
+        bool compress_tmp = false,          // 压缩第一阶段写入的表2-7临时文件(仅bitfield模式)
+        bool stream_to_final = false,       // 第三、四阶段直接写入最终目录中的临时文件，不使用备用临时目录
+        uint8_t copy_threads_input = 0,     // 复制最终文件的并发数，0表示默认值(4)
+        uint32_t copy_limit_megabytes = 0,  // 复制最终文件的带宽上限(MiB/s)，0表示不限制
+        std::vector<std::string> const& tmp_placement_rules = {},  // 按文件类别指定临时目录，如"buckets=/mnt/nvme"，见tmp_placement.hpp
+        bool interleaved_parks = false)     // 使用交错的多路ANS编码park(kFormatDescriptionInterleaved)，查找更快，文件略大(仅bitfield模式)
     {
         //增加打开文件的限制，我们会打开很多文件.
         // Increases the open file limit, we will open a lot of files.
@@ -195,6 +204,49 @@ public:
         std::cout << "Using " << num_buckets << " buckets" << std::endl;
         std::cout << "Using " << (int)num_threads << " threads of stripe size " << stripe_size
                   << std::endl;
+        if (ram_megabytes_input != 0) {
+            std::cout << "Keeping up to " << ram_megabytes_input << "MiB of temp files in RAM"
+                      << std::endl;
+        }
+        // 表2-7的条目都是(pos, offset)，nobitfield模式下会以不同的大小重写，所以不压缩
+        // Tables 2-7 are only ever written as (pos, offset) entries (plus f7 in
+        // table 7) with the bitfield. Without it, phase 2 rewrites them with other
+        // entry sizes, so they're not compressed.
+        if (compress_tmp && nobitfield) {
+            std::cout << "Temp file compression requires bitfield plotting, disabling it"
+                      << std::endl;
+            compress_tmp = false;
+        }
+        if (compress_tmp) {
+            std::cout << "Compressing temp tables 2-7" << std::endl;
+        }
+        if (stream_to_final) {
+            std::cout << "Writing the plot directly into " << final_dirname << std::endl;
+        }
+        // 交错park只在bitfield模式的第三阶段实现
+        if (interleaved_parks && nobitfield) {
+            std::cout << "Interleaved parks require bitfield plotting, disabling them"
+                      << std::endl;
+            interleaved_parks = false;
+        }
+        if (interleaved_parks) {
+            std::cout << "Plot format " << kFormatDescriptionInterleaved
+                      << ": park deltas in " << kParkDeltaStreams << " interleaved streams"
+                      << std::endl;
+        }
+
+        // 每类临时文件(排序桶、表文件、.2.tmp)可以放在各自的目录中
+        // Each class of temp files can be placed in a directory of its own
+        TmpPlacement placement(tmp_dirname, tmp2_dirname);
+        for (std::string const& rule : tmp_placement_rules) {
+            placement.Add(rule);
+        }
+        if (!tmp_placement_rules.empty()) {
+            for (int i = 0; i < kNumTmpFileClasses; ++i) {
+                std::cout << "Placing " << kTmpFileClassNames[i] << " in "
+                          << placement.Dir(tmp_file_t(i)) << std::endl;
+            }
+        }
 
         // 开始准备Plot绘图所用到的所有文件名：排序文件、表1-7文件、备用临时文件、最终文件临时储存文件，最终文件
 
@@ -205,12 +257,22 @@ public:
         // 表0文件将用于对磁盘空间进行排序，表1-7储存在自己的文件中
         // The table0 file will be used for sort on disk spare. tables 1-7 are stored in their own
         // file.
-        tmp_1_filenames.push_back(fs::path(tmp_dirname) / fs::path(filename + ".sort.tmp"));
+        tmp_1_filenames.push_back(
+            fs::path(placement.Dir(tmp_file_t::buckets)) / fs::path(filename + ".sort.tmp"));
         for (size_t i = 1; i <= 7; i++) {
+            tmp_file_t const c = (i == 1) ? tmp_file_t::table1
+                                 : (i == 7) ? tmp_file_t::table7
+                                            : tmp_file_t::tables;
             tmp_1_filenames.push_back(
-                fs::path(tmp_dirname) / fs::path(filename + ".table" + std::to_string(i) + ".tmp"));
+                fs::path(placement.Dir(c)) /
+                fs::path(filename + ".table" + std::to_string(i) + ".tmp"));
         }
-        fs::path tmp_2_filename = fs::path(tmp2_dirname) / fs::path(filename + ".2.tmp");
+        // 直接写入最终目录时，.2.tmp文件与最终文件在同一目录，完成后只需重命名
+        // When streaming, the .2.tmp file is staged next to the final file, so
+        // it's renamed into place below instead of copied.
+        fs::path tmp_2_filename =
+            fs::path(stream_to_final ? final_dirname : placement.Dir(tmp_file_t::tmp2)) /
+            fs::path(filename + ".2.tmp");
         fs::path final_2_filename = fs::path(final_dirname) / fs::path(filename + ".2.tmp");
         fs::path final_filename = fs::path(final_dirname) / fs::path(filename);
 
@@ -228,6 +290,12 @@ public:
             throw InvalidValueException("Final directory " + final_dirname + " does not exist");
         }
 
+        for (std::string const& dirname : placement.Dirs()) {
+            if (!fs::exists(dirname)) {
+                throw InvalidValueException("Temp directory " + dirname + " does not exist");
+            }
+        }
+
         // 判断相关文件是否已经存在，存在则进行删除
         for (fs::path& p : tmp_1_filenames) {
             fs::remove(p);
@@ -239,14 +307,47 @@ public:
         std::ios_base::sync_with_stdio(false);
         std::ostream* prevstr = std::cin.tie(NULL);
 
+        // I/O统计只覆盖本次绘图
+        DiskTrace::Reset();
+        TmpSpace::Reset();
+
         {
             // 文件操作部分
             // Scope for FileDisk
-            std::vector<FileDisk> tmp_1_disks;
-            for (auto const& fname : tmp_1_filenames)
-                tmp_1_disks.emplace_back(fname);
+
+            // 临时文件的内存预算，表1和表2最先写入、最晚读取，因此优先放入内存，剩余部分用于排序桶
+            // RAM budget for temp files. Tables 1 and 2 are the hottest (written first, read in
+            // every phase), so they claim their share up front. Sort buckets draw on what's left.
+            RamBudget ram_budget(uint64_t(ram_megabytes_input) * 1024 * 1024);
+            std::vector<CompressedDisk> tmp_1_disks;
+            for (size_t i = 0; i < tmp_1_filenames.size(); i++) {
+                // 按阶段1实际写入的条目大小预留（位域模式下表2只有pos和offset）
+                // Reserved by the size of the entries phase 1 leaves in the
+                // table, with the bitfield table 2 only holds pos and offset
+                uint64_t const table_entry_size = (nobitfield || i == 1)
+                                                      ? EntrySizes::GetMaxEntrySize(k, i, false)
+                                                      : cdiv(k + kOffsetSize, 8);
+                HybridDisk storage =
+                    (i == 1 || i == 2)
+                        ? HybridDisk(
+                              tmp_1_filenames[i],
+                              &ram_budget,
+                              ((uint64_t)1 << k) * table_entry_size)
+                        : HybridDisk(tmp_1_filenames[i]);
+                uint16_t entry_size = 0;
+                if (compress_tmp && i >= 2) {
+                    entry_size = (i == 7) ? EntrySizes::GetKeyPosOffsetSize(k)
+                                          : cdiv(k + kOffsetSize, 8);
+                }
+                tmp_1_disks.emplace_back(std::move(storage), entry_size);
+            }
 
             FileDisk tmp2_disk(tmp_2_filename);
+            // 最终文件基本是顺序写入的(表指针除外)，使用较大的缓冲区
+            // The plot is written (mostly) sequentially, park by park. A large
+            // buffer turns that into few, large writes, which matters most
+            // when the final dir is a network or spinning disk.
+            tmp2_disk.SetBufferSize(kPlotWriteBufferSize);
 
             assert(id_len == kIdLen);
 
@@ -258,11 +359,12 @@ public:
 
             Timer p1;
             Timer all_phases;
+            DiskTrace::SetPhase(1);
             std::vector<uint64_t> table_sizes = RunPhase1(
                 tmp_1_disks,
                 k,
                 id,
-                tmp_dirname,
+                placement.Dir(tmp_file_t::buckets),
                 filename,
                 memory_size,
                 num_buckets,
@@ -270,8 +372,10 @@ public:
                 stripe_size,
                 num_threads,
                 !nobitfield,
-                show_progress);
+                show_progress,
+                &ram_budget);
             p1.PrintElapsed("Time for phase 1 =");  // Time for phase 1 = 15890.430 seconds. CPU (158.890%) Sun May  2 15:21:26 2021
+            DiskTrace::SetPhase(2);
 
             uint64_t finalsize=0;
 
@@ -291,16 +395,20 @@ public:
                     table_sizes,
                     k,
                     id,
-                    tmp_dirname,
+                    placement.Dir(tmp_file_t::buckets),
                     filename,
                     memory_size,
                     num_buckets,
                     log_num_buckets,
                     show_progress);
                 p2.PrintElapsed("Time for phase 2 =");
+                DiskTrace::SetPhase(3);
 
                 // Now we open a new file, where the final contents of the plot will be stored.
                 uint32_t header_size = WriteHeader(tmp2_disk, k, id, memo, memo_len);
+                // 最终文件的大小在反向传播之后就确定了，预先分配使其在磁盘上连续存放
+                tmp2_disk.Preallocate(
+                    EntrySizes::CalculatePlotSize(k, header_size, backprop_table_sizes));
 
                 std::cout << std::endl
                       << "Starting phase 3/4: Compression without bitfield from tmp files into " << tmp_2_filename
@@ -313,7 +421,7 @@ public:
                     tmp_1_disks,
                     backprop_table_sizes,
                     id,
-                    tmp_dirname,
+                    placement.Dir(tmp_file_t::p3buckets),
                     filename,
                     header_size,
                     memory_size,
@@ -321,6 +429,7 @@ public:
                     log_num_buckets,
                     show_progress);
                 p3.PrintElapsed("Time for phase 3 =");
+                DiskTrace::SetPhase(4);
 
                 std::cout << std::endl
                       << "Starting phase 4/4: Write Checkpoint tables into " << tmp_2_filename
@@ -341,16 +450,30 @@ public:
                     table_sizes,
                     k,
                     id,
-                    tmp_dirname,
+                    placement.Dir(tmp_file_t::buckets),
                     filename,
                     memory_size,
                     num_buckets,
                     log_num_buckets,
-                    show_progress);
+                    num_threads,
+                    show_progress,
+                    &ram_budget);
                 p2.PrintElapsed("Time for phase 2 =");
+                DiskTrace::SetPhase(3);
 
                 // Now we open a new file, where the final contents of the plot will be stored.
-                uint32_t header_size = WriteHeader(tmp2_disk, k, id, memo, memo_len);
+                uint32_t header_size = WriteHeader(
+                    tmp2_disk,
+                    k,
+                    id,
+                    memo,
+                    memo_len,
+                    interleaved_parks ? kFormatDescriptionInterleaved : kFormatDescription);
+                // 最终文件的大小在反向传播之后就确定了，预先分配使其在磁盘上连续存放
+                // The size of the final file is known after backpropagation, preallocate
+                // it so it's laid out contiguously
+                tmp2_disk.Preallocate(EntrySizes::CalculatePlotSize(
+                    k, header_size, res2.table_sizes, interleaved_parks));
 
                 std::cout << std::endl
                       << "Starting phase 3/4: Compression from tmp files into " << tmp_2_filename
@@ -361,20 +484,24 @@ public:
                     tmp2_disk,
                     std::move(res2),
                     id,
-                    tmp_dirname,
+                    placement.Dir(tmp_file_t::p3buckets),
                     filename,
                     header_size,
                     memory_size,
                     num_buckets,
                     log_num_buckets,
-                    show_progress);
+                    num_threads,
+                    show_progress,
+                    &ram_budget,
+                    interleaved_parks);
                 p3.PrintElapsed("Time for phase 3 =");
+                DiskTrace::SetPhase(4);
 
                 std::cout << std::endl
                       << "Starting phase 4/4: Write Checkpoint tables into " << tmp_2_filename
                       << " ... " << Timer::GetNow();
                 Timer p4;
-                RunPhase4(k, k + 1, tmp2_disk, res, show_progress, 16);
+                RunPhase4(k, k + 1, tmp2_disk, res, num_threads, show_progress, 16);
                 p4.PrintElapsed("Time for phase 4 =");
                 finalsize = res.final_table_begin_pointers[11];
             }
@@ -396,6 +523,9 @@ public:
                       << static_cast<double>(finalsize) /
                              (1024 * 1024 * 1024)
                       << " GiB" << std::endl;
+            // 每类临时文件的峰值大小，用于规划各个磁盘的容量
+            // The peak disk usage of each class, for sizing the device it's placed on
+            TmpSpace::PrintPeaks(placement);
             all_phases.PrintElapsed("Total time =");
         }
 
@@ -406,6 +536,15 @@ public:
             fs::remove(p);
         }
 
+        // 跨文件系统时，使用多线程分块复制(可限速)，代替fs::copy
+        // Copies across file systems are done in concurrent chunks, optionally
+        // throttled, see FileCopier.
+        FileCopier::options_t copy_options;
+        if (copy_threads_input != 0) copy_options.num_threads = copy_threads_input;
+        copy_options.bytes_per_second = uint64_t(copy_limit_megabytes) * 1024 * 1024;
+        FileCopier copier(copy_options);
+
+        DiskTrace::SetPhase(5);
         bool bCopied = false;
         bool bRenamed = false;
         Timer copy;
@@ -424,8 +563,7 @@ public:
                 }
             } else {
                 if (!bCopied) {
-                    fs::copy(
-                        tmp_2_filename, final_2_filename, fs::copy_options::overwrite_existing, ec);
+                    copier.Copy(tmp_2_filename, final_2_filename, ec);
                     if (ec.value() != 0) {
                         std::cout << "Could not copy " << tmp_2_filename << " to "
                                   << final_2_filename << ". Error " << ec.message()
@@ -463,6 +601,9 @@ public:
 #endif
             }
         } while (!bRenamed);
+
+        DiskTrace::SetPhase(0);
+        DiskTrace::PrintSummary();
     }
 
 private:
@@ -472,7 +613,8 @@ private:
         uint8_t k,
         const uint8_t* id,
         const uint8_t* memo,
-        uint32_t memo_len)
+        uint32_t memo_len,
+        std::string const& format_description = kFormatDescription)
     {
         // 19 bytes  - "Proof of Space Plot" (utf-8)
         // 32 bytes  - unique plot id
@@ -495,11 +637,11 @@ private:
         write_pos += 1;
 
         uint8_t size_buffer[2];
-        Util::IntToTwoBytes(size_buffer, kFormatDescription.size());
+        Util::IntToTwoBytes(size_buffer, format_description.size());
         plot_Disk.Write(write_pos, (size_buffer), 2);
         write_pos += 2;
-        plot_Disk.Write(write_pos, (uint8_t*)kFormatDescription.data(), kFormatDescription.size());
-        write_pos += kFormatDescription.size();
+        plot_Disk.Write(write_pos, (uint8_t*)format_description.data(), format_description.size());
+        write_pos += format_description.size();
 
         Util::IntToTwoBytes(size_buffer, memo_len);
         plot_Disk.Write(write_pos, (size_buffer), 2);
@@ -513,7 +655,7 @@ private:
         write_pos += 10 * 8;
 
         uint32_t bytes_written =
-            header_text.size() + kIdLen + 1 + 2 + kFormatDescription.size() + 2 + memo_len + 10 * 8;
+            header_text.size() + kIdLen + 1 + 2 + format_description.size() + 2 + memo_len + 10 * 8;
         std::cout << "Wrote: " << bytes_written << std::endl;
         return bytes_written;
     }
@@ -48,6 +48,9 @@ const uint32_t kSpareMultiplier = 5;
 const double kMemSortProportion = 0.75;
 const double kMemSortProportionLinePoint = 0.85;
 
+// The write buffer size of the plot file. Phases 3 and 4 write it (mostly) sequentially
+const uint32_t kPlotWriteBufferSize = 4 * 1024 * 1024;
+
 // How many f7s per C1 entry, and how many C1 entries per C2 entry
 const uint32_t kCheckpoint1Interval = 10000;
 const uint32_t kCheckpoint2Interval = 10000;
@@ -82,6 +85,17 @@ const double kC3R = 1.0;
 // be incremented.
 const std::string kFormatDescription = "v1.0";
 
+// The same format, except that the deltas of the parks of tables 1-6 are
+// split round-robin into kParkDeltaStreams ANS streams, which are decoded
+// side by side. Plotting it is optional, provers read both formats.
+const std::string kFormatDescriptionInterleaved = "v1.0-ans4";
+const uint32_t kParkDeltaStreams = 4;
+
+// The deltas section of a park in kFormatDescriptionInterleaved is this much
+// larger: the streams store the number of deltas, their sizes and a final
+// state each
+const uint32_t kInterleavedDeltasOverhead = 16;
+
 struct PlotEntry {
     uint64_t y;
     uint64_t pos;
@@ -76,6 +76,10 @@ public:
         if (fmt_desc_len == kFormatDescription.size() &&
             !memcmp(header.fmt_desc, kFormatDescription.c_str(), fmt_desc_len)) {
             // OK
+        } else if (
+            fmt_desc_len == kFormatDescriptionInterleaved.size() &&
+            !memcmp(header.fmt_desc, kFormatDescriptionInterleaved.c_str(), fmt_desc_len)) {
+            this->interleaved_parks = true;
         } else {
             throw std::invalid_argument("Invalid plot file format");
         }
@@ -239,6 +243,8 @@ private:
     uint8_t* memo;
     uint8_t id[kIdLen]{};  // Unique plot id
     uint8_t k;
+    // The plot is in kFormatDescriptionInterleaved
+    bool interleaved_parks = false;
     std::vector<uint64_t> table_begin_pointers;
     std::vector<uint64_t> C2;
 
@@ -281,7 +287,8 @@ private:
     uint128_t ReadLinePoint(std::ifstream& disk_file, uint8_t table_index, uint64_t position)
     {
         uint64_t park_index = position / kEntriesPerPark;
-        uint32_t park_size_bits = EntrySizes::CalculateParkSize(k, table_index) * 8;
+        uint32_t park_size_bits =
+            EntrySizes::CalculateParkSize(k, table_index, interleaved_parks) * 8;
 
         SafeSeek(disk_file, table_begin_pointers[table_index] + (park_size_bits / 8) * park_index);
 
@@ -297,7 +304,8 @@ private:
         SafeRead(disk_file, stubs_bin, stubs_size_bits / 8);
 
         // Reads EPP deltas
-        uint32_t max_deltas_size_bits = EntrySizes::CalculateMaxDeltasSize(k, table_index) * 8;
+        uint32_t max_deltas_size_bits =
+            EntrySizes::CalculateMaxDeltasSize(k, table_index, interleaved_parks) * 8;
         auto* deltas_bin = new uint8_t[max_deltas_size_bits / 8];
 
         // Reads the size of the encoded deltas object
@@ -308,21 +316,28 @@ private:
             throw std::invalid_argument("Invalid size for deltas: " + std::to_string(encoded_deltas_size));
         }
 
-        std::vector<uint8_t> deltas;
+        // Only the first kEntriesPerPark - 1 deltas are ever used
+        uint8_t deltas[kEntriesPerPark - 1];
+        uint32_t num_deltas = 0;
 
         if (0x8000 & encoded_deltas_size) {
             // Uncompressed
             encoded_deltas_size &= 0x7fff;
-            deltas.resize(encoded_deltas_size);
-            SafeRead(disk_file, deltas.data(), encoded_deltas_size);
+            num_deltas = std::min<uint32_t>(encoded_deltas_size, kEntriesPerPark - 1);
+            SafeRead(disk_file, deltas, num_deltas);
         } else {
             // Compressed
             SafeRead(disk_file, deltas_bin, encoded_deltas_size);
 
             // Decodes the deltas
             double R = kRValues[table_index - 1];
-            deltas =
-                Encoding::ANSDecodeDeltas(deltas_bin, encoded_deltas_size, kEntriesPerPark - 1, R);
+            num_deltas = kEntriesPerPark - 1;
+            if (interleaved_parks) {
+                Encoding::ANSDecodeInterleavedDeltas(
+                    deltas_bin, encoded_deltas_size, num_deltas, R, deltas);
+            } else {
+                Encoding::ANSDecodeDeltas(deltas_bin, encoded_deltas_size, num_deltas, R, deltas);
+            }
         }
 
         uint32_t start_bit = 0;
@@ -330,7 +345,7 @@ private:
         uint64_t sum_deltas = 0;
         uint64_t sum_stubs = 0;
         for (uint32_t i = 0;
-             i < std::min((uint32_t)(position % kEntriesPerPark), (uint32_t)deltas.size());
+             i < std::min((uint32_t)(position % kEntriesPerPark), num_deltas);
              i++) {
             uint64_t stub = Util::EightBytesToInt(stubs_bin + start_bit / 8);
             stub <<= start_bit % 8;
@@ -361,8 +376,8 @@ private:
         uint16_t encoded_size,
         uint64_t c1_index) const
     {
-        std::vector<uint8_t> deltas =
-            Encoding::ANSDecodeDeltas(bit_mask, encoded_size, kCheckpoint1Interval, kC3R);
+        uint8_t deltas[kCheckpoint1Interval];
+        Encoding::ANSDecodeDeltas(bit_mask, encoded_size, kCheckpoint1Interval, kC3R, deltas);
         std::vector<uint64_t> p7_positions;
         bool surpassed_f7 = false;
         for (uint8_t delta : deltas) {
@@ -630,27 +645,34 @@ private:
         return ordered_proof;
     }
 
-    // Recursive function to go through the tables on disk, backpropagating and fetching
-    // all of the leaves (x values). For example, for depth=5, it fetches the position-th
-    // entry in table 5, reading the two back pointers from the line point, and then
-    // recursively calling GetInputs for table 4.
+    // Goes through the tables on disk, backpropagating and fetching all of the leaves (x
+    // values). For example, for depth=5, it fetches the position-th entry in table 5, reading
+    // the two back pointers from the line point, and then fetches both of those entries in
+    // table 4. A table is done at a time, so all its line points are converted at once. The
+    // leaves are in the order of a depth-first walk, y before x.
     std::vector<Bits> GetInputs(std::ifstream& disk_file, uint64_t position, uint8_t depth)
     {
-        uint128_t line_point = ReadLinePoint(disk_file, depth, position);
-        std::pair<uint64_t, uint64_t> xy = Encoding::LinePointToSquare(line_point);
-
-        if (depth == 1) {
-            // For table P1, the line point represents two concatenated x values.
-            std::vector<Bits> ret;
-            ret.emplace_back(xy.second, k);  // y
-            ret.emplace_back(xy.first, k);   // x
-            return ret;
-        } else {
-            std::vector<Bits> left = GetInputs(disk_file, xy.second, depth - 1);  // y
-            std::vector<Bits> right = GetInputs(disk_file, xy.first, depth - 1);  // x
-            left.insert(left.end(), right.begin(), right.end());
-            return left;
+        std::vector<uint64_t> positions{position};
+        std::vector<uint128_t> line_points;
+        std::vector<std::pair<uint64_t, uint64_t>> squares;
+        for (; depth >= 1; --depth) {
+            line_points.clear();
+            for (uint64_t const p : positions) {
+                line_points.push_back(ReadLinePoint(disk_file, depth, p));
+            }
+            squares.resize(line_points.size());
+            Encoding::LinePointsToSquares(line_points.data(), line_points.size(), squares.data());
+
+            positions.clear();
+            for (auto const& xy : squares) {
+                positions.push_back(xy.second);  // y
+                positions.push_back(xy.first);   // x
+            }
         }
+        // For table P1, the line point represents two concatenated x values.
+        std::vector<Bits> ret;
+        for (uint64_t const x : positions) ret.emplace_back(x, k);
+        return ret;
     }
 };
 
@@ -53,7 +53,8 @@ public:
         const std::string &filename,
         uint32_t begin_bits,
         uint64_t const stripe_size,
-        strategy_t const sort_strategy = strategy_t::uniform)
+        strategy_t const sort_strategy = strategy_t::uniform,
+        RamBudget* ram_budget = nullptr)
         : memory_size_(memory_size)
         , entry_size_(entry_size)
         , begin_bits_(begin_bits)
@@ -77,11 +78,32 @@ public:
                 fs::path(filename + ".sort_bucket_" + bucket_number_padded.str() + ".tmp");
             fs::remove(bucket_filename);
 
-            buckets_.emplace_back(
-                FileDisk(bucket_filename));
+            // bucket files are written and read back shortly after, they
+            // are kept in RAM if the budget allows
+            buckets_.emplace_back(HybridDisk(bucket_filename, ram_budget));
         }
     }
 
+    // Hints how many entries will be added in total, so that the part of the
+    // buckets that doesn't fit in RAM can be preallocated on disk
+    void Preallocate(uint64_t const num_entries)
+    {
+        uint64_t bucket_size = num_entries * entry_size_ / buckets_.size();
+        // entries are uniformly distributed, leave a little room for variance
+        bucket_size += bucket_size / 32;
+        for (auto& b : buckets_) {
+            b.underlying_file.Preallocate(bucket_size);
+        }
+    }
+
+    // Declares that the "key_bits" bits at the start of the entries (after
+    // begin_bits) are the numbers 0 to n - 1, each exactly once, for the n
+    // entries added. Within a bucket the bits below the bucket bits are then
+    // the entry's index, so buckets are sorted by copying every entry to its
+    // slot instead of comparing entries. Buckets that turn out not to be
+    // dense are sorted as usual
+    void SetDenseKeys(uint32_t const key_bits) { dense_key_bits_ = key_bits; }
+
     void AddToCache(const Bits &entry)
     {
         entry.ToBytes(entry_buf_.get());
@@ -215,9 +237,7 @@ public:
     {
         // Close and delete files in case we exit without doing the sort
         for (auto& b : buckets_) {
-            std::string const filename = b.file.GetFileName();
-            b.underlying_file.Close();
-            fs::remove(fs::path(filename));
+            b.underlying_file.Remove();
         }
     }
 
@@ -225,13 +245,13 @@ private:
 
     struct bucket_t
     {
-        bucket_t(FileDisk f) : underlying_file(std::move(f)), file(&underlying_file, 0) {}
+        bucket_t(HybridDisk f) : underlying_file(std::move(f)), file(&underlying_file, 0) {}
 
         // The amount of data written to the disk bucket
         uint64_t write_pointer = 0;
 
         // The file for the bucket
-        FileDisk underlying_file;
+        HybridDisk underlying_file;
         BufferedDisk file;
     };
 
@@ -259,6 +279,8 @@ private:
     uint64_t next_bucket_to_sort = 0;
     std::unique_ptr<uint8_t[]> entry_buf_;
     strategy_t strategy_;
+    // the width of the keys set by SetDenseKeys(), 0 if they aren't dense
+    uint32_t dense_key_bits_ = 0;
 
     void SortBucket()
     {
@@ -294,10 +316,26 @@ private:
         bool const force_quicksort = (strategy_ == strategy_t::quicksort)
             || (strategy_ == strategy_t::quicksort_last && last_bucket);
 
-        // Do SortInMemory algorithm if it fits in the memory
+        bool const placed = dense_key_bits_ > log_num_buckets_ &&
+            UniformSort::PlaceToMemory(
+                b.underlying_file,
+                0,
+                memory_start_.get(),
+                entry_size_,
+                bucket_entries,
+                begin_bits_ + log_num_buckets_,
+                dense_key_bits_ - log_num_buckets_);
+
+        // Otherwise do SortInMemory algorithm if it fits in the memory
         // (number of entries required * entry_size_) <= total memory available
-        if (!force_quicksort &&
-            Util::RoundSize(bucket_entries) * entry_size_ <= memory_size_) {
+        bool const uniform = !force_quicksort &&
+            Util::RoundSize(bucket_entries) * entry_size_ <= memory_size_;
+
+        if (placed) {
+            std::cout << "\tBucket " << bucket_i << " placed by key. Ram: " << std::fixed
+                      << std::setprecision(3) << have_ram << "GiB, need: " << qs_ram << "GiB."
+                      << std::endl;
+        } else if (uniform) {
             std::cout << "\tBucket " << bucket_i << " uniform sort. Ram: " << std::fixed
                       << std::setprecision(3) << have_ram << "GiB, u_sort min: " << u_ram
                       << "GiB, qs min: " << qs_ram << "GiB." << std::endl;
@@ -321,9 +359,7 @@ private:
         }
 
         // Deletes the bucket file
-        std::string filename = b.file.GetFileName();
-        b.underlying_file.Close();
-        fs::remove(fs::path(filename));
+        b.underlying_file.Remove();
 
         this->final_position_start = this->final_position_end;
         this->final_position_end += b.write_pointer;
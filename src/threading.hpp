@@ -18,6 +18,16 @@
 #include <semaphore.h>
 #endif
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 // TODO: in C++20, this can be replaced with std::binary_semaphore
 namespace Sem {
 #ifdef _WIN32
@@ -64,5 +74,181 @@ namespace Sem {
 
 };
 
+// A pipeline stage: runs jobs on a thread of its own, one at a time, in the
+// order they were submitted. At most max_queued jobs wait to run, Submit()
+// blocks while the queue is full. If a job throws, the exception is rethrown
+// by the next Submit() or Finish() and the jobs after it are dropped.
+class StageThread {
+public:
+    explicit StageThread(size_t const max_queued)
+        : max_queued_(std::max<size_t>(max_queued, 1)), thread_([this] { Run(); })
+    {
+    }
+
+    // Drops the jobs that haven't started yet, the running one is waited for
+    ~StageThread()
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+            stop_ = true;
+            jobs_.clear();
+        }
+        changed_.notify_all();
+        thread_.join();
+    }
+
+    void Submit(std::function<void()> job)
+    {
+        std::unique_lock<std::mutex> l(mutex_);
+        changed_.wait(l, [this] { return jobs_.size() < max_queued_ || error_; });
+        Rethrow();
+        jobs_.push_back(std::move(job));
+        changed_.notify_all();
+    }
+
+    // Waits for all jobs submitted so far to finish
+    void Finish()
+    {
+        std::unique_lock<std::mutex> l(mutex_);
+        changed_.wait(l, [this] { return (jobs_.empty() && !running_) || error_; });
+        Rethrow();
+    }
+
+private:
+    void Run()
+    {
+        std::unique_lock<std::mutex> l(mutex_);
+        while (true) {
+            changed_.wait(l, [this] { return !jobs_.empty() || stop_; });
+            if (stop_) return;
+            std::function<void()> job = std::move(jobs_.front());
+            jobs_.pop_front();
+            running_ = true;
+            l.unlock();
+            std::exception_ptr error;
+            try {
+                job();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            l.lock();
+            running_ = false;
+            if (error) {
+                error_ = error;
+                jobs_.clear();
+            }
+            changed_.notify_all();
+        }
+    }
+
+    // called with mutex_ held
+    void Rethrow()
+    {
+        if (!error_) return;
+        std::exception_ptr e = error_;
+        error_ = nullptr;
+        std::rethrow_exception(e);
+    }
+
+    size_t const max_queued_;
+    std::mutex mutex_;
+    // signals new jobs, finished jobs and stopping, to both sides
+    std::condition_variable changed_;
+    std::deque<std::function<void()>> jobs_;
+    bool running_ = false;
+    bool stop_ = false;
+    std::exception_ptr error_;
+    std::thread thread_;
+};
+
+// A fixed set of threads that run the same job in parallel, as many times as
+// needed. Run(job) calls job(t) for every t in [0, size()), job(0) on the
+// calling thread, and returns once all of them are done. The threads are only
+// started once, so this is cheap enough to do for every batch of a table. If
+// any of the calls throws, Run() rethrows the first exception. Run() must not
+// be called by several threads at once.
+class WorkerThreads {
+public:
+    explicit WorkerThreads(int const num_threads) : size_(std::max(num_threads, 1))
+    {
+        for (int t = 1; t < size_; ++t) threads_.emplace_back([this, t] { Work(t); });
+    }
+
+    ~WorkerThreads()
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+            stop_ = true;
+        }
+        start_.notify_all();
+        for (auto& t : threads_) t.join();
+    }
+
+    WorkerThreads(WorkerThreads const&) = delete;
+    WorkerThreads& operator=(WorkerThreads const&) = delete;
+
+    int size() const { return size_; }
+
+    void Run(std::function<void(int)> const& job)
+    {
+        {
+            std::lock_guard<std::mutex> l(mutex_);
+            job_ = &job;
+            running_ = size_ - 1;
+            ++generation_;
+        }
+        start_.notify_all();
+        std::exception_ptr error;
+        try {
+            job(0);
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::unique_lock<std::mutex> l(mutex_);
+        done_.wait(l, [this] { return running_ == 0; });
+        job_ = nullptr;
+        if (!error) error = error_;
+        error_ = nullptr;
+        if (error) std::rethrow_exception(error);
+    }
+
+private:
+    void Work(int const t)
+    {
+        uint64_t seen = 0;
+        std::unique_lock<std::mutex> l(mutex_);
+        while (true) {
+            start_.wait(l, [&] { return generation_ != seen || stop_; });
+            if (stop_) return;
+            seen = generation_;
+            std::function<void(int)> const& job = *job_;
+            l.unlock();
+            std::exception_ptr error;
+            try {
+                job(t);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            l.lock();
+            if (error && !error_) error_ = error;
+            if (--running_ == 0) done_.notify_one();
+        }
+    }
+
+    int const size_;
+    std::mutex mutex_;
+    // signals a new job, or stopping, to the workers
+    std::condition_variable start_;
+    // signals the last worker finishing, to Run()
+    std::condition_variable done_;
+    // the job of the current Run(), and the number of workers still on it
+    std::function<void(int)> const* job_ = nullptr;
+    int running_ = 0;
+    uint64_t generation_ = 0;
+    bool stop_ = false;
+    std::exception_ptr error_;
+    std::vector<std::thread> threads_;
+};
+
 //        std::cout << ptd->index << " waited 0" << std::endl;
 #endif  // CHIAPOS_THREADING_HPP
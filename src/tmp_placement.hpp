@@ -0,0 +1,185 @@
+// Copyright 2018 Chia Network Inc
+
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+
+//    http://www.apache.org/licenses/LICENSE-2.0
+
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef SRC_CPP_TMP_PLACEMENT_HPP_
+#define SRC_CPP_TMP_PLACEMENT_HPP_
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "exceptions.hpp"
+
+// The temp files of a plot fall into classes with very different sizes and
+// access patterns, each class can be placed in a directory of its own (i.e. on
+// a device of its own):
+//
+// * buckets:   sort buckets of phases 1 and 2 (and the .sort.tmp file), written
+//              and read back once per table, randomly spread over the buckets
+// * p3buckets: sort buckets of phase 3
+// * table1:    table 1, read in every phase
+// * tables:    tables 2-6
+// * table7:    table 7, read in every phase
+// * tmp2:      the plot file (.2.tmp) while it's being written
+//
+// Classes without a directory of their own fall back to a more general one:
+// p3buckets to buckets, table1 and table7 to tables, and those to the temp
+// directory. tmp2 falls back to the second temp directory.
+enum class tmp_file_t : int {
+    buckets,
+    p3buckets,
+    table1,
+    tables,
+    table7,
+    tmp2,
+    num_classes,
+};
+
+constexpr int kNumTmpFileClasses = static_cast<int>(tmp_file_t::num_classes);
+
+inline const char* const kTmpFileClassNames[kNumTmpFileClasses] = {
+    "buckets", "p3buckets", "table1", "tables", "table7", "tmp2"};
+
+struct TmpPlacement {
+    TmpPlacement(std::string tmp_dirname, std::string tmp2_dirname)
+        : tmp_dirname_(std::move(tmp_dirname)), tmp2_dirname_(std::move(tmp2_dirname))
+    {
+    }
+
+    void Set(tmp_file_t const c, std::string dirname) { dirs_[int(c)] = std::move(dirname); }
+
+    // Adds a rule of the form "<class>=<directory>", e.g. "buckets=/mnt/nvme"
+    void Add(std::string const& rule)
+    {
+        size_t const eq = rule.find('=');
+        if (eq == std::string::npos || eq + 1 == rule.size()) {
+            throw InvalidValueException(
+                "Invalid temp file placement \"" + rule + "\", expected <class>=<directory>");
+        }
+        std::string const name = rule.substr(0, eq);
+        for (int i = 0; i < kNumTmpFileClasses; ++i) {
+            if (name == kTmpFileClassNames[i]) {
+                dirs_[i] = rule.substr(eq + 1);
+                return;
+            }
+        }
+        throw InvalidValueException("Unknown temp file class \"" + name + "\" in " + rule);
+    }
+
+    std::string const& Dir(tmp_file_t const c) const
+    {
+        if (!dirs_[int(c)].empty()) return dirs_[int(c)];
+        switch (c) {
+            case tmp_file_t::p3buckets: return Dir(tmp_file_t::buckets);
+            case tmp_file_t::table1:
+            case tmp_file_t::table7: return Dir(tmp_file_t::tables);
+            case tmp_file_t::tmp2: return tmp2_dirname_;
+            default: return tmp_dirname_;
+        }
+    }
+
+    // All directories in use, without duplicates
+    std::vector<std::string> Dirs() const
+    {
+        std::vector<std::string> ret;
+        for (int i = 0; i < kNumTmpFileClasses; ++i) {
+            std::string const& d = Dir(tmp_file_t(i));
+            if (std::find(ret.begin(), ret.end(), d) == ret.end()) ret.push_back(d);
+        }
+        return ret;
+    }
+
+    // The class of a temp file, by its name. Returns num_classes for files
+    // that aren't temp files of a plot
+    static tmp_file_t Classify(std::string const& filename)
+    {
+        if (filename.find(".sort_bucket_") != std::string::npos) {
+            bool const phase3 = filename.find(".p3.t") != std::string::npos ||
+                                filename.find(".p3s.t") != std::string::npos;
+            return phase3 ? tmp_file_t::p3buckets : tmp_file_t::buckets;
+        }
+        if (filename.find(".table1.tmp") != std::string::npos) return tmp_file_t::table1;
+        if (filename.find(".table7.tmp") != std::string::npos) return tmp_file_t::table7;
+        if (filename.find(".table") != std::string::npos) return tmp_file_t::tables;
+        if (filename.find(".sort.tmp") != std::string::npos) return tmp_file_t::buckets;
+        if (filename.find(".2.tmp") != std::string::npos) return tmp_file_t::tmp2;
+        return tmp_file_t::num_classes;
+    }
+
+private:
+    std::string tmp_dirname_;
+    std::string tmp2_dirname_;
+    std::string dirs_[kNumTmpFileClasses];
+};
+
+// The number of bytes on disk held by each class of temp files, and the most
+// it has been since Reset(). FileDisk reports its size as it grows and
+// shrinks, so this covers everything that's actually written to disk, but not
+// the parts of files that are held in RAM. When several plots run in the same
+// process, their usage adds up.
+namespace TmpSpace {
+
+struct Usage {
+    std::atomic<uint64_t> current{0};
+    std::atomic<uint64_t> peak{0};
+
+    void Grow(uint64_t const bytes)
+    {
+        uint64_t const now = current.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        uint64_t p = peak.load(std::memory_order_relaxed);
+        while (now > p && !peak.compare_exchange_weak(p, now, std::memory_order_relaxed)) {
+        }
+    }
+
+    void Shrink(uint64_t const bytes) { current.fetch_sub(bytes, std::memory_order_relaxed); }
+};
+
+inline Usage* GetUsages()
+{
+    static Usage usages[kNumTmpFileClasses];
+    return usages;
+}
+
+// The counters for a file, or nullptr if it's not a temp file of a plot
+inline Usage* ForFile(std::string const& filename)
+{
+    tmp_file_t const c = TmpPlacement::Classify(filename);
+    return c == tmp_file_t::num_classes ? nullptr : &GetUsages()[int(c)];
+}
+
+// Restarts the peaks at the current usage
+inline void Reset()
+{
+    for (int i = 0; i < kNumTmpFileClasses; ++i) {
+        Usage& u = GetUsages()[i];
+        u.peak = u.current.load();
+    }
+}
+
+inline void PrintPeaks(TmpPlacement const& placement)
+{
+    std::cout << "Peak temp space per file class:" << std::endl;
+    for (int i = 0; i < kNumTmpFileClasses; ++i) {
+        uint64_t const peak = GetUsages()[i].peak;
+        std::cout << "  " << kTmpFileClassNames[i] << " (" << placement.Dir(tmp_file_t(i))
+                  << "): " << static_cast<double>(peak) / (1024 * 1024 * 1024) << " GiB"
+                  << std::endl;
+    }
+}
+
+}  // namespace TmpSpace
+
+#endif  // SRC_CPP_TMP_PLACEMENT_HPP_
@@ -22,7 +22,9 @@
 #include <vector>
 
 #include "./disk.hpp"
+#include "./mapped_file.hpp"
 #include "./util.hpp"
+#include "./bitfield.hpp"
 
 namespace UniformSort {
 
@@ -37,7 +39,7 @@ namespace UniformSort {
     }
 
     inline void SortToMemory(
-        FileDisk &input_disk,
+        RandomAccessDisk &input_disk,
         uint64_t const input_disk_begin,
         uint8_t *const memory,
         uint32_t const entry_len,
@@ -45,46 +47,72 @@ namespace UniformSort {
         uint32_t const bits_begin)
     {
         uint64_t const memory_len = Util::RoundSize(num_entries) * entry_len;
-        auto const swap_space = std::make_unique<uint8_t[]>(entry_len);
-        auto const buffer = std::make_unique<uint8_t[]>(BUF_SIZE);
+        // Entries that have been swapped out of "memory" (or copied from the
+        // end of the mapping) are held here. There are two, so one can be
+        // filled while the other one is still being read. All allocations need
+        // 7 bytes head-room, since SliceInt64FromBytes() may overrun by 7 bytes
+        auto const swap_space = std::make_unique<uint8_t[]>(2 * (entry_len + 7));
+        uint8_t *spare = swap_space.get();
+        uint8_t *spare2 = swap_space.get() + entry_len + 7;
         uint64_t bucket_length = 0;
         // The number of buckets needed (the smallest power of 2 greater than 2 * num_entries).
         while ((1ULL << bucket_length) < 2 * num_entries) bucket_length++;
         memset(memory, 0, memory_len);
 
+        // If the input can be mapped, entries are read from the page cache
+        // directly, otherwise they're read into a buffer, BUF_SIZE at a time
+        MappedFile mapping;
+        uint64_t const input_len = num_entries * entry_len;
+        bool const mapped =
+            input_disk.Map(input_disk_begin, input_len, mapping, MappedFile::sequential);
+        std::unique_ptr<uint8_t[]> buffer;
+        if (!mapped) buffer = std::make_unique<uint8_t[]>(BUF_SIZE + 7);
+
         uint64_t read_pos = input_disk_begin;
         uint64_t buf_size = 0;
         uint64_t buf_ptr = 0;
         uint64_t swaps = 0;
         for (uint64_t i = 0; i < num_entries; i++) {
-            if (buf_size == 0) {
-                // If read buffer is empty, read from disk and refill it.
-                buf_size = std::min((uint64_t)BUF_SIZE / entry_len, num_entries - i);
-                buf_ptr = 0;
-                input_disk.Read(read_pos, buffer.get(), buf_size * entry_len);
-                read_pos += buf_size * entry_len;
+            uint8_t const *entry;
+            if (mapped) {
+                uint64_t const offset = i * entry_len;
+                if (offset + entry_len + 7 <= input_len) {
+                    entry = mapping.data() + offset;
+                } else {
+                    // the head-room past the end of the mapping isn't ours
+                    memcpy(spare, mapping.data() + offset, entry_len);
+                    entry = spare;
+                    std::swap(spare, spare2);
+                }
+            } else {
+                if (buf_size == 0) {
+                    // If read buffer is empty, read from disk and refill it.
+                    buf_size = std::min((uint64_t)BUF_SIZE / entry_len, num_entries - i);
+                    buf_ptr = 0;
+                    input_disk.Read(read_pos, buffer.get(), buf_size * entry_len);
+                    read_pos += buf_size * entry_len;
+                }
+                buf_size--;
+                entry = buffer.get() + buf_ptr;
+                buf_ptr += entry_len;
             }
-            buf_size--;
             // First unique bits in the entry give the expected position of it in the sorted array.
             // We take 'bucket_length' bits starting with the first unique one.
-            uint64_t pos =
-                Util::ExtractNum(buffer.get() + buf_ptr, entry_len, bits_begin, bucket_length) *
-                entry_len;
+            uint64_t pos = Util::ExtractNum(entry, entry_len, bits_begin, bucket_length) * entry_len;
             // As long as position is occupied by a previous entry...
             while (!IsPositionEmpty(memory + pos, entry_len) && pos < memory_len) {
                 // ...store there the minimum between the two and continue to push the higher one.
-                if (Util::MemCmpBits(
-                        memory + pos, buffer.get() + buf_ptr, entry_len, bits_begin) > 0) {
-                    memcpy(swap_space.get(), memory + pos, entry_len);
-                    memcpy(memory + pos, buffer.get() + buf_ptr, entry_len);
-                    memcpy(buffer.get() + buf_ptr, swap_space.get(), entry_len);
+                if (Util::MemCmpBits(memory + pos, entry, entry_len, bits_begin) > 0) {
+                    memcpy(spare, memory + pos, entry_len);
+                    memcpy(memory + pos, entry, entry_len);
+                    entry = spare;
+                    std::swap(spare, spare2);
                     swaps++;
                 }
                 pos += entry_len;
             }
             // Push the entry in the first free spot.
-            memcpy(memory + pos, buffer.get() + buf_ptr, entry_len);
-            buf_ptr += entry_len;
+            memcpy(memory + pos, entry, entry_len);
         }
         uint64_t entries_written = 0;
         // Search the memory buffer for occupied entries.
@@ -104,6 +132,40 @@ namespace UniformSort {
         assert(entries_written == num_entries);
     }
 
+    // Sorts entries whose keys, the "key_bits" bits starting at "bits_begin",
+    // are the numbers 0 to num_entries - 1 in some order. No comparisons are
+    // needed, each entry is copied straight to its slot in "memory". Returns
+    // false if the keys turn out not to be like that, "memory" is garbage then
+    inline bool PlaceToMemory(
+        RandomAccessDisk &input_disk,
+        uint64_t const input_disk_begin,
+        uint8_t *const memory,
+        uint32_t const entry_len,
+        uint64_t const num_entries,
+        uint32_t const bits_begin,
+        uint32_t const key_bits)
+    {
+        // 7 bytes head-room for SliceInt64FromBytes()
+        auto const buffer = std::make_unique<uint8_t[]>(BUF_SIZE + 7);
+        bitfield placed(num_entries);
+        uint64_t read_pos = input_disk_begin;
+        for (uint64_t i = 0; i < num_entries;) {
+            uint64_t const n = std::min((uint64_t)BUF_SIZE / entry_len, num_entries - i);
+            input_disk.Read(read_pos, buffer.get(), n * entry_len);
+            read_pos += n * entry_len;
+            uint8_t const *entry = buffer.get();
+            for (uint64_t j = 0; j < n; ++j, entry += entry_len) {
+                uint64_t const slot = Util::ExtractNum(entry, entry_len, bits_begin, key_bits);
+                // out of range, or a duplicate (which leaves a slot empty)
+                if (slot >= num_entries || placed.get(slot)) return false;
+                placed.set(slot);
+                memcpy(memory + slot * entry_len, entry, entry_len);
+            }
+            i += n;
+        }
+        return true;
+    }
+
 }
 
 #endif  // SRC_CPP_UNIFORMSORT_HPP_
@@ -81,6 +81,10 @@ inline uint64_t bswap_64(uint64_t x) { return __builtin_bswap64(x); }
 #include <cpuid.h>
 #endif
 
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
+
 class Timer {
 public:
     Timer()
@@ -182,6 +186,19 @@ namespace Util {
         return bswap_16(i);
     }
 
+    inline void IntToFourBytes(uint8_t *result, const uint32_t input)
+    {
+        uint32_t r = bswap_32(input);
+        memcpy(result, &r, sizeof(r));
+    }
+
+    inline uint32_t FourBytesToInt(const uint8_t *bytes)
+    {
+        uint32_t i;
+        memcpy(&i, bytes, sizeof(i));
+        return bswap_32(i);
+    }
+
     /*
      * Converts a 64 bit int to bytes.
      */
@@ -309,8 +326,8 @@ namespace Util {
      * Like memcmp, but only compares starting at a certain bit.
      */
     inline int MemCmpBits(
-        uint8_t *left_arr,
-        uint8_t *right_arr,
+        const uint8_t *left_arr,
+        const uint8_t *right_arr,
         uint32_t len,
         uint32_t bits_begin)
     {
@@ -373,6 +390,43 @@ namespace Util {
         return __builtin_popcountl(n);
 #endif /* defined(_WIN32) ... defined(__x86_64__) */
     }
+
+    // Returns the index of the lowest set bit. n must not be 0
+    inline int CountTrailingZeros(uint64_t n)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward64(&index, n);
+        return int(index);
+#else
+        return __builtin_ctzll(n);
+#endif
+    }
+
+    // Returns the index of the n-th (counting from 0) lowest set bit of x. x
+    // must have more than n bits set
+    inline int SelectInWord(uint64_t x, int n)
+    {
+#if defined(__BMI2__)
+        return CountTrailingZeros(_pdep_u64(uint64_t(1) << n, x));
+#else
+        // popcount of each byte, then the running sum of those, so byte i of
+        // prefix holds the number of set bits in bytes 0 through i
+        uint64_t b = x - ((x >> 1) & 0x5555555555555555ULL);
+        b = (b & 0x3333333333333333ULL) + ((b >> 2) & 0x3333333333333333ULL);
+        b = (b + (b >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+        uint64_t const prefix = b * 0x0101010101010101ULL;
+
+        int byte = 0;
+        while (int((prefix >> (byte * 8)) & 0xff) <= n) ++byte;
+        if (byte > 0) n -= int((prefix >> ((byte - 1) * 8)) & 0xff);
+
+        // at most 7 more bits to clear within the byte
+        x >>= byte * 8;
+        while (n-- > 0) x &= x - 1;
+        return byte * 8 + CountTrailingZeros(x);
+#endif
+    }
 }
 
 #endif  // SRC_CPP_UTIL_HPP_
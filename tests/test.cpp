@@ -20,6 +20,7 @@
 #include "../lib/include/picosha2.hpp"
 #include "calculate_bucket.hpp"
 #include "disk.hpp"
+#include "file_copy.hpp"
 #include "plotter_disk.hpp"
 #include "prover_disk.hpp"
 #include "sort_manager.hpp"
@@ -246,6 +247,32 @@ TEST_CASE("Bits")
             REQUIRE(buf[i] == buf_2[i]);
         }
     }
+
+    SECTION("BitWriter")
+    {
+        uint32_t const num_values = 1000;
+        uint64_t values[num_values];
+        for (uint32_t i = 0; i < num_values; i++) {
+            values[i] = (uint64_t(rand()) << 40) ^ (uint64_t(rand()) << 20) ^ rand();
+        }
+        for (uint8_t const bits : {0, 1, 7, 15, 29, 32, 33, 51, 63, 64}) {
+            ParkBits expected;
+            for (uint32_t i = 0; i < num_values; i++) {
+                uint64_t const v = bits < 64 ? values[i] & ((uint64_t(1) << bits) - 1) : values[i];
+                expected += ParkBits(v, bits);
+            }
+            uint32_t const num_bytes = Util::ByteAlign(num_values * bits) / 8;
+            std::vector<uint8_t> buf(num_bytes + 1, 0);
+            std::vector<uint8_t> buf_2(num_bytes + 1, 0);
+            expected.ToBytes(buf.data());
+
+            BitWriter writer(buf_2.data());
+            writer.AppendAll(values, num_values, bits);
+            writer.Finish();
+            REQUIRE(writer.GetSize() == expected.GetSize());
+            REQUIRE(buf == buf_2);
+        }
+    }
 }
 
 bool CheckMatch(int64_t yl, int64_t yr)
@@ -331,6 +358,77 @@ TEST_CASE("Matching function")
     SECTION("Cycles") { REQUIRE(!Have4Cycles(kExtraBits, kB, kC)); }
 }
 
+// The reference implementation, one bit at a time
+std::pair<uint64_t, uint64_t> SlowLinePointToSquare(uint128_t const index)
+{
+    uint64_t x = 0;
+    for (int i = 63; i >= 0; i--) {
+        uint64_t const new_x = x + ((uint64_t)1 << i);
+        if (Encoding::GetXEnc(new_x) <= index) x = new_x;
+    }
+    return {x, uint64_t(index - Encoding::GetXEnc(x))};
+}
+
+TEST_CASE("Line points")
+{
+    SECTION("Isqrt")
+    {
+        for (uint64_t r : {uint64_t(0), uint64_t(1), uint64_t(2), uint64_t(3), uint64_t(1) << 26,
+                           (uint64_t(1) << 52) - 1, uint64_t(1) << 52, (uint64_t(1) << 53) + 1,
+                           uint64_t(3037000499), (uint64_t(1) << 63) + 12345, ~uint64_t(0)}) {
+            uint128_t const square = (uint128_t)r * r;
+            CHECK(Encoding::Isqrt(square) == r);
+            if (r > 0) CHECK(Encoding::Isqrt(square - 1) == r - 1);
+            if (r < ~uint64_t(0)) CHECK(Encoding::Isqrt(square + 2 * (uint128_t)r) == r);
+        }
+        CHECK(Encoding::Isqrt(~(uint128_t)0) == ~uint64_t(0));
+    }
+
+    SECTION("Perfect triangles")
+    {
+        // GetXEnc(x) is the first line point of x, one less is the last of x - 1
+        std::vector<uint128_t> line_points;
+        for (uint8_t bits = 1; bits <= 63; ++bits) {
+            for (int64_t d = -3; d <= 3; ++d) {
+                uint64_t const x = (uint64_t(1) << bits) + d;
+                if (x < 2) continue;
+                uint128_t const t = Encoding::GetXEnc(x);
+                for (uint128_t const lp : {t - 1, t, t + 1, t + x - 1}) {
+                    line_points.push_back(lp);
+                    REQUIRE(Encoding::LinePointToSquare(lp) == SlowLinePointToSquare(lp));
+                }
+                REQUIRE(Encoding::LinePointToSquare(t).first == x);
+                REQUIRE(Encoding::LinePointToSquare(t - 1).first == x - 1);
+            }
+        }
+        std::vector<std::pair<uint64_t, uint64_t>> squares(line_points.size());
+        Encoding::LinePointsToSquares(line_points.data(), line_points.size(), squares.data());
+        for (size_t i = 0; i < line_points.size(); ++i) {
+            REQUIRE(squares[i] == SlowLinePointToSquare(line_points[i]));
+        }
+    }
+
+    SECTION("Small and random line points")
+    {
+        std::vector<uint128_t> line_points;
+        for (uint64_t lp = 0; lp < 5000; ++lp) line_points.push_back(lp);
+        std::mt19937_64 rng(5);
+        for (int i = 0; i < 5000; ++i) {
+            uint8_t const k = 18 + i % 33;
+            uint64_t const x = rng() & ((uint64_t(1) << k) - 1);
+            uint64_t const y = rng() & ((uint64_t(1) << k) - 1);
+            line_points.push_back(Encoding::SquareToLinePoint(x, y));
+        }
+        line_points.push_back(~(uint128_t)0);
+        std::vector<std::pair<uint64_t, uint64_t>> squares(line_points.size());
+        Encoding::LinePointsToSquares(line_points.data(), line_points.size(), squares.data());
+        for (size_t i = 0; i < line_points.size(); ++i) {
+            REQUIRE(squares[i] == SlowLinePointToSquare(line_points[i]));
+            REQUIRE(Encoding::LinePointToSquare(line_points[i]) == squares[i]);
+        }
+    }
+}
+
 void VerifyFC(uint8_t t, uint8_t k, uint64_t L, uint64_t R, uint64_t y1, uint64_t y, uint64_t c)
 {
     uint8_t sizes[] = {1, 2, 4, 4, 3, 2};
@@ -345,6 +443,145 @@ void VerifyFC(uint8_t t, uint8_t k, uint64_t L, uint64_t R, uint64_t y1, uint64_
     }
 }
 
+TEST_CASE("ANS deltas")
+{
+    // the R values of the plot format use the prebuilt tables, 3.3 doesn't
+    std::vector<double> Rs(kRValues, kRValues + 6);
+    Rs.push_back(kC3R);
+    Rs.push_back(3.3);
+    for (double const R : Rs) {
+        REQUIRE((FSETables::Index(R) >= 0) == (R != 3.3));
+    }
+
+    // several threads encode and decode at once
+    std::vector<std::thread> threads;
+    std::atomic<int> mismatches{0};
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&Rs, &mismatches, t] {
+            std::mt19937 rng(t);
+            for (int iter = 0; iter < 50; ++iter) {
+                double const R = Rs[(t + iter) % Rs.size()];
+                std::vector<uint8_t> deltas(kEntriesPerPark - 1);
+                for (uint8_t& d : deltas) d = std::min<uint32_t>(rng() % 8, rng() % 8);
+                std::vector<uint8_t> out(deltas.size() * 8);
+                size_t const size = Encoding::ANSEncodeDeltas(deltas, R, out.data());
+                if (size == 0 ||
+                    Encoding::ANSDecodeDeltas(out.data(), size, deltas.size(), R) != deltas) {
+                    ++mismatches;
+                }
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    REQUIRE(mismatches == 0);
+
+    SECTION("Caller buffers")
+    {
+        std::mt19937 rng(9);
+        std::vector<uint8_t> deltas(kCheckpoint1Interval);
+        for (uint8_t& d : deltas) d = std::min<uint32_t>(rng() % 4, rng() % 4);
+        std::vector<uint8_t> expected(deltas.size() * 8);
+        size_t const size = Encoding::ANSEncodeDeltas(deltas, kC3R, expected.data());
+        REQUIRE(size > 0);
+
+        // just enough room (the encoder needs 8 bytes of slack), and one byte less
+        std::vector<uint8_t> out(size + 8);
+        REQUIRE(
+            Encoding::ANSEncodeDeltas(deltas.data(), deltas.size(), kC3R, out.data(), size + 8) ==
+            size);
+        REQUIRE(std::equal(out.begin(), out.begin() + size, expected.begin()));
+        REQUIRE(
+            Encoding::ANSEncodeDeltas(deltas.data(), deltas.size(), kC3R, out.data(), size + 7) ==
+            0);
+        Encoding::ANSEncodeDeltas(deltas.data(), deltas.size(), kC3R, out.data(), size + 8);
+
+        // decoding more deltas than there are leaves the rest 0
+        std::vector<uint8_t> decoded(deltas.size() + 10, 0xee);
+        Encoding::ANSDecodeDeltas(out.data(), size, decoded.size(), kC3R, decoded.data());
+        REQUIRE(std::equal(deltas.begin(), deltas.end(), decoded.begin()));
+        REQUIRE(std::count(decoded.begin() + deltas.size(), decoded.end(), 0) == 10);
+
+        out[size / 2] ^= 0x5a;
+        bool threw = false;
+        try {
+            Encoding::ANSDecodeDeltas(out.data(), size, deltas.size(), kC3R, decoded.data());
+            threw = !std::equal(deltas.begin(), deltas.end(), decoded.begin());
+        } catch (InvalidStateException const&) {
+            threw = true;
+        }
+        REQUIRE(threw);
+    }
+
+    SECTION("Interleaved streams")
+    {
+        std::mt19937 rng(11);
+        // every number of deltas per stream, up to full parks
+        for (size_t const n : {size_t(4), size_t(5), size_t(7), size_t(100), size_t(1000),
+                               size_t(kEntriesPerPark - 2), size_t(kEntriesPerPark - 1)}) {
+            for (double const R : {kRValues[0], kRValues[3], 3.3}) {
+                std::vector<uint8_t> deltas(n);
+                for (uint8_t& d : deltas) d = std::min<uint32_t>(rng() % 8, rng() % 8);
+                std::vector<uint8_t> out(n * 2 + 64);
+                size_t const size = Encoding::ANSEncodeInterleavedDeltas(
+                    deltas.data(), n, R, out.data(), out.size());
+                REQUIRE(size > 0);
+                std::vector<uint8_t> decoded(kEntriesPerPark - 1, 0xee);
+                REQUIRE(
+                    Encoding::ANSDecodeInterleavedDeltas(
+                        out.data(), size, decoded.size(), R, decoded.data()) == n);
+                REQUIRE(std::equal(deltas.begin(), deltas.end(), decoded.begin()));
+                REQUIRE(std::count(decoded.begin() + n, decoded.end(), 0) ==
+                        int64_t(decoded.size() - n));
+            }
+        }
+
+        std::vector<uint8_t> deltas(kEntriesPerPark - 1);
+        for (uint8_t& d : deltas) d = std::min<uint32_t>(rng() % 8, rng() % 8);
+        std::vector<uint8_t> out(deltas.size());
+        size_t const size = Encoding::ANSEncodeInterleavedDeltas(
+            deltas.data(), deltas.size(), kRValues[1], out.data(), out.size());
+        REQUIRE(size > 0);
+        // too few deltas, too little room, and deltas the table can't encode
+        REQUIRE(
+            Encoding::ANSEncodeInterleavedDeltas(deltas.data(), 3, kRValues[1], out.data(), 64) ==
+            0);
+        REQUIRE(
+            Encoding::ANSEncodeInterleavedDeltas(
+                deltas.data(), deltas.size(), kRValues[1], out.data(), size + 7) == 0);
+        FSETableInfo const info = FSETables::Get().Info(FSETables::Index(kRValues[1]));
+        REQUIRE(info.max_symbol + 1 == Encoding::CreateNormalizedCount(kRValues[1]).size());
+        std::vector<uint8_t> bad = deltas;
+        bad[17] = info.max_symbol;
+        REQUIRE(
+            Encoding::ANSEncodeInterleavedDeltas(
+                bad.data(), bad.size(), kRValues[1], out.data(), out.size()) > 0);
+        bad[17] = info.max_symbol + 1;
+        REQUIRE(
+            Encoding::ANSEncodeInterleavedDeltas(
+                bad.data(), bad.size(), kRValues[1], out.data(), out.size()) == 0);
+
+        // corrupt streams, or a corrupt header, are caught
+        std::vector<uint8_t> decoded(deltas.size());
+        for (size_t const pos : {size_t(0), size_t(3), size / 3, size - 1}) {
+            std::vector<uint8_t> corrupt(out.begin(), out.begin() + size);
+            corrupt[pos] ^= 0x5a;
+            bool threw = false;
+            try {
+                Encoding::ANSDecodeInterleavedDeltas(
+                    corrupt.data(), size, decoded.size(), kRValues[1], decoded.data());
+                threw = decoded != deltas;
+            } catch (InvalidStateException const&) {
+                threw = true;
+            }
+            REQUIRE(threw);
+        }
+        REQUIRE_THROWS_AS(
+            Encoding::ANSDecodeInterleavedDeltas(
+                out.data(), size - 1, decoded.size(), kRValues[1], decoded.data()),
+            InvalidStateException);
+    }
+}
+
 TEST_CASE("F functions")
 {
     SECTION("F1")
@@ -541,12 +778,30 @@ void PlotAndTestProofOfSpace(
     uint32_t buffer,
     uint32_t num_proofs,
     uint32_t stripe_size,
-    uint8_t num_threads)
+    uint8_t num_threads,
+    uint32_t ram_megabytes = 0,
+    bool compress_tmp = false)
 {
     DiskPlotter plotter = DiskPlotter();
     uint8_t memo[5] = {1, 2, 3, 4, 5};
     plotter.CreatePlotDisk(
-        ".", ".", ".", filename, k, memo, 5, plot_id, 32, buffer, 0, stripe_size, num_threads);
+        ".",
+        ".",
+        ".",
+        filename,
+        k,
+        memo,
+        5,
+        plot_id,
+        32,
+        buffer,
+        0,
+        stripe_size,
+        num_threads,
+        false,
+        false,
+        ram_megabytes,
+        compress_tmp);
     TestProofOfSpace(filename, iterations, k, plot_id, num_proofs);
     REQUIRE(remove(filename.c_str()) == 0);
 }
@@ -557,6 +812,72 @@ TEST_CASE("Plotting")
     {
         PlotAndTestProofOfSpace("cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2);
     }
+    SECTION("Disk plot k18 temp files in RAM")
+    {
+        PlotAndTestProofOfSpace("cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2, 40);
+    }
+    SECTION("Disk plot k18 mapped reads")
+    {
+        MappedFile::Enable();
+        PlotAndTestProofOfSpace("cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2);
+        MappedFile::Enable(false);
+    }
+    SECTION("Disk plot k18 compressed bitfields")
+    {
+        compressed_bitfield::Force();
+        PlotAndTestProofOfSpace("cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 3);
+        compressed_bitfield::Force(false);
+    }
+    SECTION("Disk plot k18 compressed temp tables")
+    {
+        PlotAndTestProofOfSpace(
+            "cpp-test-plot.dat", 100, 18, plot_id_1, 11, 95, 4000, 2, 0, true);
+    }
+    SECTION("Disk plot k18 streamed to the final dir")
+    {
+        fs::create_directory("final-test-dir");
+        DiskPlotter plotter = DiskPlotter();
+        uint8_t memo[5] = {1, 2, 3, 4, 5};
+        plotter.CreatePlotDisk(
+            ".", ".", "final-test-dir", "cpp-test-plot.dat", 18, memo, 5, plot_id_1, 32, 11, 0,
+            4000, 2, false, false, 0, false, true);
+        REQUIRE(!fs::exists("cpp-test-plot.dat.2.tmp"));
+        REQUIRE(!fs::exists("final-test-dir/cpp-test-plot.dat.2.tmp"));
+        TestProofOfSpace("final-test-dir/cpp-test-plot.dat", 100, 18, plot_id_1, 95);
+        REQUIRE(fs::remove_all("final-test-dir") == 2);
+    }
+    SECTION("Disk plot k18 with per-class temp dirs")
+    {
+        for (char const* d : {"buckets-test-dir", "tables-test-dir", "tmp2-test-dir"}) {
+            fs::create_directory(d);
+        }
+        DiskPlotter plotter = DiskPlotter();
+        uint8_t memo[5] = {1, 2, 3, 4, 5};
+        plotter.CreatePlotDisk(
+            ".", ".", ".", "cpp-test-plot.dat", 18, memo, 5, plot_id_1, 32, 11, 0, 4000, 2,
+            false, false, 0, false, false, 0, 0,
+            {"buckets=buckets-test-dir", "tables=tables-test-dir", "tmp2=tmp2-test-dir"});
+        REQUIRE(TmpSpace::GetUsages()[int(tmp_file_t::buckets)].peak > 0);
+        REQUIRE(TmpSpace::GetUsages()[int(tmp_file_t::table1)].peak > 0);
+        REQUIRE(TmpSpace::GetUsages()[int(tmp_file_t::tmp2)].peak > 0);
+        TestProofOfSpace("cpp-test-plot.dat", 100, 18, plot_id_1, 95);
+        REQUIRE(remove("cpp-test-plot.dat") == 0);
+        // all temp files are gone
+        for (char const* d : {"buckets-test-dir", "tables-test-dir", "tmp2-test-dir"}) {
+            REQUIRE(fs::remove_all(d) == 1);
+        }
+    }
+    SECTION("Disk plot k18 interleaved parks")
+    {
+        DiskPlotter plotter = DiskPlotter();
+        uint8_t memo[5] = {1, 2, 3, 4, 5};
+        plotter.CreatePlotDisk(
+            ".", ".", ".", "cpp-test-plot.dat", 18, memo, 5, plot_id_1, 32, 11, 0, 4000, 2,
+            false, false, 0, false, false, 0, 0, {}, true);
+        // the same proofs as the v1.0 plot
+        TestProofOfSpace("cpp-test-plot.dat", 100, 18, plot_id_1, 95);
+        REQUIRE(remove("cpp-test-plot.dat") == 0);
+    }
     SECTION("Disk plot k19")
     {
         PlotAndTestProofOfSpace("cpp-test-plot.dat", 100, 19, plot_id_1, 100, 71, 8192, 2);
@@ -755,6 +1076,39 @@ TEST_CASE("Sort on disk")
         }
     }
 
+    SECTION("Lazy Sort Manager dense keys")
+    {
+        // (key, payload) entries, the 20 bit keys are a permutation of
+        // 0..iters-1, except in the second round where some are duplicated
+        uint32_t const iters = 300000;
+        uint32_t const size = 8;
+        std::vector<uint64_t> keys(iters);
+        for (uint32_t i = 0; i < iters; i++) keys[i] = i;
+        std::mt19937_64 rng(17);
+        std::shuffle(keys.begin(), keys.end(), rng);
+
+        for (bool const dense : {true, false}) {
+            if (!dense) {
+                for (uint32_t i = 0; i < iters; i += 1000) keys[i] = keys[i + 1];
+            }
+            SortManager manager(1000000, 16, 4, size, ".", "test-files", 0, 1);
+            manager.SetDenseKeys(20);
+            std::vector<uint64_t> input;
+            for (uint32_t i = 0; i < iters; i++) {
+                uint64_t const entry = (keys[i] << 44) | (rng() >> 20);
+                input.push_back(entry);
+                uint8_t buf[size];
+                Util::IntToEightBytes(buf, entry);
+                manager.AddToCache(buf);
+            }
+            manager.FlushCache();
+            sort(input.begin(), input.end());
+            for (uint32_t i = 0; i < iters; i++) {
+                REQUIRE(Util::EightBytesToInt(manager.ReadEntry(i * size)) == input[i]);
+            }
+        }
+    }
+
     SECTION("Sort in Memory")
     {
         uint32_t iters = 100000;
@@ -783,6 +1137,44 @@ TEST_CASE("Sort on disk")
             REQUIRE(memcmp(buf, memory.get() + i * size, size) == 0);
         }
     }
+
+    SECTION("Sort in Memory mapped")
+    {
+        // small entries at an unaligned offset, the last ones are too close to
+        // the end of the mapping to be read in place
+        uint32_t iters = 100000;
+        uint32_t const size = 5;
+        vector<Bits> input;
+        uint32_t begin = 1001;
+        FileDisk disk("test_file.bin");
+
+        for (uint32_t i = 0; i < iters; i++) {
+            vector<unsigned char> hash_input = intToBytes(i, 4);
+            vector<unsigned char> hash(picosha2::k_digest_size);
+            picosha2::hash256(hash_input.begin(), hash_input.end(), hash.begin(), hash.end());
+            hash[0] = hash[1] = 0;
+            disk.Write(begin + i * size, hash.data(), size);
+            input.emplace_back(Bits(hash.data(), size, size * 8));
+        }
+
+        MappedFile::Enable();
+        MappedFile mapping;
+        REQUIRE(disk.Map(begin, iters * size, mapping, MappedFile::sequential));
+        REQUIRE(!disk.Map(begin, iters * size + 1, mapping, MappedFile::sequential));
+
+        const uint32_t memory_len = Util::RoundSize(iters) * size;
+        auto memory = std::make_unique<uint8_t[]>(memory_len);
+        UniformSort::SortToMemory(disk, begin, memory.get(), size, iters, 16);
+        MappedFile::Enable(false);
+
+        sort(input.begin(), input.end());
+        // ToBytes() writes whole 64 bit words
+        uint8_t buf[size + 7];
+        for (uint32_t i = 0; i < iters; i++) {
+            input[i].ToBytes(buf);
+            REQUIRE(memcmp(buf, memory.get() + i * size, size) == 0);
+        }
+    }
 }
 
 TEST_CASE("bitfield-simple")
@@ -838,6 +1230,68 @@ TEST_CASE("bitfield-count-unaligned")
     }
 }
 
+TEST_CASE("bitfield-set-atomic")
+{
+    bitfield b(4096);
+
+    // every thread sets every 4th bit, starting at its own offset, so all
+    // threads keep hitting the same words
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&b, t] {
+            for (int rep = 0; rep < 100; ++rep) {
+                for (int64_t i = t; i < 4096; i += 4) b.set_atomic(i);
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+
+    CHECK(b.count(0, 4096) == 4096);
+}
+
+TEST_CASE("bitfield-find-next-set")
+{
+    bitfield b(1024);
+    CHECK(b.find_next_set(0) == 1024);
+
+    std::set<int64_t> bits = {3, 63, 64, 200, 511, 1000, 1023};
+    for (int64_t i : bits) b.set(i);
+
+    for (int64_t i = 0; i < 1024; ++i) {
+        auto const it = bits.lower_bound(i);
+        CHECK(b.find_next_set(i) == (it == bits.end() ? 1024 : *it));
+    }
+}
+
+TEST_CASE("bitfield-select")
+{
+    bitfield b(2048);
+    std::vector<int64_t> bits;
+    std::mt19937 rng(1);
+    for (int64_t i = 0; i < 2048; ++i) {
+        if (rng() % 5 != 0) {
+            b.set(i);
+            bits.push_back(i);
+        }
+    }
+
+    for (int64_t start : {0, 1, 63, 64, 65, 700, 2047}) {
+        auto const first = std::lower_bound(bits.begin(), bits.end(), start) - bits.begin();
+        for (int64_t n = 0; first + n < int64_t(bits.size()); ++n) {
+            CHECK(b.select(start, n) == bits[first + n]);
+        }
+        CHECK(b.select(start, bits.size() - first) == 2048);
+    }
+
+    for (uint64_t x :
+         {1ULL, 0x8000000000000000ULL, ~0ULL, 0xf0f0f0f0f0f0f0f0ULL, 0x8000100000000001ULL}) {
+        int n = 0;
+        for (int i = 0; i < 64; ++i) {
+            if (x & (1ULL << i)) CHECK(Util::SelectInWord(x, n++) == i);
+        }
+    }
+}
+
 TEST_CASE("bitfield_index-simple")
 {
     bitfield b(64);
@@ -909,11 +1363,103 @@ TEST_CASE("bitfield_index edge-sizes")
     test_bitfield_size(bitfield_index::kIndexBucket + 1);
 }
 
+TEST_CASE("bitfield_index rank")
+{
+    // dense and sparse runs, so the 9-bit block counts get close to full
+    int64_t const size = 20000;
+    bitfield b(size);
+    std::mt19937_64 rng(42);
+    for (int64_t i = 0; i < size; ++i) {
+        if ((i / 3000) % 2 == 0 ? rng() % 16 != 0 : rng() % 16 == 0) b.set(i);
+    }
+    bitfield_index const idx(b);
+
+    for (int64_t i = 0; i < size; ++i) {
+        CHECK(idx.rank(i) == uint64_t(b.count(0, i)));
+    }
+}
+
+TEST_CASE("compressed_bitfield")
+{
+    // one chunk each of: empty, sparse, half full, nearly full and full, plus
+    // a short last chunk
+    int64_t const chunk = compressed_bitfield::kChunkBits;
+    int64_t const size = chunk * 5 + 1000;
+    bitfield dense(size);
+    compressed_bitfield b(size);
+    CHECK(b.size() == dense.size());
+
+    std::mt19937_64 rng(7);
+    for (int64_t i = 0; i < size; ++i) {
+        int64_t const c = i / chunk;
+        bool const set = c == 1 ? rng() % 100 == 0
+                       : c == 2 ? rng() % 2 == 0
+                       : c == 3 ? rng() % 100 != 0
+                       : c >= 4;
+        if (set) {
+            dense.set(i);
+            b.set_atomic(i);
+        }
+    }
+    uint64_t const before = b.memory_usage();
+    b.optimize();
+    CHECK(b.memory_usage() < before);
+
+    // only sparse bitfields are estimated to be smaller than dense ones
+    CHECK(compressed_bitfield::EstimateMemoryUsage(chunk * 64, chunk * 55) > chunk * 64 / 8);
+    CHECK(compressed_bitfield::EstimateMemoryUsage(chunk * 64, chunk * 64 / 100) < chunk * 64 / 8);
+
+    compressed_bitfield_index const idx(b);
+    for (int64_t i = 0; i < size; i += 7) {
+        CHECK(b.get(i) == dense.get(i));
+        CHECK(idx.rank(i) == uint64_t(dense.count(0, i)));
+    }
+    CHECK(b.count(0, size) == dense.count(0, size));
+    CHECK(b.count(chunk, chunk * 4) == dense.count(chunk, chunk * 4));
+    // ranges across several chunks, from the summed up counts of optimize()
+    // and, once a bit is set, without them
+    auto check_ranges = [&] {
+        for (int i = 0; i < 200; ++i) {
+            int64_t const begin = int64_t(rng() % size) / 64 * 64;
+            int64_t const end = begin + int64_t(rng() % (size - begin + 1));
+            if (b.count(begin, end) != dense.count(begin, end)) {
+                FAIL("count differs in [" << begin << ", " << end << ")");
+            }
+        }
+        CHECK(b.count(0, chunk * 5) == dense.count(0, chunk * 5));
+    };
+    check_ranges();
+
+    // setting bits after optimize() works with every kind of chunk
+    for (int64_t const i : {int64_t(5), chunk + 3, chunk * 3 + 11, size - 1}) {
+        b.set(i);
+        dense.set(i);
+        CHECK(b.get(i));
+    }
+    CHECK(b.count(0, size) == dense.count(0, size));
+    check_ranges();
+    b.optimize();
+    check_ranges();
+
+    bitfield const plain = b.to_bitfield(size);
+    for (int64_t i = 0; i < size; ++i) {
+        if (plain.get(i) != dense.get(i)) FAIL("to_bitfield differs at " << i);
+    }
+
+    compressed_bitfield other(size);
+    other.swap(b);
+    CHECK(b.count(0, size) == 0);
+    CHECK(other.count(0, size) == dense.count(0, size));
+    other.clear();
+    CHECK(other.count(0, size) == 0);
+    CHECK(!other.get(size - 1));
+}
+
 namespace {
 
 constexpr int num_test_entries = 2000000;
 
-void write_disk_file(FileDisk& df)
+void write_disk_file(RandomAccessDisk& df)
 {
     std::uint32_t val = 0;
     for (int i = 0; i < num_test_entries; ++i) {
@@ -943,6 +1489,93 @@ TEST_CASE("FileDisk")
     remove("test_file.bin");
 }
 
+TEST_CASE("FileDisk concurrent")
+{
+    // every thread writes (and then reads) its own interleaved slices of the
+    // same file
+    int const num_threads = 4;
+    uint32_t const slice = 1000;
+    FileDisk d("test_file.bin");
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&d, t] {
+            std::vector<uint32_t> buf(slice);
+            for (uint32_t s = t; s < num_test_entries / slice; s += num_threads) {
+                for (uint32_t i = 0; i < slice; ++i) buf[i] = s * slice + i;
+                d.Write(uint64_t(s) * slice * 4, reinterpret_cast<uint8_t*>(buf.data()), slice * 4);
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    threads.clear();
+    REQUIRE(d.GetWriteMax() == num_test_entries * 4);
+
+    std::atomic<uint32_t> mismatches{0};
+    for (int t = 0; t < num_threads; ++t) {
+        threads.emplace_back([&d, &mismatches, t] {
+            std::vector<uint32_t> buf(slice);
+            for (uint32_t s = num_threads - 1 - t; s < num_test_entries / slice;
+                 s += num_threads) {
+                d.Read(uint64_t(s) * slice * 4, reinterpret_cast<uint8_t*>(buf.data()), slice * 4);
+                for (uint32_t i = 0; i < slice; ++i) {
+                    if (buf[i] != s * slice + i) ++mismatches;
+                }
+            }
+        });
+    }
+    for (auto& t : threads) t.join();
+    REQUIRE(mismatches == 0);
+
+    remove("test_file.bin");
+}
+
+TEST_CASE("FileDisk write buffer")
+{
+    FileDisk d("test_file.bin");
+    d.SetBufferSize(4096);
+    write_disk_file(d);
+    // a write that's not adjacent, and one that's larger than the buffer
+    std::vector<uint8_t> big(10000, 0xab);
+    d.Write(8, big.data(), big.size());
+    uint32_t const v = 7;
+    d.Write(4, reinterpret_cast<uint8_t const*>(&v), 4);
+
+    std::uint32_t val = 0;
+    d.Read(4, reinterpret_cast<std::uint8_t*>(&val), 4);
+    REQUIRE(val == 7);
+    d.Read(8, reinterpret_cast<std::uint8_t*>(&val), 4);
+    REQUIRE(val == 0xabababab);
+    for (uint32_t i = 10008 / 4; i < num_test_entries; ++i) {
+        d.Read(i * 4, reinterpret_cast<std::uint8_t*>(&val), 4);
+        REQUIRE(i == val);
+    }
+    d.Close();
+    REQUIRE(fs::file_size("test_file.bin") == num_test_entries * 4);
+
+    remove("test_file.bin");
+}
+
+TEST_CASE("FileDisk preallocate")
+{
+    FileDisk d = FileDisk("test_file.bin");
+    d.Preallocate(num_test_entries * 4);
+    // the size hint doesn't change the file size
+    REQUIRE(fs::file_size("test_file.bin") == 0);
+    write_disk_file(d);
+
+    d.Truncate(num_test_entries * 2);
+    d.Preallocate(num_test_entries * 4);
+    REQUIRE(fs::file_size("test_file.bin") == num_test_entries * 2);
+
+    std::uint32_t val = 0;
+    for (uint32_t i = 0; i < num_test_entries / 2; ++i) {
+        d.Read(i * 4, reinterpret_cast<std::uint8_t*>(&val), 4);
+        REQUIRE(i == val);
+    }
+
+    remove("test_file.bin");
+}
+
 TEST_CASE("BufferedDisk")
 {
     FileDisk d = FileDisk("test_file.bin");
@@ -965,6 +1598,438 @@ TEST_CASE("BufferedDisk")
     remove("test_file.bin");
 }
 
+TEST_CASE("BufferedDisk mapped")
+{
+    FileDisk d = FileDisk("test_file.bin");
+    write_disk_file(d);
+    MappedFile::Enable();
+
+    BufferedDisk bd(&d, num_test_entries * 4);
+    uint8_t const* first = bd.Read(0, 4);
+    for (uint32_t i = 0; i < num_test_entries; ++i) {
+        uint8_t const* p = bd.Read(i * 4, 4);
+        // read in place, except for the last entries
+        if (i < num_test_entries - 2) CHECK(p == first + i * 4);
+        CHECK(i == *reinterpret_cast<std::uint32_t const*>(p));
+    }
+    MappedFile::Enable(false);
+
+    remove("test_file.bin");
+}
+
+TEST_CASE("MemoryDisk")
+{
+    SECTION("read back")
+    {
+        MemoryDisk d("test_file.bin");
+        write_disk_file(d);
+
+        std::uint32_t val = 0;
+        for (uint32_t i = 0; i < num_test_entries; ++i) {
+            d.Read(i * 4, reinterpret_cast<std::uint8_t*>(&val), 4);
+            REQUIRE(i == val);
+        }
+
+        // reads straddling chunk boundaries are stitched together
+        for (uint64_t i = MemoryDisk::kChunkSize - 6; i < MemoryDisk::kChunkSize + 6; ++i) {
+            std::uint8_t expect[8];
+            d.Read(i, expect, 8);
+            REQUIRE(memcmp(d.Read(i, 8), expect, 8) == 0);
+        }
+        REQUIRE(!fs::exists("test_file.bin"));
+    }
+
+    SECTION("budget")
+    {
+        RamBudget budget(MemoryDisk::kChunkSize * 2);
+        MemoryDisk d("test_file.bin", &budget);
+        std::uint8_t buf[16] = {};
+        d.Write(MemoryDisk::kChunkSize * 2 - 16, buf, 16);
+        REQUIRE(budget.Available() == 0);
+        REQUIRE_THROWS_AS(d.Write(MemoryDisk::kChunkSize * 2, buf, 1), InsufficientMemoryException);
+
+        d.Truncate(MemoryDisk::kChunkSize);
+        REQUIRE(budget.Available() == MemoryDisk::kChunkSize);
+        d.Truncate(0);
+        REQUIRE(budget.Available() == MemoryDisk::kChunkSize * 2);
+
+        // the unused part of the reserve is given back once the size is final
+        MemoryDisk r("test_file.bin", &budget, MemoryDisk::kChunkSize * 2);
+        REQUIRE(budget.Available() == 0);
+        r.Write(0, buf, 16);
+        REQUIRE(budget.Available() == 0);
+        r.Truncate(16);
+        REQUIRE(budget.Available() == MemoryDisk::kChunkSize);
+    }
+}
+
+TEST_CASE("HybridDisk")
+{
+    SECTION("no budget")
+    {
+        HybridDisk d("test_file.bin");
+        write_disk_file(d);
+        REQUIRE(d.GetRamSize() == 0);
+
+        std::uint32_t val = 0;
+        for (uint32_t i = 0; i < num_test_entries; ++i) {
+            d.Read(i * 4, reinterpret_cast<std::uint8_t*>(&val), 4);
+            REQUIRE(i == val);
+        }
+        d.Remove();
+        REQUIRE(!fs::exists("test_file.bin"));
+    }
+
+    SECTION("spill")
+    {
+        RamBudget budget(MemoryDisk::kChunkSize * 3);
+        HybridDisk d("test_file.bin", &budget);
+        write_disk_file(d);
+        REQUIRE(d.GetRamSize() == MemoryDisk::kChunkSize * 3);
+        REQUIRE(fs::exists("test_file.bin"));
+
+        BufferedDisk bd(&d, num_test_entries * 4);
+        for (uint32_t i = 0; i < num_test_entries; ++i) {
+            auto const val = *reinterpret_cast<std::uint32_t const*>(bd.Read(i * 4, 4));
+            CHECK(i == val);
+        }
+
+        d.Truncate(MemoryDisk::kChunkSize);
+        REQUIRE(!fs::exists("test_file.bin"));
+        REQUIRE(budget.Available() == MemoryDisk::kChunkSize * 2);
+        d.Remove();
+        REQUIRE(budget.Available() == MemoryDisk::kChunkSize * 3);
+    }
+
+    SECTION("fits in RAM")
+    {
+        RamBudget budget(num_test_entries * 8);
+        HybridDisk d("test_file.bin", &budget, num_test_entries * 4);
+        write_disk_file(d);
+        REQUIRE(!fs::exists("test_file.bin"));
+
+        std::uint32_t val = 0;
+        for (uint32_t i = num_test_entries - 1; i > 0; --i) {
+            d.Read(i * 4, reinterpret_cast<std::uint8_t*>(&val), 4);
+            CHECK(i == val);
+        }
+    }
+}
+
+TEST_CASE("CompressedDisk")
+{
+    // (pos, offset) like entries, pos increasing
+    int const entry_size = 5;
+    int const num_entries = CompressedDisk::kBlockEntries * 3 + 100;
+    std::vector<uint8_t> data(num_entries * entry_size);
+    std::mt19937 rng(1);
+    uint64_t pos = 0;
+    for (int i = 0; i < num_entries; ++i) {
+        pos += rng() % 4;
+        uint64_t const entry = (pos << 10) | (rng() % 1024);
+        for (int j = 0; j < entry_size; ++j) {
+            data[i * entry_size + j] = uint8_t(entry >> (8 * (entry_size - 1 - j)));
+        }
+    }
+
+    CompressedDisk d(HybridDisk("test_file.bin"), entry_size);
+    // written in uneven chunks, like phase 1 does
+    for (uint64_t i = 0; i < data.size(); i += 3333) {
+        d.Write(i, data.data() + i, std::min<uint64_t>(3333, data.size() - i));
+    }
+    CHECK(d.GetSize() == data.size());
+    CHECK(d.GetStoredSize() < data.size() / 2);
+
+    SECTION("forward and backward reads")
+    {
+        BufferedDisk bd(&d, data.size());
+        for (uint64_t i = 0; i < num_entries; ++i) {
+            uint8_t const* entry = bd.Read(i * entry_size, entry_size);
+            REQUIRE(memcmp(entry, &data[i * entry_size], entry_size) == 0);
+        }
+        std::vector<uint8_t> buf(entry_size);
+        for (uint64_t i = num_entries; i > 0; i -= 777) {
+            d.Read((i - 1) * entry_size, buf.data(), entry_size);
+            REQUIRE(memcmp(buf.data(), &data[(i - 1) * entry_size], entry_size) == 0);
+            if (i < 777) break;
+        }
+    }
+
+    SECTION("rewrite in place")
+    {
+        // like phase 2 does with table 7, read ahead of the write position
+        for (uint64_t i = 0; i < data.size(); ++i) data[i] ^= 0x5a;
+        std::vector<uint8_t> buf(4096);
+        for (uint64_t i = 0; i < data.size(); i += buf.size()) {
+            uint64_t const n = std::min<uint64_t>(buf.size(), data.size() - i);
+            d.Read(i, buf.data(), n);
+            for (uint64_t j = 0; j < n; ++j) buf[j] ^= 0x5a;
+            d.Write(i, buf.data(), n);
+        }
+        std::vector<uint8_t> back(data.size());
+        d.Read(0, back.data(), back.size());
+        REQUIRE(back == data);
+    }
+
+    SECTION("truncate")
+    {
+        uint64_t const new_size = (CompressedDisk::kBlockEntries + 10) * entry_size;
+        d.Truncate(new_size);
+        CHECK(d.GetSize() == new_size);
+        std::vector<uint8_t> back(new_size + entry_size);
+        d.Read(0, back.data(), back.size());
+        REQUIRE(memcmp(back.data(), data.data(), new_size) == 0);
+        // past the end reads back as zeros
+        for (int j = 0; j < entry_size; ++j) REQUIRE(back[new_size + j] == 0);
+
+        d.Truncate(0);
+        CHECK(d.GetStoredSize() == 0);
+    }
+
+    remove("test_file.bin");
+}
+
+TEST_CASE("DiskTrace")
+{
+    DiskTrace::EnableLog("test_disk.log");
+    DiskTrace::Reset();
+    DiskTrace::SetPhase(2);
+    {
+        FileDisk d = FileDisk("test_file.bin.table1.tmp");
+        write_disk_file(d);
+        std::uint32_t val = 0;
+        d.Read(40, reinterpret_cast<std::uint8_t*>(&val), 4);
+        REQUIRE(val == 10);
+    }
+    DiskTrace::FileStats* f = DiskTrace::GetFile("test_file.bin.table1.tmp");
+    CHECK(f->file_class == DiskTrace::table_file);
+    CHECK(f->ops[int(DiskTrace::op_t::write)] == num_test_entries);
+    CHECK(f->bytes[int(DiskTrace::op_t::write)] == num_test_entries * 4);
+    CHECK(f->ops[int(DiskTrace::op_t::read)] == 1);
+    CHECK(DiskTrace::GetState().phase_ops[2][int(DiskTrace::op_t::write)] == num_test_entries);
+
+    // a closed sort bucket is only counted in the totals of its class
+    {
+        FileDisk d = FileDisk("test_file.bin.sort_bucket_000.tmp");
+        write_disk_file(d);
+    }
+    CHECK(DiskTrace::GetState().file_index.count("test_file.bin.sort_bucket_000.tmp") == 0);
+    CHECK(DiskTrace::GetState().closed_files[DiskTrace::sort_bucket_file] == 1);
+
+    std::stringstream summary;
+    DiskTrace::PrintSummary(summary);
+    CHECK(summary.str().find("test_file.bin.table1.tmp") != std::string::npos);
+    CHECK(summary.str().find("sort buckets (1 closed files)") != std::string::npos);
+    CHECK(summary.str().find("tables write") != std::string::npos);
+
+    // every operation made it to the log
+    std::ifstream log("test_disk.log");
+    std::string line;
+    int records = 0;
+    int names = 0;
+    while (std::getline(log, line)) {
+        if (line[0] != '#') ++records;
+        else ++names;
+    }
+    CHECK(records == 2 * num_test_entries + 1);
+    CHECK(names == 2);
+
+    // closed files are gone after a reset
+    DiskTrace::EnableStats(false);
+    DiskTrace::Reset();
+    CHECK(DiskTrace::GetState().file_index.count("test_file.bin.table1.tmp") == 0);
+    remove("test_disk.log");
+    remove("test_file.bin.table1.tmp");
+    remove("test_file.bin.sort_bucket_000.tmp");
+}
+
+TEST_CASE("StageThread")
+{
+    SECTION("Runs jobs in order")
+    {
+        std::vector<int> done;
+        StageThread stage(2);
+        for (int i = 0; i < 100; ++i) {
+            stage.Submit([&done, i] {
+                std::this_thread::sleep_for(std::chrono::microseconds(10));
+                done.push_back(i);
+            });
+        }
+        stage.Finish();
+        REQUIRE(done.size() == 100);
+        for (int i = 0; i < 100; ++i) REQUIRE(done[i] == i);
+    }
+
+    SECTION("Rethrows errors")
+    {
+        int runs = 0;
+        StageThread stage(1);
+        stage.Submit([] { throw InvalidStateException("stage"); });
+        REQUIRE_THROWS_AS(stage.Finish(), InvalidStateException);
+        // the error is only reported once, the stage is usable again
+        stage.Submit([&runs] { ++runs; });
+        stage.Finish();
+        REQUIRE(runs == 1);
+    }
+}
+
+TEST_CASE("WorkerThreads")
+{
+    SECTION("Runs every job on all threads")
+    {
+        WorkerThreads workers(4);
+        REQUIRE(workers.size() == 4);
+        std::vector<int> runs(4);
+        for (int i = 0; i < 1000; ++i) {
+            workers.Run([&runs](int const t) { ++runs[t]; });
+        }
+        for (int t = 0; t < 4; ++t) REQUIRE(runs[t] == 1000);
+    }
+
+    SECTION("Rethrows errors")
+    {
+        WorkerThreads workers(3);
+        REQUIRE_THROWS_AS(
+            workers.Run([](int const t) {
+                if (t == 2) throw InvalidStateException("worker");
+            }),
+            InvalidStateException);
+        // the workers are still usable
+        std::atomic<int> runs{0};
+        workers.Run([&runs](int) { ++runs; });
+        REQUIRE(runs == 3);
+    }
+}
+
+TEST_CASE("FileCopier")
+{
+    // three full chunks and a tail that's not a whole page
+    uint64_t const chunk_size = 64 * 1024;
+    std::vector<uint8_t> data(3 * chunk_size + 1234);
+    for (size_t i = 0; i < data.size(); ++i) data[i] = uint8_t(i * 7 + (i >> 11));
+    {
+        FileDisk d("test_file.bin");
+        d.Write(0, data.data(), data.size());
+    }
+
+    auto const check_copy = [&] {
+        REQUIRE(fs::file_size("test_copy.bin") == data.size());
+        // (FileDisk would truncate it)
+        std::ifstream copy("test_copy.bin", std::ios::binary);
+        std::vector<uint8_t> buf(data.size());
+        copy.read(reinterpret_cast<char*>(buf.data()), buf.size());
+        REQUIRE(buf == data);
+    };
+
+    FileCopier::options_t options;
+    options.num_threads = 3;
+    options.chunk_size = chunk_size;
+    options.report_interval = 0;
+    std::error_code ec;
+
+    SECTION("fastest method")
+    {
+        FileCopier(options).Copy("test_file.bin", "test_copy.bin", ec);
+        REQUIRE(!ec);
+        check_copy();
+    }
+    SECTION("read/write")
+    {
+        options.read_write_only = true;
+        FileCopier(options).Copy("test_file.bin", "test_copy.bin", ec);
+        REQUIRE(!ec);
+        check_copy();
+    }
+    SECTION("overwrite a larger file")
+    {
+        {
+            std::vector<uint8_t> const junk(data.size() * 2, 0xff);
+            FileDisk d("test_copy.bin");
+            d.Write(0, junk.data(), junk.size());
+        }
+        FileCopier(options).Copy("test_file.bin", "test_copy.bin", ec);
+        REQUIRE(!ec);
+        check_copy();
+    }
+    SECTION("bandwidth limit")
+    {
+        options.bytes_per_second = 1024 * 1024;
+        auto const start = std::chrono::steady_clock::now();
+        FileCopier(options).Copy("test_file.bin", "test_copy.bin", ec);
+        REQUIRE(!ec);
+        REQUIRE(std::chrono::steady_clock::now() - start >= 150ms);
+        check_copy();
+    }
+    SECTION("missing source")
+    {
+        FileCopier(options).Copy("no_such_file.bin", "test_copy.bin", ec);
+        REQUIRE(ec);
+        REQUIRE(!fs::exists("test_copy.bin"));
+    }
+
+    remove("test_file.bin");
+    remove("test_copy.bin");
+}
+
+TEST_CASE("TmpPlacement")
+{
+    TmpPlacement placement("tmp", "tmp2");
+    SECTION("fallbacks")
+    {
+        REQUIRE(placement.Dir(tmp_file_t::p3buckets) == "tmp");
+        REQUIRE(placement.Dir(tmp_file_t::table7) == "tmp");
+        REQUIRE(placement.Dir(tmp_file_t::tmp2) == "tmp2");
+        placement.Add("buckets=/nvme");
+        placement.Add("tables=/ssd");
+        placement.Add("table7=/hdd");
+        REQUIRE(placement.Dir(tmp_file_t::buckets) == "/nvme");
+        REQUIRE(placement.Dir(tmp_file_t::p3buckets) == "/nvme");
+        REQUIRE(placement.Dir(tmp_file_t::table1) == "/ssd");
+        REQUIRE(placement.Dir(tmp_file_t::tables) == "/ssd");
+        REQUIRE(placement.Dir(tmp_file_t::table7) == "/hdd");
+        REQUIRE(placement.Dirs() == std::vector<std::string>{"/nvme", "/ssd", "/hdd", "tmp2"});
+    }
+    SECTION("invalid rules")
+    {
+        REQUIRE_THROWS_AS(placement.Add("buckets"), InvalidValueException);
+        REQUIRE_THROWS_AS(placement.Add("buckets="), InvalidValueException);
+        REQUIRE_THROWS_AS(placement.Add("table2=/ssd"), InvalidValueException);
+    }
+    SECTION("classify")
+    {
+        REQUIRE(
+            TmpPlacement::Classify("d/p.plot.p1.t2.sort_bucket_001.tmp") == tmp_file_t::buckets);
+        REQUIRE(
+            TmpPlacement::Classify("d/p.plot.p3s.t4.sort_bucket_012.tmp") ==
+            tmp_file_t::p3buckets);
+        REQUIRE(TmpPlacement::Classify("d/p.plot.table1.tmp") == tmp_file_t::table1);
+        REQUIRE(TmpPlacement::Classify("d/p.plot.table4.tmp") == tmp_file_t::tables);
+        REQUIRE(TmpPlacement::Classify("d/p.plot.table7.tmp") == tmp_file_t::table7);
+        REQUIRE(TmpPlacement::Classify("d/p.plot.sort.tmp") == tmp_file_t::buckets);
+        REQUIRE(TmpPlacement::Classify("d/p.plot.2.tmp") == tmp_file_t::tmp2);
+        REQUIRE(TmpPlacement::Classify("d/p.plot") == tmp_file_t::num_classes);
+    }
+    SECTION("peak size")
+    {
+        TmpSpace::Usage& usage = TmpSpace::GetUsages()[int(tmp_file_t::tables)];
+        uint64_t const before = usage.current;
+        TmpSpace::Reset();
+        {
+            FileDisk d("test_file.table3.tmp");
+            std::vector<uint8_t> const buf(1000);
+            d.Write(0, buf.data(), buf.size());
+            d.Write(500, buf.data(), buf.size());
+            REQUIRE(usage.current == before + 1500);
+            d.Truncate(200);
+            REQUIRE(usage.current == before + 200);
+            FileDisk moved(std::move(d));
+        }
+        REQUIRE(usage.current == before);
+        REQUIRE(usage.peak == before + 1500);
+        remove("test_file.table3.tmp");
+    }
+}
+
 TEST_CASE("FilteredDisk")
 {
     FileDisk d = FileDisk("test_file.bin");
@@ -13,7 +13,8 @@ for l in f:
 		filenames[int(filenum)] = filename
 		continue
 
-	time, offset, end, rw, f = l.split('\t')
+	# the 6th column (latency in microseconds) is optional
+	time, offset, end, rw, f = l.split('\t')[:5]
 
 	size = int(end) - int(offset)
 